@@ -1,101 +1,195 @@
 #include "aio_write_test.h"
 
+typedef struct global_data global_data_t;
+
+/* One in-flight write: its control block, and which write it is */
 typedef struct {
+  struct aiocb       control_block;
+  unsigned long      io_number;
+  bool               in_flight;
+  global_data_t     *global_info;
+} aio_slot_t;
+
+struct global_data {
   pthread_mutex_t    mutex;
   pthread_cond_t     condvar;
-  struct aiocb      *control_blocks;
+  enum aio_completion completion;
+  /* The pool of control blocks, and the ones free for the next writes.
+   * Completed writes return their slots here (under the mutex). */
+  aio_slot_t        *slots;
+  aio_slot_t       **free_slots;
+  long               queue_depth;
+  long               free_count;
+  bool               main_waiting;
   /* the semantics here can be odd:
    * - If O_SYNC/O_DSYNC set on file descriptor, this means the I/O made it to
    *   stable storage
    * - If the above not set, this just means the I/O has been handed off to the
    *   kernel, no more
    */
-  long               max_aios;
-  long               ios_completed_per_batch;
   long               total_ios_completed;
   long               total_ios_needed;
+  long               failed;
+  unsigned long long *submit_time;
+  io_latency_t       complete_latency;
   sigset_t           set;
-} global_data_t;
+};
 
-typedef struct {
-  global_data_t  *global_info;
-  struct aiocb   *cblock;
-} per_io_data_t;
+static void  complete_io(aio_slot_t *slot);
+static void  thread_notify(union sigval value);
+static void  reap_completions(global_data_t *global_data);
+static char *completion_name(enum aio_completion completion);
 
-void aio_write_test(int fd, long long filesize, long long blocksize,
-                    char *buffers, int buffer_count)
+void aio_write_test(int fd, long long base_offset, long long filesize,
+                    long long blocksize, char *buffers, int buffer_count,
+                    unsigned int seed, int queue_depth,
+                    enum aio_completion completion)
 {
   int                lock_status;
   unsigned long      iterations = filesize / blocksize;
   long               buffer_number;
-  char              *buffer;
   struct aiocb      *control_block;
+  aio_slot_t        *slot;
+  aio_slot_t       **batch;
+  long               batch_count;
   sigset_t           set;
   pthread_t          tid;
   long               max_aios;
   global_data_t      central_global_data;
+  unsigned long long start;
+  unsigned long long t0;
+  unsigned long long elapsed;
+  io_latency_t       submit_latency;
+
+  max_aios = sysconf(_SC_AIO_MAX);
+  if (max_aios == -1) {
+    /* it's undefined, so select a sane default */
+    max_aios = 512;
+  }
+  printf("Max outstanding AIO I/Os: [%ld]\n",max_aios);
+  if (queue_depth > max_aios) {
+    printf("Queue depth %d limited to %ld\n", queue_depth, max_aios);
+    queue_depth = max_aios;
+  }
+  printf("ITERATIONS: %lu, QUEUE DEPTH: %d, COMPLETION: %s\n", iterations,
+         queue_depth, completion_name(completion));
 
   /* Initialize mutex and condition variable
    * WARNING: this is a one time initialization - attempting twice will cause an
    *          error */
   pthread_mutex_init(&central_global_data.mutex,NULL);
   pthread_cond_init(&central_global_data.condvar,NULL);
-  central_global_data.ios_completed_per_batch = 0; /* initialize to 0 */
-  central_global_data.total_ios_completed     = 0; /* initialize to 0 */
-  central_global_data.total_ios_needed = iterations;
+  central_global_data.completion          = completion;
+  central_global_data.total_ios_completed = 0; /* initialize to 0 */
+  central_global_data.total_ios_needed    = iterations;
+  central_global_data.failed              = 0;
+  central_global_data.main_waiting        = false;
 
-  max_aios = sysconf(_SC_AIO_MAX);
-  if (max_aios == -1) {
-    /* it's undefined, so select a sane default */
-    max_aios = 512;
+  /* A fixed pool of control blocks, reused as their writes complete, so
+   * queue_depth writes stay in flight */
+  central_global_data.slots       = calloc(queue_depth, sizeof(aio_slot_t));
+  central_global_data.free_slots  = malloc(queue_depth * sizeof(aio_slot_t *));
+  batch                           = malloc(queue_depth * sizeof(aio_slot_t *));
+  central_global_data.submit_time = malloc(iterations *
+                                           sizeof(unsigned long long));
+  if (central_global_data.slots == NULL ||
+      central_global_data.free_slots == NULL || batch == NULL ||
+      central_global_data.submit_time == NULL) {
+    perror("Unable to allocate control blocks");
+    exit(1);
   }
-  printf("Max outstanding AIO I/Os: [%ld]\n",max_aios);
+  for (int i = 0; i < queue_depth; i++) {
+    central_global_data.slots[i].global_info = &central_global_data;
+    central_global_data.free_slots[i] = &central_global_data.slots[i];
+  }
+  central_global_data.queue_depth = queue_depth;
+  central_global_data.free_count  = queue_depth;
+  io_latency_init(&central_global_data.complete_latency, iterations);
+  io_latency_init(&submit_latency, iterations);
 
-  /* don't know how long to make the array until you determine max_aios */
-  struct aiocb      *control_blocks[max_aios];
-
-  /* Use the same signal set to:
-   * A. Disable reception of MYSIG_AIO_COMPLETE/MYSIG_STOP in the main thread
-   * B. Enable reception of the same signals in the child thread via sigwaitinfo */
-  sigemptyset(&set);
-  sigaddset(&set,MYSIG_AIO_COMPLETE);
-  sigaddset(&set,MYSIG_STOP);
-  pthread_sigmask(SIG_BLOCK, &set, NULL);
-  /* squirrel awway the signal set to be used with sigwaitinfo() in the child
-   * thread */
-  central_global_data.set      = set;
-  /* Note when the signal handling thread can exit - when all I/Os have been
-   * completed. */
-  central_global_data.max_aios = max_aios;
-
-  /* Start the I/O completion handling thread */
-  pthread_create(&tid,NULL,sig_thread,&central_global_data);
-
-  srand(time(NULL));
-
-  /* Initialize list of aiocb structures */
-  /* for now, causes a segfault
-  for (int i = 0; i < max_aios; i++) {
-    control_blocks[i] = (struct aiocb *)malloc(sizeof(struct aiocb));
+  if (completion == Completion_signal) {
+    /* Use the same signal set to:
+     * A. Disable reception of MYSIG_AIO_COMPLETE/MYSIG_STOP in the main thread
+     * B. Enable reception of the same signals in the child thread via
+     *    sigwaitinfo */
+    sigemptyset(&set);
+    sigaddset(&set,MYSIG_AIO_COMPLETE);
+    sigaddset(&set,MYSIG_STOP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    /* squirrel awway the signal set to be used with sigwaitinfo() in the
+     * child thread */
+    central_global_data.set      = set;
+
+    /* Start the I/O completion handling thread */
+    pthread_create(&tid,NULL,sig_thread,&central_global_data);
   }
-  */
 
-  for (int i = 0; i < iterations; i += max_aios) {
-    for (int j = 0; j < max_aios; j++) {
+  start = nsecs_now();
+  for (unsigned long i = 0; i < iterations; ) {
+    /* With aio_suspend or polling, this thread reaps its own completions */
+    if (completion == Completion_suspend || completion == Completion_poll) {
+      while (central_global_data.free_count == 0) {
+        reap_completions(&central_global_data);
+      }
+    }
+
+    /* Take every free control block; wait for a completion if there are
+     * none */
+    lock_status = pthread_mutex_lock(&central_global_data.mutex);
+    if (lock_status != 0) {
+      perror("Unable to do initial mutex lock");
+      exit(1);
+    }
+    while (central_global_data.free_count == 0) {
+      central_global_data.main_waiting = true;
+      lock_status = pthread_cond_wait(&central_global_data.condvar,
+                                      &central_global_data.mutex);
+      if (lock_status != 0) {
+        perror("Condition wait failed");
+        exit(2);
+      }
+    }
+    central_global_data.main_waiting = false;
+    batch_count = 0;
+    while (central_global_data.free_count > 0 &&
+           i + batch_count < iterations) {
+      batch[batch_count++] =
+        central_global_data.free_slots[--central_global_data.free_count];
+    }
+    lock_status = pthread_mutex_unlock(&central_global_data.mutex);
+    if (lock_status != 0) {
+      perror("Unable to do final mutex unlock");
+      exit(1);
+    }
+
+    /* Refill them */
+    for (long j = 0; j < batch_count; j++, i++) {
 
       /* buffer_number                         = random_at_most(BUFFERS - 1); */
-      buffer_number                            = ( rand() % buffer_count );
+      buffer_number                            = ( rand_r(&seed) % buffer_count );
 
-      /* control_block                            = control_blocks[j]; */
-      control_block                            = (struct aiocb *)malloc(sizeof(struct aiocb));
+      slot                                     = batch[j];
+      slot->io_number                          = i;
+      slot->in_flight                          = true;
+      control_block                            = &slot->control_block;
+      memset(control_block, 0, sizeof(*control_block));
 
       control_block->aio_fildes                = fd;
-      control_block->aio_offset                = 0;
-      /* Don't bother signal notification per aiocb, just get one signal when
-       * they're all done */
-      control_block->aio_sigevent.sigev_notify           = SIGEV_SIGNAL;
-      control_block->aio_sigevent.sigev_signo            = MYSIG_AIO_COMPLETE;
-      control_block->aio_sigevent.sigev_value.sival_ptr  = control_block;
+      control_block->aio_offset                = base_offset + i * blocksize;
+      control_block->aio_sigevent.sigev_value.sival_ptr  = slot;
+      if (completion == Completion_signal) {
+        /* Signal per aiocb; the completion thread hands the slot back */
+        control_block->aio_sigevent.sigev_notify         = SIGEV_SIGNAL;
+        control_block->aio_sigevent.sigev_signo          = MYSIG_AIO_COMPLETE;
+      } else if (completion == Completion_thread) {
+        /* The AIO implementation calls thread_notify() in a thread of its
+         * own */
+        control_block->aio_sigevent.sigev_notify            = SIGEV_THREAD;
+        control_block->aio_sigevent.sigev_notify_function   = thread_notify;
+        control_block->aio_sigevent.sigev_notify_attributes = NULL;
+      } else {
+        control_block->aio_sigevent.sigev_notify         = SIGEV_NONE;
+      }
       control_block->aio_nbytes                          = blocksize;
       control_block->aio_buf                             = buffers +
                                                            (buffer_number *
@@ -103,100 +197,168 @@ void aio_write_test(int fd, long long filesize, long long blocksize,
       control_block->aio_reqprio                         = 0;
 
       /* Check individual I/O submission (not completion) status here */
+      t0 = nsecs_now();
+      central_global_data.submit_time[i] = t0;
       int ret = aio_write(control_block);
+      io_latency_record(&submit_latency, nsecs_now() - t0);
       if (ret != 0) {
         perror("aio_write() initiation FAILED");
-        /* return(1); */
+        exit(1);
       }
-
     }
+  }
 
-
-    /* Wait for I/O completion handling thread to assert the condition
-     * variable to continue on */
-    lock_status = pthread_mutex_lock(&central_global_data.mutex);
-    if (lock_status != 0) {
-      perror("Unable to do initial mutex lock");
-      exit(1);
+  /* Wait for the last writes */
+  if (completion == Completion_signal) {
+    /* Join with the I/O handling thread when we're done */
+    pthread_join(tid,NULL);
+  } else if (completion == Completion_thread) {
+    pthread_mutex_lock(&central_global_data.mutex);
+    while (central_global_data.total_ios_completed <
+           central_global_data.total_ios_needed) {
+      central_global_data.main_waiting = true;
+      pthread_cond_wait(&central_global_data.condvar,
+                        &central_global_data.mutex);
     }
-    while (central_global_data.total_ios_completed %
-           central_global_data.max_aios == 0) {
-      lock_status = pthread_cond_wait(&central_global_data.condvar,
-                                      &central_global_data.mutex);
-      if (lock_status != 0) {
-        perror("Condition wait failed");
-        exit(2);
-      }
+    pthread_mutex_unlock(&central_global_data.mutex);
+  } else {
+    while (central_global_data.total_ios_completed <
+           central_global_data.total_ios_needed) {
+      reap_completions(&central_global_data);
     }
+  }
+  elapsed = nsecs_now() - start;
 
-    if (central_global_data.total_ios_completed %
-        central_global_data.max_aios == 0)
-      printf("I/O batch condition signaled\n");
+  printf("%ld writes (%ld failed or short) in %.3f seconds: %.1f IOPS, "
+         "%.1f MB/s\n",
+         central_global_data.total_ios_completed, central_global_data.failed,
+         elapsed / 1e9,
+         central_global_data.total_ios_completed / (elapsed / 1e9),
+         central_global_data.total_ios_completed * blocksize /
+         (elapsed / 1e9) / (1024 * 1024));
 
-    lock_status = pthread_mutex_unlock(&central_global_data.mutex);
+  io_latency_print(&submit_latency, "Submit");
+  io_latency_print(&central_global_data.complete_latency, "Complete");
+
+  io_latency_free(&submit_latency);
+  io_latency_free(&central_global_data.complete_latency);
+  free(central_global_data.slots);
+  free(central_global_data.free_slots);
+  free(batch);
+  free(central_global_data.submit_time);
+  pthread_mutex_destroy(&central_global_data.mutex);
+  pthread_cond_destroy(&central_global_data.condvar);
+}
+
+/* Finish a write whose status is in, and hand its control block back for the
+ * next one.  Called by whichever thread the completion mode reaps in. */
+static void complete_io(aio_slot_t *slot)
+{
+  int                 lock_status;
+  global_data_t      *global_data = slot->global_info;
+  unsigned long long  now = nsecs_now();
+  /* aio_error() first: once aio_return() has been called the control block's
+   * status is gone, and asking for it again is undefined */
+  int                 my_error = aio_error(&slot->control_block);
+  ssize_t             my_status = aio_return(&slot->control_block);
+
+  if (my_error != 0 || my_status < 0) {
+    /* There's a problem, we need to avoid incrementing anything now */
+    errno = my_error;
+    perror("aio failed");
+    exit(9);
+  }
+
+  lock_status = pthread_mutex_lock(&(global_data->mutex));
+  if (lock_status != 0) {
+    perror("Unable to lock total_ios_completed");
+    exit(3);
+  }
+  if ((size_t)my_status != slot->control_block.aio_nbytes) {
+    global_data->failed++;
+  }
+  io_latency_record(&global_data->complete_latency,
+                    now - global_data->submit_time[slot->io_number]);
+  slot->in_flight = false;
+  global_data->total_ios_completed++;
+  global_data->free_slots[global_data->free_count++] = slot;
+  if (global_data->main_waiting) {
+    lock_status = pthread_cond_signal(&(global_data->condvar));
     if (lock_status != 0) {
-      perror("Unable to do final mutex unlock");
-      exit(1);
+      perror("Unable to signal an INTERIM condition");
+      exit(8);
     }
+  }
+  lock_status = pthread_mutex_unlock(&(global_data->mutex));
+  if (lock_status != 0) {
+    perror("Unable to UNLOCK total_ios_completed");
+    exit(4);
+  }
+}
+
+/* SIGEV_THREAD notification */
+static void thread_notify(union sigval value)
+{
+  complete_io((aio_slot_t *)value.sival_ptr);
+}
+
+/* Wait until at least one write in flight has finished, with aio_suspend()
+ * or by polling aio_error(), and complete every one that has */
+static void reap_completions(global_data_t *global_data)
+{
+  const struct aiocb *in_flight[global_data->queue_depth];
+  long                reaped = 0;
 
-    /* clear control_blocks vector */
-    /* control_blocks.clear(); */
-    for (int i = 0;  i < max_aios; i++) {
-      /* TODO: we can reuse the aiocbs, so just clear them here  */
+  while (reaped == 0) {
+    if (global_data->completion == Completion_suspend) {
+      /* NULL entries are ignored */
+      for (long i = 0; i < global_data->queue_depth; i++) {
+        in_flight[i] = global_data->slots[i].in_flight ?
+                       &global_data->slots[i].control_block : NULL;
+      }
+      if (aio_suspend(in_flight, global_data->queue_depth, NULL) != 0 &&
+          errno != EINTR) {
+        perror("aio_suspend() FAILED");
+        exit(10);
+      }
+    }
+    for (long i = 0; i < global_data->queue_depth; i++) {
+      aio_slot_t *slot = &global_data->slots[i];
+      if (slot->in_flight &&
+          aio_error(&slot->control_block) != EINPROGRESS) {
+        complete_io(slot);
+        reaped++;
+      }
     }
   }
+}
 
-  /* Join with the I/O handling thread when we're done */
-  pthread_join(tid,NULL);
+static char *completion_name(enum aio_completion completion)
+{
+  return completion == Completion_signal ? "signal (SIGEV_SIGNAL)" :
+         completion == Completion_thread ? "thread (SIGEV_THREAD)" :
+         completion == Completion_suspend ? "aio_suspend" :
+         completion == Completion_poll ? "aio_error polling" : "UNKNOWN";
 }
 
 static void *sig_thread(void *arg)
 {
-  int            lock_status;
-  int            my_errno;
   int            signum;
   siginfo_t      info;
   global_data_t *global_data = (global_data_t *)arg;
-  struct aiocb  *my_aiocb;
+  aio_slot_t    *slot;
 
   printf("Entered sig_thread\n");
   do {
     signum = sigwaitinfo(&(global_data->set), &info);
     if (signum == MYSIG_AIO_COMPLETE) {
-      /* cast needed: (global_data_t *)info.si_value.sival_ptr */
-      my_aiocb = (struct aiocb *)info.si_value.sival_ptr;
-      if ((my_errno = aio_error(my_aiocb)) != EINPROGRESS) {
-        int my_status = aio_return(my_aiocb);
-        if (my_status >= 0) {
-          /* we can keep going */
-        } else {
-          /* There's a problem, we need to avoid incrementing anything now */
-          perror("aio failed");
-          exit(9);
-        }
-      }
-      global_data->ios_completed_per_batch++;
-      lock_status = pthread_mutex_lock(&(global_data->mutex));
-      if (lock_status != 0) {
-        perror("Unable to lock total_ios_completed");
-        exit(3);
-      }
-      global_data->total_ios_completed++;
-      lock_status = pthread_mutex_unlock(&(global_data->mutex));
-      if (lock_status != 0) {
-        perror("Unable to UNLOCK total_ios_completed");
-        exit(4);
-      }
-      if (global_data->ios_completed_per_batch >= global_data->max_aios) {
-        printf("One batch of aio_write() activities completed\n");
-        printf("%ld aio_write completions handled\n",global_data->total_ios_completed);
-        global_data->ios_completed_per_batch = 0; /* reset */
-        lock_status = pthread_cond_signal(&(global_data->condvar));
-        if (lock_status != 0) {
-          perror("Unable to signal an INTERIM condition");
-          exit(8);
-        }
+      /* cast needed: (aio_slot_t *)info.si_value.sival_ptr */
+      slot = (aio_slot_t *)info.si_value.sival_ptr;
+      if (aio_error(&slot->control_block) == EINPROGRESS) {
+        continue;
       }
+      complete_io(slot);
+      /* Only this thread completes writes in this mode */
       if (global_data->total_ios_completed >= global_data->total_ios_needed)
         break;
     } else if (signum == MYSIG_STOP) {
@@ -205,22 +367,5 @@ static void *sig_thread(void *arg)
     }
   } while (signum != -1 || errno == EINTR);
 
-
-  lock_status = pthread_mutex_lock(&(global_data->mutex));
-  if (lock_status != 0) {
-    perror("Unable to lock total_ios_completed");
-    exit(5);
-  }
-  lock_status = pthread_cond_signal(&(global_data->condvar));
-  if (lock_status != 0) {
-    perror("Unable to signal FINAL condition");
-    exit(7);
-  }
-  lock_status = pthread_mutex_unlock(&(global_data->mutex));
-  if (lock_status != 0) {
-    perror("Unable to UNLOCK total_ios_completed");
-    exit(6);
-  }
-
   return (void *)true;
 }
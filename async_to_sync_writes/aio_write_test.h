@@ -13,9 +13,16 @@
 #include <string.h>
 #include <stdbool.h>
 #include "my_signals.h"
+#include "io_latency.h"
+#include "test_type.h"
 
-void aio_write_test(int fd, long long filesize, long long blocksize,
-                    char *buffers, int buffer_count);
+/* Keeps queue_depth aio_write()s in flight, refilling as each completes,
+ * which it learns of the way 'completion' says.  Writes filesize bytes from
+ * base_offset on, picking the buffers with rand_r(&seed). */
+void aio_write_test(int fd, long long base_offset, long long filesize,
+                    long long blocksize, char *buffers, int buffer_count,
+                    unsigned int seed, int queue_depth,
+                    enum aio_completion completion);
 
 static void *sig_thread(void *arg);
 
@@ -6,20 +6,25 @@ void buffer_initialize(char **buffers,int buffer_count, int bufsize)
   long  buffer_number;
   char *buffer;
 
-  /* Allocate memory for buffers */
-  *buffers = malloc(buffer_count * bufsize);
+  /* Allocate memory for buffers, aligned for O_DIRECT */
+  if (posix_memalign((void **)buffers, BUFFER_ALIGNMENT,
+                     (size_t)buffer_count * bufsize) != 0) {
+    perror("Unable to allocate buffers");
+    exit(2);
+  }
 
-  /* Fill buffers with random data */
-  printf("Generating random buffers\n");
+  /* Fill buffers with random data.  Every writer thread does this, so it
+   * stays quiet unless it fails. */
   int randfd = open("/dev/urandom", O_RDONLY);
-  if (randfd == NULL) {
+  if (randfd == -1) {
     perror("Unable to open /dev/urandom");
     exit(2);
   }
-  printf("        Base address %lld\n",*buffers);
   for (i = 0; i < buffer_count; i++) {
-    printf("Reading into address %lld\n",((*buffers)+(i*bufsize)));
-    read(randfd,((*buffers)+(i*bufsize)),bufsize);
+    if (read(randfd,((*buffers)+(i*bufsize)),bufsize) != bufsize) {
+      perror("Unable to read /dev/urandom");
+      exit(2);
+    }
   }
-
+  close(randfd);
 }
@@ -8,6 +8,10 @@
 #include <stdio.h>
 #include <errno.h>
 
+/* Buffers start on this boundary, so they can be written with O_DIRECT (the
+ * block size must then be a multiple of the device's sector size too) */
+#define BUFFER_ALIGNMENT 4096
+
 
 void buffer_initialize(char **buffers,int buffer_count, int bufsize);
 
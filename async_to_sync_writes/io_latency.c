@@ -0,0 +1,64 @@
+#include "io_latency.h"
+
+unsigned long long nsecs_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void io_latency_init(io_latency_t *latency, unsigned long capacity)
+{
+  latency->samples  = malloc(capacity * sizeof(unsigned long long));
+  latency->count    = 0;
+  latency->capacity = capacity;
+  if (latency->samples == NULL) {
+    perror("Unable to allocate latency samples");
+    exit(1);
+  }
+}
+
+void io_latency_record(io_latency_t *latency, unsigned long long nsecs)
+{
+  if (latency->count < latency->capacity) {
+    latency->samples[latency->count++] = nsecs;
+  }
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Sorts the samples, so call it once, when the test is done */
+void io_latency_print(io_latency_t *latency, const char *name)
+{
+  unsigned long long  sum = 0;
+  unsigned long long *s   = latency->samples;
+  unsigned long       n   = latency->count;
+
+  if (n == 0) {
+    printf("%s latency: no samples\n", name);
+    return;
+  }
+  qsort(s, n, sizeof(unsigned long long), compare_samples);
+  for (unsigned long i = 0; i < n; i++) {
+    sum += s[i];
+  }
+  printf("%s latency (usecs) over %lu I/Os: avg %.1f min %.1f p50 %.1f "
+         "p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+         name, n, sum / 1000.0 / n, s[0] / 1000.0,
+         s[n * 50 / 100] / 1000.0, s[n * 90 / 100] / 1000.0,
+         s[n * 99 / 100] / 1000.0, s[n * 999 / 1000] / 1000.0,
+         s[n - 1] / 1000.0);
+}
+
+void io_latency_free(io_latency_t *latency)
+{
+  free(latency->samples);
+  latency->samples = NULL;
+}
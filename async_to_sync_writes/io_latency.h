@@ -0,0 +1,23 @@
+#ifndef IO_LATENCY_H
+#define IO_LATENCY_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Per-I/O latency samples, in nanoseconds, reported as percentiles once the
+ * test is done */
+typedef struct {
+  unsigned long long *samples;
+  unsigned long       count;
+  unsigned long       capacity;
+} io_latency_t;
+
+unsigned long long nsecs_now(void);
+
+void io_latency_init(io_latency_t *latency, unsigned long capacity);
+void io_latency_record(io_latency_t *latency, unsigned long long nsecs);
+void io_latency_print(io_latency_t *latency, const char *name);
+void io_latency_free(io_latency_t *latency);
+
+#endif /* IO_LATENCY_H */
@@ -0,0 +1,343 @@
+/* Linux only: io_uring is driven with the raw system calls, so no liburing is
+ * needed.  Elsewhere the test just says it is unavailable. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "io_uring_test.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* How long the SQPOLL thread spins on an empty submission queue before it
+ * sleeps and has to be woken with IORING_ENTER_SQ_WAKEUP */
+#define SQ_THREAD_IDLE_MSECS 2000
+
+typedef struct {
+  int                  ring_fd;
+  unsigned             flags;
+  unsigned long        enter_calls;
+  /* entries past the tail we published that the kernel hasn't taken yet */
+  unsigned             unsubmitted;
+  /* the three mappings, kept to unmap them: the kernel holds on to the ring
+   * until they are gone, even after ring_fd is closed.  cq_ptr is sq_ptr
+   * when the kernel maps both rings at once. */
+  char                *sq_ptr;
+  size_t               sq_size;
+  char                *cq_ptr;
+  size_t               cq_size;
+  size_t               sqes_size;
+  /* submission queue ring */
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_flags;
+  unsigned            *sq_array;
+  struct io_uring_sqe *sqes;
+  /* completion queue ring */
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+} uring_t;
+
+/* Unmap whatever of the ring is mapped and close it, keeping errno for the
+ * caller's perror() */
+static void uring_teardown(uring_t *ring)
+{
+  int saved_errno = errno;
+
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_size);
+  }
+  if (ring->sq_ptr != NULL) {
+    munmap(ring->sq_ptr, ring->sq_size);
+  }
+  close(ring->ring_fd);
+  errno = saved_errno;
+}
+
+static int uring_setup(uring_t *ring, unsigned entries, unsigned flags)
+{
+  struct io_uring_params  p;
+  size_t                  sq_size;
+  size_t                  cq_size;
+  char                   *sq_ptr;
+  char                   *cq_ptr;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+  p.flags = flags;
+  if (flags & IORING_SETUP_SQPOLL) {
+    p.sq_thread_idle = SQ_THREAD_IDLE_MSECS;
+  }
+  ring->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->ring_fd < 0) {
+    return -1;
+  }
+  ring->flags = flags;
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+  }
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    uring_teardown(ring);
+    return -1;
+  }
+  ring->sq_ptr  = sq_ptr;
+  ring->sq_size = sq_size;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  } else {
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+      uring_teardown(ring);
+      return -1;
+    }
+  }
+  ring->cq_ptr  = cq_ptr;
+  ring->cq_size = cq_size;
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->ring_fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_teardown(ring);
+    return -1;
+  }
+
+  ring->sq_head  = (unsigned *)(sq_ptr + p.sq_off.head);
+  ring->sq_tail  = (unsigned *)(sq_ptr + p.sq_off.tail);
+  ring->sq_mask  = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+  ring->sq_flags = (unsigned *)(sq_ptr + p.sq_off.flags);
+  ring->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+  ring->cq_head  = (unsigned *)(cq_ptr + p.cq_off.head);
+  ring->cq_tail  = (unsigned *)(cq_ptr + p.cq_off.tail);
+  ring->cq_mask  = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+  ring->cqes     = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+  printf("io_uring: %u submission entries, %u completion entries\n",
+         p.sq_entries, p.cq_entries);
+  return 0;
+}
+
+static int uring_enter(uring_t *ring, unsigned to_submit,
+                       unsigned min_complete, unsigned flags)
+{
+  ring->enter_calls++;
+  return syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete,
+                 flags, NULL, 0);
+}
+
+/* Hand the queued entries to the kernel, and wait for min_complete
+ * completions.  With SQPOLL that is just the tail store, plus a wakeup if the
+ * polling thread has gone idle.  Otherwise io_uring_enter() may take fewer
+ * entries than are queued; the rest stay in the ring and go with the next
+ * call. */
+static int uring_submit(uring_t *ring, unsigned min_complete)
+{
+  unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  int      ret;
+
+  if (ring->flags & IORING_SETUP_SQPOLL) {
+    ring->unsubmitted = 0;
+    /* Full fence: the tail store has to be visible before the flags are
+     * read, or the thread can go idle after we see no NEED_WAKEUP, without
+     * ever seeing the new tail */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+        IORING_SQ_NEED_WAKEUP) {
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    return flags != 0 ? uring_enter(ring, 0, min_complete, flags) : 0;
+  }
+  ret = uring_enter(ring, ring->unsubmitted, min_complete, flags);
+  if (ret > 0) {
+    ring->unsubmitted -= ret;
+  }
+  return ret;
+}
+
+void io_uring_test(int fd, long long base_offset, long long filesize,
+                   long long blocksize, char *buffers, int buffer_count,
+                   unsigned int seed, int queue_depth, int uring_flags)
+{
+  unsigned long        iterations = filesize / blocksize;
+  unsigned long        submitted = 0;
+  unsigned long        completed = 0;
+  unsigned long        failed = 0;
+  unsigned long        inflight = 0;
+  long                 buffer_number;
+  uring_t              ring;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct iovec         iov;
+  unsigned long long  *submit_time;
+  unsigned long long   start;
+  unsigned long long   t0;
+  unsigned long long   now;
+  unsigned long long   elapsed;
+  io_latency_t         submit_latency;
+  io_latency_t         complete_latency;
+  int                  io_fd = fd;
+
+  printf("ITERATIONS: %lu, QUEUE DEPTH: %d%s%s%s\n", iterations, queue_depth,
+         uring_flags & URING_FIXED_BUFFERS ? ", fixed buffers" : "",
+         uring_flags & URING_FIXED_FILES ? ", fixed files" : "",
+         uring_flags & URING_SQPOLL ? ", SQPOLL" : "");
+
+  if (uring_setup(&ring, queue_depth,
+                  uring_flags & URING_SQPOLL ? IORING_SETUP_SQPOLL : 0) != 0) {
+    perror("Unable to set up io_uring");
+    exit(1);
+  }
+
+  /* One registered buffer covering all of them; each write then uses an
+   * address inside it */
+  if (uring_flags & URING_FIXED_BUFFERS) {
+    iov.iov_base = buffers;
+    iov.iov_len  = buffer_count * blocksize;
+    if (syscall(__NR_io_uring_register, ring.ring_fd,
+                IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+      perror("Unable to register buffers");
+      exit(1);
+    }
+  }
+  if (uring_flags & URING_FIXED_FILES) {
+    if (syscall(__NR_io_uring_register, ring.ring_fd,
+                IORING_REGISTER_FILES, &fd, 1) != 0) {
+      perror("Unable to register file");
+      exit(1);
+    }
+    io_fd = 0; /* index into the registered files */
+  }
+
+  /* The user_data of each entry is the I/O number, which indexes this */
+  submit_time = malloc(iterations * sizeof(unsigned long long));
+  if (submit_time == NULL) {
+    perror("Unable to allocate submit times");
+    exit(1);
+  }
+  io_latency_init(&submit_latency, iterations);
+  io_latency_init(&complete_latency, iterations);
+
+  start = nsecs_now();
+  while (completed < iterations) {
+    /* Top the queue back up to queue_depth in flight */
+    unsigned tail = *ring.sq_tail;
+    unsigned to_submit = 0;
+
+    while (inflight < (unsigned long)queue_depth && submitted < iterations) {
+      unsigned index = tail & *ring.sq_mask;
+
+      buffer_number = ( rand_r(&seed) % buffer_count );
+      sqe = &ring.sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode    = uring_flags & URING_FIXED_BUFFERS ?
+                       IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      sqe->fd        = io_fd;
+      sqe->flags     = uring_flags & URING_FIXED_FILES ? IOSQE_FIXED_FILE : 0;
+      sqe->off       = base_offset + submitted * blocksize;
+      sqe->addr      = (unsigned long)(buffers + (buffer_number * blocksize));
+      sqe->len       = blocksize;
+      sqe->buf_index = 0;
+      sqe->user_data = submitted;
+      ring.sq_array[index] = index;
+
+      tail++;
+      to_submit++;
+      inflight++;
+      submitted++;
+    }
+
+    if (to_submit > 0) {
+      t0 = nsecs_now();
+      for (unsigned long i = submitted - to_submit; i < submitted; i++) {
+        submit_time[i] = t0;
+      }
+      /* Release: the entries are written before the kernel sees the tail */
+      __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+      ring.unsubmitted += to_submit;
+      if (uring_submit(&ring, 0) < 0) {
+        perror("io_uring_enter() submission FAILED");
+        exit(1);
+      }
+      now = nsecs_now();
+      /* The cost of the submission, shared by the I/Os it carried */
+      for (unsigned i = 0; i < to_submit; i++) {
+        io_latency_record(&submit_latency, (now - t0) / to_submit);
+      }
+    }
+
+    /* Wait for at least one completion if none is ready, handing over any
+     * entries a short submission left behind */
+    if (__atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) == *ring.cq_head) {
+      if (uring_submit(&ring, 1) < 0 &&
+          errno != EINTR) {
+        perror("io_uring_enter() wait FAILED");
+        exit(1);
+      }
+    }
+
+    /* Reap everything that has completed */
+    unsigned head = *ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    now = nsecs_now();
+    while (head != cq_tail) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      if (cqe->res != blocksize) {
+        if (failed == 0) {
+          fprintf(stderr, "write %llu %s: %s\n", cqe->user_data,
+                  cqe->res < 0 ? "FAILED" : "was short",
+                  cqe->res < 0 ? strerror(-cqe->res) : "partial write");
+        }
+        failed++;
+      }
+      io_latency_record(&complete_latency, now - submit_time[cqe->user_data]);
+      head++;
+      inflight--;
+      completed++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  elapsed = nsecs_now() - start;
+
+  printf("%lu writes (%lu failed or short) in %.3f seconds: %.1f IOPS, "
+         "%.1f MB/s, %lu io_uring_enter() calls\n",
+         completed, failed, elapsed / 1e9, completed / (elapsed / 1e9),
+         completed * blocksize / (elapsed / 1e9) / (1024 * 1024),
+         ring.enter_calls);
+  io_latency_print(&submit_latency, "Submit");
+  io_latency_print(&complete_latency, "Complete");
+
+  io_latency_free(&submit_latency);
+  io_latency_free(&complete_latency);
+  free(submit_time);
+  uring_teardown(&ring);
+}
+
+#else /* __linux__ */
+
+void io_uring_test(int fd, long long base_offset, long long filesize,
+                   long long blocksize, char *buffers, int buffer_count,
+                   unsigned int seed, int queue_depth, int uring_flags)
+{
+  printf("io_uring is only available on Linux\n");
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,25 @@
+#ifndef IO_URING_TEST_H
+#define IO_URING_TEST_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "io_latency.h"
+
+/* Flags for io_uring_test(), set with --fixed_buffers, --fixed_files and
+ * --sqpoll */
+#define URING_FIXED_BUFFERS 0x1 /* register the buffers, use WRITE_FIXED */
+#define URING_FIXED_FILES   0x2 /* register the fd, use IOSQE_FIXED_FILE */
+#define URING_SQPOLL        0x4 /* a kernel thread polls the submission queue */
+
+/* Writes filesize bytes from base_offset on, picking the buffers with
+ * rand_r(&seed) */
+void io_uring_test(int fd, long long base_offset, long long filesize,
+                   long long blocksize, char *buffers, int buffer_count,
+                   unsigned int seed, int queue_depth, int uring_flags);
+
+#endif /* IO_URING_TEST_H */
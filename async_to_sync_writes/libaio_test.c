@@ -0,0 +1,166 @@
+/* Linux only: the native AIO system calls are used directly, so no libaio is
+ * needed.  Elsewhere the test just says it is unavailable. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "libaio_test.h"
+
+#ifdef __linux__
+
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+
+void libaio_test(int fd, long long base_offset, long long filesize,
+                 long long blocksize, char *buffers, int buffer_count,
+                 unsigned int seed, int queue_depth)
+{
+  unsigned long        iterations = filesize / blocksize;
+  unsigned long        submitted = 0;
+  unsigned long        completed = 0;
+  unsigned long        failed = 0;
+  unsigned long        submit_calls = 0;
+  unsigned long        getevents_calls = 0;
+  long                 buffer_number;
+  aio_context_t        ctx = 0;
+  struct iocb         *control_blocks;
+  struct iocb        **free_blocks;
+  struct iocb        **batch;
+  struct io_event     *events;
+  int                  free_count;
+  int                  to_submit;
+  int                  ret;
+  unsigned long long  *submit_time;
+  unsigned long long   start;
+  unsigned long long   t0;
+  unsigned long long   now;
+  unsigned long long   elapsed;
+  io_latency_t         submit_latency;
+  io_latency_t         complete_latency;
+
+  printf("ITERATIONS: %lu, QUEUE DEPTH: %d\n", iterations, queue_depth);
+
+  if (syscall(__NR_io_setup, queue_depth, &ctx) != 0) {
+    perror("io_setup() FAILED");
+    exit(1);
+  }
+
+  /* A fixed pool of control blocks, reused as their writes complete */
+  control_blocks = calloc(queue_depth, sizeof(struct iocb));
+  free_blocks    = malloc(queue_depth * sizeof(struct iocb *));
+  batch          = malloc(queue_depth * sizeof(struct iocb *));
+  events         = malloc(queue_depth * sizeof(struct io_event));
+  submit_time    = malloc(iterations * sizeof(unsigned long long));
+  if (control_blocks == NULL || free_blocks == NULL || batch == NULL ||
+      events == NULL || submit_time == NULL) {
+    perror("Unable to allocate control blocks");
+    exit(1);
+  }
+  for (int i = 0; i < queue_depth; i++) {
+    free_blocks[i] = &control_blocks[i];
+  }
+  free_count = queue_depth;
+  io_latency_init(&submit_latency, iterations);
+  io_latency_init(&complete_latency, iterations);
+
+  start = nsecs_now();
+  while (completed < iterations) {
+    /* Refill every free control block */
+    to_submit = 0;
+    while (free_count > 0 && submitted < iterations) {
+      struct iocb *cb = free_blocks[--free_count];
+
+      buffer_number = ( rand_r(&seed) % buffer_count );
+      memset(cb, 0, sizeof(*cb));
+      cb->aio_data       = submitted; /* indexes submit_time */
+      cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+      cb->aio_fildes     = fd;
+      cb->aio_buf        = (unsigned long)(buffers + (buffer_number * blocksize));
+      cb->aio_nbytes     = blocksize;
+      cb->aio_offset     = base_offset + submitted * blocksize;
+      batch[to_submit++] = cb;
+      submitted++;
+    }
+
+    if (to_submit > 0) {
+      t0 = nsecs_now();
+      for (unsigned long i = submitted - to_submit; i < submitted; i++) {
+        submit_time[i] = t0;
+      }
+      /* io_submit() may take only part of the batch */
+      for (int done = 0; done < to_submit; done += ret) {
+        ret = syscall(__NR_io_submit, ctx, to_submit - done, batch + done);
+        submit_calls++;
+        if (ret <= 0) {
+          errno = ret < 0 ? errno : EAGAIN;
+          perror("io_submit() FAILED");
+          if (errno == EINVAL) {
+            fprintf(stderr, "O_DIRECT needs the block size and the file "
+                            "system's block size to agree\n");
+          }
+          exit(1);
+        }
+      }
+      now = nsecs_now();
+      /* The cost of the submission, shared by the I/Os it carried */
+      for (int i = 0; i < to_submit; i++) {
+        io_latency_record(&submit_latency, (now - t0) / to_submit);
+      }
+    }
+
+    /* Wait for at least one completion, and take all that are ready */
+    ret = syscall(__NR_io_getevents, ctx, 1, queue_depth, events, NULL);
+    getevents_calls++;
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("io_getevents() FAILED");
+      exit(1);
+    }
+    now = nsecs_now();
+    for (int i = 0; i < ret; i++) {
+      if (events[i].res != blocksize) {
+        if (failed == 0) {
+          fprintf(stderr, "write %llu %s: %s\n", events[i].data,
+                  events[i].res < 0 ? "FAILED" : "was short",
+                  events[i].res < 0 ? strerror(-events[i].res) :
+                                      "partial write");
+        }
+        failed++;
+      }
+      io_latency_record(&complete_latency, now - submit_time[events[i].data]);
+      free_blocks[free_count++] = (struct iocb *)(unsigned long)events[i].obj;
+      completed++;
+    }
+  }
+  elapsed = nsecs_now() - start;
+
+  printf("%lu writes (%lu failed or short) in %.3f seconds: %.1f IOPS, "
+         "%.1f MB/s, %lu io_submit() and %lu io_getevents() calls\n",
+         completed, failed, elapsed / 1e9, completed / (elapsed / 1e9),
+         completed * blocksize / (elapsed / 1e9) / (1024 * 1024),
+         submit_calls, getevents_calls);
+  io_latency_print(&submit_latency, "Submit");
+  io_latency_print(&complete_latency, "Complete");
+
+  io_latency_free(&submit_latency);
+  io_latency_free(&complete_latency);
+  syscall(__NR_io_destroy, ctx);
+  free(control_blocks);
+  free(free_blocks);
+  free(batch);
+  free(events);
+  free(submit_time);
+}
+
+#else /* __linux__ */
+
+void libaio_test(int fd, long long base_offset, long long filesize,
+                 long long blocksize, char *buffers, int buffer_count,
+                 unsigned int seed, int queue_depth)
+{
+  printf("Linux native AIO is only available on Linux\n");
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,20 @@
+#ifndef LIBAIO_TEST_H
+#define LIBAIO_TEST_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "io_latency.h"
+
+/* Linux native AIO: fd should be opened O_DIRECT, otherwise io_submit()
+ * does the writes synchronously.  Writes filesize bytes from base_offset on,
+ * picking the buffers with rand_r(&seed). */
+void libaio_test(int fd, long long base_offset, long long filesize,
+                 long long blocksize, char *buffers, int buffer_count,
+                 unsigned int seed, int queue_depth);
+
+#endif /* LIBAIO_TEST_H */
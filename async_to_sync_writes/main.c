@@ -1,7 +1,20 @@
+/* For O_DIRECT and pthread_setaffinity_np() */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#ifdef __sun
+#include <sys/processor.h>
+#include <sys/procset.h>
+#endif
 #include "my_signals.h"
 #include "test_type.h"
 #include "options.h"
@@ -9,27 +22,202 @@
 #include "pwrite_test.h"
 #include "aio_write_test.h"
 #include "lio_listio_test.h"
+#include "io_uring_test.h"
+#include "libaio_test.h"
+#include "io_latency.h"
 
 /* the number of buffers filled with random data, which we choose from randomly
  * to write the destination file */
 #define BUFFER_COUNT  200
 
+/* I/Os kept in flight by the queued engines unless --queue_depth says */
+#define DEFAULT_QUEUE_DEPTH 32
+
+/* What every worker thread does */
+typedef struct {
+  long long            blocksize;
+  enum test_type       test;
+  int                  open_flags;
+  int                  queue_depth;
+  int                  uring_flags;
+  enum aio_completion  completion;
+  bool                 pin;
+  /* Every worker, and main, wait here once the workers are ready to write,
+   * so main's CPU figures leave out their setup */
+  pthread_barrier_t   *ready;
+} job_t;
+
+/* One worker thread: its share of the file size and where in the file that
+ * starts, its own file descriptor, buffers and random seed, and how long its
+ * writes took */
+typedef struct {
+  const job_t         *job;
+  int                  cpu;
+  char                 filepath[PATH_MAX];
+  long long            offset;
+  long long            filesize;
+  unsigned int         seed;
+  pthread_t            tid;
+  unsigned long long   start;
+  unsigned long long   end;
+} worker_t;
+
+/* Size a file up front, so writes at explicit offsets land inside it rather
+ * than extending it: an extending write is done synchronously by some AIO
+ * implementations, Linux native AIO with O_DIRECT among them.  Where the file
+ * system can't allocate (posix_fallocate() unsupported) the size alone is
+ * set, leaving the file sparse. */
+static void preallocate_file(const char *filepath, long long size)
+{
+  int fd = open(filepath, O_RDWR | O_CREAT, 0755);
+  int err;
+
+  if (fd == -1) {
+    perror("Unable to open file");
+    exit(1);
+  }
+  err = posix_fallocate(fd, 0, size);
+  if (err != 0 && ftruncate(fd, size) != 0) {
+    errno = err;
+    perror("Unable to preallocate file");
+    exit(1);
+  }
+  close(fd);
+}
+
+/* Bind the calling thread to one CPU */
+static void pin_to_cpu(int cpu)
+{
+#if defined(__linux__)
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    fprintf(stderr, "Unable to pin a thread to CPU %d\n", cpu);
+  }
+#elif defined(__sun)
+  if (processor_bind(P_LWPID, P_MYID, cpu, NULL) != 0) {
+    perror("Unable to pin a thread to a CPU");
+  }
+#endif
+}
+
+static void *write_worker(void *arg)
+{
+  worker_t           *worker = (worker_t *)arg;
+  const job_t        *job = worker->job;
+  char               *buffers;
+
+  if (job->pin) {
+    pin_to_cpu(worker->cpu);
+  }
+
+  /* Fill buffers with random data */
+  buffer_initialize(&buffers, BUFFER_COUNT, job->blocksize);
+
+  /* Open file to write to with proper flags */
+  int fd = open(worker->filepath, job->open_flags, 0755);
+  if (fd == -1) {
+    perror("Unable to open file");
+    exit(1);
+  }
+
+  pthread_barrier_wait(job->ready);
+  worker->start = nsecs_now();
+  if (job->test == Test_pwrite) {
+    pwrite_test(fd, worker->offset, worker->filesize, job->blocksize, buffers,
+                BUFFER_COUNT, worker->seed);
+  } else if (job->test == Test_aio_write) {
+    aio_write_test(fd, worker->offset, worker->filesize, job->blocksize,
+                   buffers, BUFFER_COUNT, worker->seed, job->queue_depth,
+                   job->completion);
+  } else if (job->test == Test_lio_listio) {
+    lio_listio_test(fd, worker->filesize, job->blocksize, buffers, BUFFER_COUNT);
+  } else if (job->test == Test_io_uring) {
+    io_uring_test(fd, worker->offset, worker->filesize, job->blocksize,
+                  buffers, BUFFER_COUNT, worker->seed, job->queue_depth,
+                  job->uring_flags);
+  } else if (job->test == Test_libaio) {
+    libaio_test(fd, worker->offset, worker->filesize, job->blocksize,
+                buffers, BUFFER_COUNT, worker->seed, job->queue_depth);
+  }
+  worker->end = nsecs_now();
+
+  close(fd);
+  free(buffers);
+  return NULL;
+}
+
 int main(int argc, char **argv)
 {
   char            filepath[PATH_MAX];
-  char           *filepath_renamed;
+  char            filepath_renamed[PATH_MAX + 8];
   char            filepath_suffix[] = ".done";
   long long       filesize;
   long long       blocksize;
   long long       rename_delay = 0; /* default to 0 */
   enum test_type  test;
   int             sync_type = 0;
-  char           *buffers;
+  int             queue_depth = DEFAULT_QUEUE_DEPTH;
+  int             uring_flags = 0;
+  int             direct = 0;
+  int             preallocate = 0;
+  enum aio_completion completion = Completion_signal;
+  int             threads = 1;
+  int             files = 1;
+  long            cpus;
+  long long      *file_sizes;
+  job_t           job;
+  pthread_barrier_t ready;
+  worker_t       *workers;
+  long long       total_bytes = 0;
+  unsigned long long start;
+  unsigned long long end;
+  unsigned long long elapsed;
+  struct rusage   usage_start;
+  struct rusage   usage_end;
+  double          user_usecs;
+  double          system_usecs;
+  long long       total_ios;
+  sigset_t        set;
   time_t          t;
   struct tm      *tm;
   char            timestamp[64];
 
-  collect_options(&argc, argv, filepath, &filesize, &blocksize, &test, &sync_type,&rename_delay);
+  collect_options(&argc, argv, filepath, &filesize, &blocksize, &test, &sync_type,&rename_delay,
+                  &queue_depth, &uring_flags, &direct, &preallocate,
+                  &completion,
+                  &threads, &files);
+
+  /* Native AIO only runs asynchronously against an O_DIRECT file */
+  if (test == Test_libaio) {
+    direct = 1;
+  }
+  /* An extending O_DIRECT write is done synchronously by some AIO
+   * implementations, Linux native AIO among them, so direct I/O always
+   * overwrites a preallocated file.  lio_listio has no offsets to give. */
+  if (direct) {
+    preallocate = 1;
+  }
+  if (test == Test_lio_listio) {
+    preallocate = 0;
+  }
+  /* Every file gets at least one writer */
+  if (files > threads) {
+    printf("Only %d threads for %d files, so writing %d files\n",
+           threads, files, threads);
+    files = threads;
+  }
+  /* These wait for completion signals process wide, so concurrent tests
+   * would take each other's */
+  if (threads > 1 &&
+      (test == Test_lio_listio ||
+       (test == Test_aio_write && completion == Completion_signal))) {
+    printf("--threads needs --completion=(thread|suspend|poll) with "
+           "aio_write, and is not supported with lio_listio\n");
+    exit(1);
+  }
 
   printf("Running with following options:\n");
   printf("File to write: %s, File size %lld, I/O Block Size: %lld\n",
@@ -37,43 +225,149 @@ int main(int argc, char **argv)
   printf("I/O Test: %s, Synchronized Type: %s\n",
          test == Test_pwrite ? "pwrite" :
          test == Test_aio_write ? "aio_write" :
-         test == Test_lio_listio ? "lio_listio" : "UNKNOWN",
+         test == Test_lio_listio ? "lio_listio" :
+         test == Test_io_uring ? "io_uring" :
+         test == Test_libaio ? "libaio" : "UNKNOWN",
          sync_type & O_SYNC ? "O_SYNC" :
          sync_type & O_DSYNC ? "O_DSYNC" :
          "No Synchronization");
+  printf("Direct I/O: %s\n", direct ? "O_DIRECT" : "No (page cache)");
+  printf("File writes: %s\n", preallocate ?
+         "overwrite a preallocated file" : "append (O_APPEND)");
+  printf("Writer threads: %d, Files: %d\n", threads, files);
   printf("Rename delay after I/Os submitted: %lld seconds\n",rename_delay);
 
-  /* Set up the renamed file name */
-  filepath_renamed = malloc(sizeof(filepath) + sizeof(filepath_suffix));
-  strcat(filepath_renamed,filepath);
-  strcat(filepath_renamed,filepath_suffix);
-
-  /* Fill buffers with random data */
-  buffer_initialize(&buffers, BUFFER_COUNT, blocksize);
-  printf("INITIALIZED BUFFER BASE ADDRESS: %lld\n",buffers);
-
   /* Open file to write to with proper flags */
-  /* Opening "synchronized" (O_DSYNC), and O_APPEND, so we don't have to specify
-     the offset in the aio control block */
-  int open_flags = O_RDWR | O_CREAT | O_APPEND | sync_type;
-  int fd = open(filepath, open_flags, 0755);
-  if (fd == NULL) {
-    perror("Unable to open file");
+  /* Opening "synchronized" (O_DSYNC) and O_APPEND, so every write extends
+     the file, whatever offset it is given.  A preallocated file is written
+     at the offsets instead */
+  job.open_flags = O_RDWR | O_CREAT | sync_type;
+  if (!preallocate) {
+    job.open_flags |= O_APPEND;
+  }
+  if (direct) {
+#ifdef O_DIRECT
+    job.open_flags |= O_DIRECT;
+#else
+    printf("O_DIRECT is not available on this platform\n");
     exit(1);
+#endif
+  }
+  job.blocksize   = blocksize;
+  job.test        = test;
+  job.queue_depth = queue_depth;
+  job.uring_flags = uring_flags;
+  job.completion  = completion;
+  /* One thread keeps the old, unpinned behaviour */
+  job.pin         = threads > 1;
+  job.ready       = &ready;
+  pthread_barrier_init(&ready, NULL, threads + 1);
+
+  /* Shard the file size across the threads, in whole blocks, and the
+   * threads across the files: thread i writes to file i % files, after the
+   * shares of the threads before it on that file.  With one file it is the
+   * file given; otherwise each gets a numeric suffix.  Each thread picks its
+   * buffers with a seed of its own. */
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) {
+    cpus = 1;
+  }
+  workers = calloc(threads, sizeof(worker_t));
+  file_sizes = calloc(files, sizeof(long long));
+  if (workers == NULL || file_sizes == NULL) {
+    perror("Unable to allocate workers");
+    exit(1);
+  }
+  for (int i = 0; i < threads; i++) {
+    workers[i].job      = &job;
+    workers[i].cpu      = i % cpus;
+    workers[i].filesize = filesize / blocksize / threads * blocksize;
+    if (i < filesize / blocksize % threads) {
+      workers[i].filesize += blocksize;
+    }
+    if (snprintf(workers[i].filepath, PATH_MAX, files == 1 ? "%s" : "%s.%d",
+                 filepath, i % files) >= PATH_MAX) {
+      fprintf(stderr, "File path too long: %s\n", filepath);
+      exit(1);
+    }
+    workers[i].offset    = file_sizes[i % files];
+    workers[i].seed      = (unsigned int)time(NULL) + i;
+    file_sizes[i % files] += workers[i].filesize;
+  }
+  if (preallocate) {
+    for (int i = 0; i < files; i++) {
+      preallocate_file(workers[i].filepath, file_sizes[i]);
+    }
   }
 
   /* Initiate the write test activity */
   t = time(NULL);
   tm = localtime(&t);
   strftime(timestamp, sizeof(timestamp), "%c", tm);
+  printf("Generating random buffers, %d per thread\n", BUFFER_COUNT);
   printf("    Writing begins at: %s\n",timestamp);
-  if (test == Test_pwrite) {
-    pwrite_test(fd, filesize, blocksize, buffers, BUFFER_COUNT);
-  } else if (test == Test_aio_write) {
-    aio_write_test(fd, filesize, blocksize, buffers, BUFFER_COUNT);
-  } else if (test == Test_lio_listio) {
-    lio_listio_test(fd, filesize, blocksize, buffers, BUFFER_COUNT);
+  /* The completion signals are only for the tests' sigwaitinfo() threads;
+   * every thread created from here on inherits the mask */
+  sigemptyset(&set);
+  sigaddset(&set,MYSIG_AIO_COMPLETE);
+  sigaddset(&set,MYSIG_STOP);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i].tid, NULL, write_worker, &workers[i]) != 0) {
+      perror("Unable to start writer thread");
+      exit(1);
+    }
+  }
+  pthread_barrier_wait(&ready);
+  getrusage(RUSAGE_SELF, &usage_start);
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].tid, NULL);
+  }
+  getrusage(RUSAGE_SELF, &usage_end);
+  pthread_barrier_destroy(&ready);
+
+  /* Aggregate throughput runs from the first thread starting to write to the
+   * last one finishing, leaving out buffer setup */
+  start = workers[0].start;
+  end   = workers[0].end;
+  for (int i = 0; i < threads; i++) {
+    char where[32] = "unpinned";
+    unsigned long long elapsed = workers[i].end - workers[i].start;
+    if (job.pin) {
+      snprintf(where, sizeof(where), "CPU %d", workers[i].cpu);
+    }
+    printf("Thread %d (%s, file %s): %lld bytes in %.3f seconds: "
+           "%.1f MB/s\n", i, where, workers[i].filepath,
+           workers[i].filesize, elapsed / 1e9,
+           workers[i].filesize / (elapsed / 1e9) / (1024 * 1024));
+    total_bytes += workers[i].filesize;
+    if (workers[i].start < start) {
+      start = workers[i].start;
+    }
+    if (workers[i].end > end) {
+      end = workers[i].end;
+    }
   }
+  elapsed = end - start;
+  printf("All %d threads, %d files: %lld bytes in %.3f seconds: %.1f MB/s\n",
+         threads, files, total_bytes, elapsed / 1e9,
+         total_bytes / (elapsed / 1e9) / (1024 * 1024));
+
+  /* CPU time is only counted for the whole process: every writer thread,
+   * the completion threads, and the AIO implementation's own threads, if it
+   * has any.  So it is reported once, over every write. */
+  user_usecs   = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) *
+                 1e6 +
+                 (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec);
+  system_usecs = (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) *
+                 1e6 +
+                 (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec);
+  total_ios    = total_bytes / blocksize;
+  printf("CPU per I/O (usecs): %.2f (user %.2f, system %.2f), "
+         "%.0f%% of one CPU\n",
+         (user_usecs + system_usecs) / total_ios, user_usecs / total_ios,
+         system_usecs / total_ios,
+         (user_usecs + system_usecs) / (elapsed / 1e3) * 100);
 
   /* Rename file */
   t = time(NULL);
@@ -83,14 +377,24 @@ int main(int argc, char **argv)
     printf("Sleeping %lld seconds before rename...\n",rename_delay);
     sleep(rename_delay);
   }
-  printf("     Renaming file %s to %s at: %s\n",filepath,filepath_renamed,
-                                                timestamp);
-  rename(filepath,filepath_renamed);
+  for (int i = 0; i < files; i++) {
+    snprintf(filepath_renamed, sizeof(filepath_renamed), "%s%s",
+             workers[i].filepath, filepath_suffix);
+    printf("     Renaming file %s to %s at: %s\n",workers[i].filepath,
+           filepath_renamed, timestamp);
+    rename(workers[i].filepath,filepath_renamed);
+  }
   t = time(NULL);
   tm = localtime(&t);
   strftime(timestamp, sizeof(timestamp), "%c", tm);
   printf(" Renaming complete at: %s\n",timestamp);
   printf("sleeping 4 seconds after rename and before unlink...\n");
   sleep(4);
-  unlink(filepath_renamed);
+  for (int i = 0; i < files; i++) {
+    snprintf(filepath_renamed, sizeof(filepath_renamed), "%s%s",
+             workers[i].filepath, filepath_suffix);
+    unlink(filepath_renamed);
+  }
+  free(file_sizes);
+  free(workers);
 }
@@ -6,25 +6,53 @@
  *  Total size of the file this test will create
  * --blocksize=<size in bytes>
  *  Size of each write to the file
- * --test=(pwrite|aio_write|lio_listio)
+ * --test=(pwrite|aio_write|lio_listio|io_uring|libaio)
  *  The way to perform writes - synchronous or asynchronous
  * --sync_type=(O_SYNC|O_DSYNC|<none - async - default)
  *  Whether I/O is synchronized or non-synchronized (default)
+ * --completion=(signal|thread|suspend|poll)  (signal by default)
+ *  aio_write: how completions are reaped - a signal per I/O (SIGEV_SIGNAL),
+ *  a notification thread (SIGEV_THREAD), aio_suspend() over the I/Os in
+ *  flight, or polling aio_error()
+ * --threads=<count>  (1 by default)
+ *  Writer threads, each pinned to a CPU, with its own fd and buffers; the
+ *  file size is shared out between them
+ * --files=<count>  (1 by default)
+ *  Files written, each by threads/files of the threads; with more than one,
+ *  each file is the file path with a numeric suffix
+ * --direct
+ *  Open the file O_DIRECT, bypassing the page cache (always on for libaio)
+ * --preallocate
+ *  Size the files up front and write them at explicit offsets, instead of
+ *  appending to them (always on with --direct; not for lio_listio)
  * --rename_delay=<seconds>  (0 by default)
  *  How many seconds to wait after writes are complete before file rename is
  *  done.
+ * --queue_depth=<count>  (32 by default)
+ *  How many I/Os aio_write, io_uring and libaio keep in flight
+ * --fixed_buffers
+ *  io_uring: register the buffers and write with IORING_OP_WRITE_FIXED
+ * --fixed_files
+ *  io_uring: register the file descriptor
+ * --sqpoll
+ *  io_uring: submit through a kernel polling thread (IORING_SETUP_SQPOLL)
  ******************************************************************************/
 
 
 #include "test_type.h"
 #include "options.h"
+#include "io_uring_test.h"
 
 int
 collect_options(int *argc, char **argv, char *filepath,
                 long long *filesize,
                 long long *blocksize,
                 enum test_type *test, int *sync_type,
-                long long *rename_delay)
+                long long *rename_delay,
+                int *queue_depth, int *uring_flags, int *direct,
+                int *preallocate,
+                enum aio_completion *completion,
+                int *threads, int *files)
 {
   char                 *eptr;
   int                   c;
@@ -36,13 +64,22 @@ collect_options(int *argc, char **argv, char *filepath,
     {"test",         required_argument, 0, 't'},
     {"sync_type",    required_argument, 0, 'y'},
     {"rename_delay", required_argument, 0, 'r'},
+    {"queue_depth",  required_argument, 0, 'q'},
+    {"fixed_buffers",      no_argument, 0, 'B'},
+    {"fixed_files",        no_argument, 0, 'F'},
+    {"sqpoll",             no_argument, 0, 'P'},
+    {"direct",             no_argument, 0, 'D'},
+    {"preallocate",        no_argument, 0, 'A'},
+    {"completion",   required_argument, 0, 'c'},
+    {"threads",      required_argument, 0, 'T'},
+    {"files",        required_argument, 0, 'M'},
     {0,                              0, 0,   0}
   };
 
   while (1)
   {
     int option_index = 0;
-    c = getopt_long(*argc, argv, "f:s:b:t:y:r:",
+    c = getopt_long(*argc, argv, "f:s:b:t:y:r:q:BFPDAc:T:M:",
                     long_options, &option_index);
 
     /*  Detect the end of the options. */
@@ -71,6 +108,12 @@ collect_options(int *argc, char **argv, char *filepath,
           *test = Test_aio_write;
         } else if (strcmp(optarg,"lio_listio") == 0) {
           *test = Test_lio_listio;
+        } else if (strcmp(optarg,"io_uring") == 0) {
+          *test = Test_io_uring;
+        } else if (strcmp(optarg,"libaio") == 0) {
+          *test = Test_libaio;
+        } else {
+          usage(argv, 1);
         }
         break;
       case 'y':
@@ -87,15 +130,65 @@ collect_options(int *argc, char **argv, char *filepath,
         *rename_delay = strtoll(optarg, &eptr, 10);
         printf("rename will be done %lld seconds late\n", *rename_delay);
         break;
+      case 'q':
+        *queue_depth = strtol(optarg, &eptr, 10);
+        if (*queue_depth <= 0 || *eptr != '\0') {
+          usage(argv, 1);
+        }
+        printf("queue_depth: %d\n", *queue_depth);
+        break;
+      case 'B':
+        *uring_flags |= URING_FIXED_BUFFERS;
+        break;
+      case 'F':
+        *uring_flags |= URING_FIXED_FILES;
+        break;
+      case 'P':
+        *uring_flags |= URING_SQPOLL;
+        break;
+      case 'D':
+        *direct = 1;
+        break;
+      case 'A':
+        *preallocate = 1;
+        break;
+      case 'T':
+        *threads = strtol(optarg, &eptr, 10);
+        if (*threads <= 0 || *eptr != '\0') {
+          usage(argv, 1);
+        }
+        printf("threads: %d\n", *threads);
+        break;
+      case 'M':
+        *files = strtol(optarg, &eptr, 10);
+        if (*files <= 0 || *eptr != '\0') {
+          usage(argv, 1);
+        }
+        printf("files: %d\n", *files);
+        break;
+      case 'c':
+        printf("completion: %s\n", optarg);
+        if (strcmp(optarg,"signal") == 0) {
+          *completion = Completion_signal;
+        } else if (strcmp(optarg,"thread") == 0) {
+          *completion = Completion_thread;
+        } else if (strcmp(optarg,"suspend") == 0) {
+          *completion = Completion_suspend;
+        } else if (strcmp(optarg,"poll") == 0) {
+          *completion = Completion_poll;
+        } else {
+          usage(argv, 1);
+        }
+        break;
       default:
-        usage(argv);
-        abort();
+        usage(argv, 1);
     }
   }
 
+  return 0;
 }
 
-void usage(char **argv)
+void usage(char **argv, int status)
 {
   printf("Usage: %s\n",argv[0]);
   printf("--filepath=</path/to/file>\n");
@@ -104,12 +197,27 @@ void usage(char **argv)
   printf("  Size of the file you want to create\n");
   printf("--blocksize=<size in bytes>\n");
   printf("  Each I/O to the file will be of this size\n");
-  printf("--test=(pwrite|aio_write|lio_listio)\n");
+  printf("--test=(pwrite|aio_write|lio_listio|io_uring|libaio)\n");
   printf("  synchronous or asynchronous write type\n");
   printf("--sync_type=(O_SYNC|O_DSYNC|<none - default>)\n");
   printf("  synchronized or non-synchronized I/Os\n");
+  printf("--completion=(signal|thread|suspend|poll)\n");
+  printf("  how aio_write reaps completions (signal by default)\n");
+  printf("--threads=<count> --files=<count>\n");
+  printf("  pinned writer threads sharing the file size, and the files "
+         "they write (1 each by default)\n");
+  printf("--direct\n");
+  printf("  O_DIRECT I/Os, bypassing the page cache (implied by libaio)\n");
+  printf("--preallocate\n");
+  printf("  preallocate the files and overwrite them rather than append "
+         "(implied by --direct)\n");
   printf("--rename_delay=<seconds>\n");
   printf("  delay file rename for <seconds> after I/Os submitted\n");
+  printf("--queue_depth=<count>\n");
+  printf("  I/Os kept in flight by aio_write, io_uring and libaio "
+         "(32 by default)\n");
+  printf("--fixed_buffers --fixed_files --sqpoll\n");
+  printf("  io_uring: registered buffers, registered file, kernel SQ polling\n");
 
-  exit(0);
+  exit(status);
 }
@@ -6,13 +6,18 @@
 #include <getopt.h>
 #include <fcntl.h>
 
-void usage(char **argv);
+/* Print the options and exit with status: non-zero when they were wrong */
+void usage(char **argv, int status);
 int
 collect_options(int *argc, char **argv, char *filepath,
                 long long *filesize,
                 long long *blocksize,
                 enum test_type *test, int *sync_type,
-                long long *rename_delay);
+                long long *rename_delay,
+                int *queue_depth, int *uring_flags, int *direct,
+                int *preallocate,
+                enum aio_completion *completion,
+                int *threads, int *files);
 
 #endif /* OPTIONS_H */
 
@@ -1,7 +1,8 @@
 #include "pwrite_test.h"
 
-void pwrite_test(int fd, long long filesize, long long blocksize,
-                 char *buffers, int buffer_count)
+void pwrite_test(int fd, long long base_offset, long long filesize,
+                 long long blocksize, char *buffers, int buffer_count,
+                 unsigned int seed)
 {
   unsigned long  iterations = filesize / blocksize;
   long           buffer_number;
@@ -12,11 +13,9 @@ void pwrite_test(int fd, long long filesize, long long blocksize,
   printf("ITERATIONS: %lu\n",iterations);
   printf("BUFFER ADDRESS RANGE STARTS AT: %lld\n", buffers);
 
-  srand(time(NULL));
-
   for (int i = 0; i < iterations; i++) {
-    offset = i * blocksize;
-    buffer_number = ( rand() % buffer_count );
+    offset = base_offset + i * blocksize;
+    buffer_number = ( rand_r(&seed) % buffer_count );
     /*  printf("BUFFER %d picked\n",buffer_number); */
     buffer = buffers + (buffer_number * blocksize);
     written = pwrite(fd, buffer, blocksize, offset);
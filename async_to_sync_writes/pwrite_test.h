@@ -8,7 +8,10 @@
 #include <stdio.h>
 #include <errno.h>
 
-void pwrite_test(int fd, long long filesize, long long blocksize,
-                 char *buffers, int buffer_count);
+/* Writes filesize bytes from base_offset on, picking the buffers with
+ * rand_r(&seed) */
+void pwrite_test(int fd, long long base_offset, long long filesize,
+                 long long blocksize, char *buffers, int buffer_count,
+                 unsigned int seed);
 
 #endif /* PWRITE_TEST_H */
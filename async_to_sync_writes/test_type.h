@@ -2,6 +2,11 @@
 #ifndef TEST_TYPE_H
 #define TEST_TYPE_H
 
-enum test_type { Test_pwrite, Test_aio_write, Test_lio_listio };
+enum test_type { Test_pwrite, Test_aio_write, Test_lio_listio, Test_io_uring,
+                 Test_libaio };
+
+/* How aio_write_test learns that a write has completed */
+enum aio_completion { Completion_signal, Completion_thread,
+                      Completion_suspend, Completion_poll };
 
 #endif /* TEST_TYPE_H */
@@ -0,0 +1,166 @@
+#ifndef PIPE_ADAPTIVEWAKEUPPOLICY_HH
+#define PIPE_ADAPTIVEWAKEUPPOLICY_HH
+
+#ifdef __linux__
+
+#include "FutexWakeupPolicy.hh"
+#include "Utility.h"
+#include "membar.h"
+
+#include <ostream>
+#include <sched.h>
+#include <stdint.h>                       // To get uint64_t
+
+/*
+ * Tell the CPU we are in a spin-wait loop.  On x86 this stops the pipeline
+ * from speculating down the loop (and hands the core to a hyperthread); on
+ * ARM it is the architectural yield hint.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+  #define PIPE_cpu_relax() __asm__ __volatile__ ("pause" : : : "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+  #define PIPE_cpu_relax() __asm__ __volatile__ ("yield" : : : "memory")
+#else
+  #define PIPE_cpu_relax() MEMBAR_ccfence()
+#endif
+
+namespace Pipe {
+
+  /*
+   * Adaptive wakeup policy (Linux only).
+   *
+   * A waiting reader (on an empty pipe) or writer (on a full pipe) escalates
+   * through three phases:
+   *
+   *   SPIN  - busy-wait with a cpu relax hint for spinNSecs
+   *   YIELD - sched_yield() for a further yieldNSecs
+   *   PARK  - sleep on the futex, exactly as FutexWakeupPolicy does
+   *
+   * Latency-critical consumers can give themselves a generous spin budget and
+   * never make a system call on a busy pipe; batch consumers can set both
+   * budgets to zero and park straight away.  The policy counts which phase
+   * each wait ended in, so the budgets can be tuned per pipe.
+   *
+   * The wakeup side is inherited unchanged from FutexWakeupPolicy: a waiter
+   * only raises its flag once it reaches the PARK phase, so a spinning waiter
+   * costs the other side nothing.
+   */
+  class AdaptiveWakeupPolicy : public FutexWakeupPolicy
+  {
+    public:
+      enum Phase { SPIN, YIELD, PARK, NUM_PHASES };
+
+      enum { DEFAULT_SPIN_NSECS = 10000, DEFAULT_YIELD_NSECS = 100000 };
+
+      AdaptiveWakeupPolicy() NO_THROW :
+        spinNSecs_(DEFAULT_SPIN_NSECS),
+        yieldNSecs_(DEFAULT_YIELD_NSECS)
+      {
+      }
+
+      /*
+       * How long a waiter busy-spins before it starts yielding.
+       * \param nsecs the spin budget in nanoseconds (0 disables spinning)
+       */
+      void setSpinNSecs(uint64_t nsecs) NO_THROW {
+        spinNSecs_ = nsecs;
+      }
+      uint64_t getSpinNSecs() const NO_THROW {
+        return spinNSecs_;
+      }
+      /*
+       * How long a waiter yields after spinning, before it parks.
+       * \param nsecs the yield budget in nanoseconds (0 disables yielding)
+       */
+      void setYieldNSecs(uint64_t nsecs) NO_THROW {
+        yieldNSecs_ = nsecs;
+      }
+      uint64_t getYieldNSecs() const NO_THROW {
+        return yieldNSecs_;
+      }
+
+      /*
+       * Which phase a waiter is in after having waited for elapsedNSecs.
+       */
+      Phase phaseAfter(uint64_t elapsedNSecs) const NO_THROW {
+        if (elapsedNSecs < spinNSecs_)
+        {
+          return SPIN;
+        }
+        if (elapsedNSecs - spinNSecs_ < yieldNSecs_)
+        {
+          return YIELD;
+        }
+        return PARK;
+      }
+
+      /*
+       * Back off once, as appropriate for a SPIN or YIELD phase.
+       */
+      static void backOff(Phase phase) NO_THROW {
+        if (phase == SPIN)
+        {
+          PIPE_cpu_relax();
+        }
+        else
+        {
+          sched_yield();
+        }
+      }
+
+      /*
+       * Count one wait, by the phase it ended in.  Called once per wait, not
+       * per look at the pipe, and never for a poll that does not wait or a
+       * wait that times out.
+       */
+      void recordReaderWait(Phase phase) NO_THROW {
+        numReaderWaitsEnded_[phase].store(numReaderWaitsEnded_[phase].load() + 1);
+      }
+      void recordWriterWait(Phase phase) NO_THROW {
+        numWriterWaitsEnded_[phase].store(numWriterWaitsEnded_[phase].load() + 1);
+      }
+      /*
+       * How many reader waits (for data) ended in the given phase.
+       */
+      uint64_t numReaderWaitsEnded(Phase phase) const NO_THROW {
+        return numReaderWaitsEnded_[phase].load();
+      }
+      /*
+       * How many writer waits (for room) ended in the given phase.
+       */
+      uint64_t numWriterWaitsEnded(Phase phase) const NO_THROW {
+        return numWriterWaitsEnded_[phase].load();
+      }
+
+      friend std::ostream& operator<<(std::ostream& os, const AdaptiveWakeupPolicy& policy)
+      {
+        return os << "Adaptive Wakeup Policy"
+                  << " (spin nsecs: "  << policy.spinNSecs_
+                  << ", yield nsecs: " << policy.yieldNSecs_
+                  << ", reader waits ended spin/yield/park: "
+                  << policy.numReaderWaitsEnded(SPIN) << "/"
+                  << policy.numReaderWaitsEnded(YIELD) << "/"
+                  << policy.numReaderWaitsEnded(PARK)
+                  << ", writer waits ended spin/yield/park: "
+                  << policy.numWriterWaitsEnded(SPIN) << "/"
+                  << policy.numWriterWaitsEnded(YIELD) << "/"
+                  << policy.numWriterWaitsEnded(PARK) << ") "
+                  << static_cast<const FutexWakeupPolicy&>(policy);
+      }
+
+    private:
+      uint64_t spinNSecs_;
+      uint64_t yieldNSecs_;
+
+      // Statistics.  The reader counters are only written by the reader, the
+      // writer counters only by the writer, but all are printed from any
+      // thread.
+      PipeAtomic<uint64_t> numReaderWaitsEnded_[NUM_PHASES];
+      PipeAtomic<uint64_t> numWriterWaitsEnded_[NUM_PHASES];
+  };
+
+} // Pipe
+
+#endif /* __linux__ */
+
+#endif /* PIPE_ADAPTIVEWAKEUPPOLICY_HH */
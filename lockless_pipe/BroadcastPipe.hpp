@@ -0,0 +1,564 @@
+#ifndef PIPE_BROADCAST_PIPE_HPP
+#define PIPE_BROADCAST_PIPE_HPP
+
+#include "LocklessPipe.hpp"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "Utility.h"
+
+#include <cstring>
+#include <iostream>
+#include <stdint.h>                       // To get uint32_t, uint64_t
+#include <unistd.h>
+
+namespace Pipe {
+
+  /*
+   * A single writer / multiple reader pipe that delivers every element to
+   * every reader, for fanning one stream out without a copy per consumer.
+   *
+   * There is one write position and NUM_READERS independent read positions,
+   * each on its own cache line.  Readers never modify the ring, so they read
+   * elements in place (peekView()/release()) or copy them out (pop()).  The
+   * writer only reuses space once the slowest reader has released it: a
+   * reader that stops reading eventually stalls the writer, and every other
+   * reader behind it.  lag() and lagElements() show how far behind each
+   * reader is.
+   *
+   * With FutexWakeupPolicy each reader gets a policy of its own; the writer
+   * wakes the readers that are parked, and parks on the policy of the
+   * slowest reader when the pipe is full.
+   *
+   * PIPE_SIZE must be a power of two.
+   */
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy = NoWakeupPolicy>
+  class BroadcastPipe {
+    /*
+     * The amount of time the writer will sleep when the pipe is full, and a
+     * reader when it has caught up (NoWakeupPolicy only).
+     */
+    enum { SLEEP_ON_BLOCK_USECS = 1000 };
+
+    CT_ASSERT(PipeSizeIsPowerOfTwo, (PIPE_SIZE & (PIPE_SIZE - 1)) == 0);
+    CT_ASSERT(HasReaders, NUM_READERS > 0);
+
+    public:
+
+    typedef Data DataHandle;
+    /*
+     * Constructor
+     */
+    explicit BroadcastPipe();
+
+    ~BroadcastPipe() { }
+
+    /*
+     * push 'Data' into the pipe for all the readers, blocking until the
+     * slowest reader has left enough room.  An element larger than
+     * getMaxPipeElementSize() is dropped and counted in numFailedWrites().
+     * \param value the 'Data' to push.
+     * \throws Interrupted if the writer has been stopped.
+     */
+    void push(const Data& value);
+
+    /*
+     * pop the next 'Data' for one reader, blocking if that reader has
+     * caught up with the writer.
+     * \param reader which reader, 0 .. NUM_READERS - 1
+     * \param value The 'Data' to pop (this wil be a handle over the raw data copied into buffer)
+     * \param buffer pointer to a raw buffer where the popped item will be copied to
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \throws Interrupted if the reader has been stopped.
+     */
+    void pop(uint32_t reader, Data& value, void* buffer, PreWaitFunctor* func = 0);
+    /*
+     * Zero-copy pop: hand the reader its next element in place.  The element,
+     * and 'value', stay valid until the reader calls release().
+     * \throws Interrupted if the reader has been stopped.
+     */
+    void peekView(uint32_t reader, Data& value, PreWaitFunctor* func = 0);
+    /*
+     * Move the reader past the element handed out by peekView().
+     */
+    void release(uint32_t reader) {
+      finishRead(reader);
+    }
+
+    bool isWriterRunning() const NO_THROW {
+      return isWriterRunning_.load();
+    }
+    bool isReaderRunning(uint32_t reader) const NO_THROW {
+      return readers_[reader].isRunning.load();
+    }
+    void startWriter() {
+      isWriterRunning_.store(true);
+    }
+    /*
+     * Stop the writer.
+     * All subsequent calls to push will throw Interrupted exceptions.
+     */
+    void stopWriter();
+    void startReader(uint32_t reader) {
+      readers_[reader].isRunning.store(true);
+    }
+    /*
+     * Stop one reader.
+     * All its subsequent calls to pop will throw Interrupted exceptions.  The
+     * reader still holds back the writer until it is started and catches up.
+     */
+    void stopReader(uint32_t reader) {
+      readers_[reader].isRunning.store(false);
+      wakeup(readers_[reader].wakeupPolicy);
+    }
+
+    /*
+     * How many bytes (including headers and padding) the reader is behind
+     * the writer.
+     */
+    uint64_t lag(uint32_t reader) const NO_THROW {
+      return writePosition_.load() - readers_[reader].readPosition.load();
+    }
+    /*
+     * How many elements the reader is behind the writer.
+     */
+    uint64_t lagElements(uint32_t reader) const NO_THROW {
+      return numWritten_.load() - readers_[reader].numRead.load();
+    }
+    /*
+     * The largest lag() the writer has seen for the reader.  The writer only
+     * looks when it runs out of room, so this is the reader's lag at the
+     * times it was holding the writer back.
+     */
+    uint64_t maxLag(uint32_t reader) const NO_THROW {
+      return readers_[reader].maxLag.load();
+    }
+    /*
+     * Is the reader caught up with the writer?
+     */
+    bool isEmpty(uint32_t reader) const NO_THROW {
+      return lag(reader) == 0;
+    }
+    uint64_t numWritten() const NO_THROW {
+      return numWritten_.load();
+    }
+    uint64_t numRead(uint32_t reader) const NO_THROW {
+      return readers_[reader].numRead.load();
+    }
+    uint64_t numFailedWrites() const NO_THROW {
+      return numFailedWrites_.load();
+    }
+    uint32_t getNumReaders() const NO_THROW {
+      return NUM_READERS;
+    }
+    uint32_t getPipeSize() const NO_THROW {
+      return PIPE_SIZE;
+    }
+    uint32_t getMaxPipeElementSize() const NO_THROW {
+      return MAX_PIPE_ELEMENT_SIZE;
+    }
+    WakeupPolicy& getWakeupPolicy(uint32_t reader) NO_THROW {
+      return readers_[reader].wakeupPolicy;
+    }
+    /*
+     * print stats about the pipe
+     */
+    std::ostream& print(std::ostream& os) const;
+
+
+    private:
+    /*
+     * Every element is preceded by a header holding its length, and padded to
+     * RECORD_ALIGNMENT.  When an element will not fit before the end of the
+     * ring the writer leaves a PADDING header and starts again at offset 0.
+     */
+    enum { HEADER_SIZE = 8, RECORD_ALIGNMENT = 8 };
+    static const uint32_t PADDING = 0xffffffff;
+
+    static const uint32_t MAX_PIPE_ELEMENT_SIZE = PIPE_SIZE - HEADER_SIZE;
+
+    // Writer-owned.
+    PIPE_CALIGNED PipeAtomic<uint64_t> writePosition_;
+    PipeAtomic<uint64_t> numWritten_;
+    PipeAtomic<uint64_t> numFailedWrites_;
+    // The slowest read position the writer last saw, and whose it was.
+    uint64_t cachedMinReadPosition_;
+    uint32_t slowestReader_;
+    PipeAtomic<bool> isWriterRunning_;
+
+    /*
+     * Each reader's state starts on a cache line of its own, so readers do
+     * not slow each other down.
+     */
+    struct ReaderState {
+      PIPE_CALIGNED PipeAtomic<uint64_t> readPosition;
+      PipeAtomic<uint64_t> numRead;
+      // Written by the writer, only when it finds the pipe full.
+      PipeAtomic<uint64_t> maxLag;
+      // The write position this reader last saw.
+      uint64_t cachedWritePosition;
+      // Where readPosition moves to when the current element is done.
+      uint64_t nextReadPosition;
+      PipeAtomic<bool> isRunning;
+      WakeupPolicy wakeupPolicy;
+    };
+    ReaderState readers_[NUM_READERS];
+
+    EmbeddedBuffer<PIPE_SIZE> buffer_;
+
+    bool hasRoom(uint32_t size) NO_THROW;
+    void waitForRoom(uint32_t size);
+
+    char* startRead(uint32_t reader, uint32_t& length, PreWaitFunctor* func);
+    void finishRead(uint32_t reader);
+
+    void wakeup(const NoWakeupPolicy&) { }
+    void wakeupWriter(const NoWakeupPolicy&) { }
+    void wait(uint32_t reader, const NoWakeupPolicy&, PreWaitFunctor* func);
+    void parkWriter(uint32_t reader, const NoWakeupPolicy&, uint32_t size);
+
+    void wakeupReaders(const NoWakeupPolicy&) { }
+
+#ifdef __linux__
+    void wakeup(FutexWakeupPolicy& policy) { policy.wakeReader(); }
+    void wakeupWriter(FutexWakeupPolicy& policy) { policy.wakeWriter(); }
+    void wait(uint32_t reader, FutexWakeupPolicy& policy, PreWaitFunctor* func);
+    void parkWriter(uint32_t reader, FutexWakeupPolicy& policy, uint32_t size);
+
+    void wakeupReaders(FutexWakeupPolicy&) {
+      // One fence covers every reader's waiter flag.
+      fullFence();
+      for (uint32_t reader = 0; reader < NUM_READERS; ++reader)
+      {
+        readers_[reader].wakeupPolicy.wakeReaderAfterFence();
+      }
+    }
+#endif
+
+    void wakeupReaders() {
+      wakeupReaders(readers_[0].wakeupPolicy);
+    }
+  };
+
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::BroadcastPipe() :
+    cachedMinReadPosition_(0),
+    slowestReader_(0)
+  {
+    writePosition_.store(0);
+    numWritten_.store(0);
+    numFailedWrites_.store(0);
+    isWriterRunning_.store(true);
+
+    for (uint32_t reader = 0; reader < NUM_READERS; ++reader)
+    {
+      readers_[reader].readPosition.store(0);
+      readers_[reader].numRead.store(0);
+      readers_[reader].maxLag.store(0);
+      readers_[reader].cachedWritePosition = 0;
+      readers_[reader].nextReadPosition = 0;
+      readers_[reader].isRunning.store(true);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::stopWriter()
+  {
+    isWriterRunning_.store(false);
+    for (uint32_t reader = 0; reader < NUM_READERS; ++reader)
+    {
+      wakeupWriter(readers_[reader].wakeupPolicy);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  bool BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::hasRoom(uint32_t size) NO_THROW
+  {
+    const uint64_t writePosition = writePosition_.load();
+    if (writePosition + size - cachedMinReadPosition_ <= PIPE_SIZE)
+    {
+      return true;
+    }
+
+    // Only scan the readers when the cached minimum says full.
+    uint64_t minReadPosition = writePosition;
+    for (uint32_t reader = 0; reader < NUM_READERS; ++reader)
+    {
+      const uint64_t readPosition = readers_[reader].readPosition.loadAcquire();
+      if (readPosition < minReadPosition)
+      {
+        minReadPosition = readPosition;
+        slowestReader_ = reader;
+      }
+    }
+    cachedMinReadPosition_ = minReadPosition;
+
+    if (writePosition + size - minReadPosition <= PIPE_SIZE)
+    {
+      return true;
+    }
+
+    ReaderState& slowest = readers_[slowestReader_];
+    if (writePosition - minReadPosition > slowest.maxLag.load())
+    {
+      slowest.maxLag.store(writePosition - minReadPosition);
+    }
+    return false;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::waitForRoom(uint32_t size)
+  {
+    while (!hasRoom(size))
+    {
+      if (!isWriterRunning_.load())
+      {
+        throw Interrupted();
+      }
+      parkWriter(slowestReader_, readers_[slowestReader_].wakeupPolicy, size);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::push(const Data& value)
+  {
+    const uint32_t length = static_cast<uint32_t>(value.length());
+    if (length > MAX_PIPE_ELEMENT_SIZE)
+    {
+        std::cerr << "BroadcastPipe: Data Passed in is too large! Length: " << length << "\n";
+        numFailedWrites_.store(numFailedWrites_.load() + 1);
+        return;
+    }
+    if (!isWriterRunning_.load())
+    {
+      throw Interrupted();
+    }
+
+    const uint32_t recordSize = static_cast<uint32_t>(align_up<RECORD_ALIGNMENT>(HEADER_SIZE + length));
+    char* const buf = buffer_.data();
+
+    uint32_t offset = static_cast<uint32_t>(writePosition_.load() & (PIPE_SIZE - 1));
+    const uint32_t toEnd = PIPE_SIZE - offset;
+    if (recordSize > toEnd)
+    {
+      // Pad to the end of the ring and publish the padding on its own, so
+      // that an element as large as the ring can still be placed once the
+      // readers have skipped it.
+      waitForRoom(toEnd);
+      *reinterpret_cast<uint32_t*>(&buf[offset]) = PADDING;
+      writePosition_.storeRelease(writePosition_.load() + toEnd);
+      wakeupReaders();
+      offset = 0;
+    }
+
+    waitForRoom(recordSize);
+
+    *reinterpret_cast<uint32_t*>(&buf[offset]) = length;
+    std::memcpy(&buf[offset + HEADER_SIZE], value.data(), length);
+
+    numWritten_.store(numWritten_.load() + 1);
+    // Release: the element is visible before the readers see the new position
+    writePosition_.storeRelease(writePosition_.load() + recordSize);
+
+    wakeupReaders();
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  char* BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::startRead(uint32_t reader,
+                                                                           uint32_t& length,
+                                                                           PreWaitFunctor* func)
+  {
+    ReaderState& state = readers_[reader];
+    char* const buf = buffer_.data();
+    uint64_t readPosition = state.readPosition.load();
+
+    // Like LocklessPipe, a stopped reader is told so even if there is
+    // something to read.
+    if (!state.isRunning.load())
+    {
+      throw Interrupted();
+    }
+
+    for (;;)
+    {
+      if (readPosition == state.cachedWritePosition)
+      {
+        // Acquire: pairs with the writer's release of the write position
+        state.cachedWritePosition = writePosition_.loadAcquire();
+        while (readPosition == state.cachedWritePosition)
+        {
+          wait(reader, state.wakeupPolicy, func);
+          if (!state.isRunning.load())
+          {
+            throw Interrupted();
+          }
+          state.cachedWritePosition = writePosition_.loadAcquire();
+        }
+      }
+
+      const uint32_t offset = static_cast<uint32_t>(readPosition & (PIPE_SIZE - 1));
+      length = *reinterpret_cast<uint32_t*>(&buf[offset]);
+      if (length == PADDING)
+      {
+        // Hand the padding back straight away: the writer may need it for
+        // the element that follows.
+        readPosition += PIPE_SIZE - offset;
+        state.readPosition.storeRelease(readPosition);
+        wakeupWriter(state.wakeupPolicy);
+        continue;
+      }
+
+      state.nextReadPosition = readPosition +
+        static_cast<uint32_t>(align_up<RECORD_ALIGNMENT>(HEADER_SIZE + length));
+      return &buf[offset + HEADER_SIZE];
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::finishRead(uint32_t reader)
+  {
+    ReaderState& state = readers_[reader];
+
+    state.numRead.store(state.numRead.load() + 1);
+    // Release: this reader is done with the element before the writer can
+    // reuse its space.
+    state.readPosition.storeRelease(state.nextReadPosition);
+
+    wakeupWriter(state.wakeupPolicy);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::pop(uint32_t reader, Data& value,
+                                                                    void* buffer, PreWaitFunctor* func)
+  {
+    uint32_t length = 0;
+    const char* element = startRead(reader, length, func);
+    std::memcpy(buffer, element, length);
+    finishRead(reader);
+
+    value = Data(static_cast<char*>(buffer), length);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::peekView(uint32_t reader, Data& value,
+                                                                         PreWaitFunctor* func)
+  {
+    uint32_t length = 0;
+    char* element = startRead(reader, length, func);
+
+    value = Data(element, length);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::wait(uint32_t reader,
+                                                                     const NoWakeupPolicy&,
+                                                                     PreWaitFunctor* func)
+  {
+    while (isEmpty(reader) && readers_[reader].isRunning.load())
+    {
+      if (func != 0)
+      {
+        (*func)();
+      }
+      usleep(SLEEP_ON_BLOCK_USECS);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::parkWriter(uint32_t,
+                                                                           const NoWakeupPolicy&,
+                                                                           uint32_t)
+  {
+    usleep(SLEEP_ON_BLOCK_USECS);
+  }
+
+#ifdef __linux__
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::wait(uint32_t reader,
+                                                                     FutexWakeupPolicy& policy,
+                                                                     PreWaitFunctor* func)
+  {
+    while (isEmpty(reader) && readers_[reader].isRunning.load())
+    {
+      if (func != 0)
+      {
+        (*func)();
+      }
+
+      const int32_t seq = policy.prepareReaderPark();
+      if (!isEmpty(reader) || !readers_[reader].isRunning.load())
+      {
+        policy.cancelReaderPark();
+        break;
+      }
+      policy.parkReader(seq, 0);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  void BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::parkWriter(uint32_t reader,
+                                                                           FutexWakeupPolicy& policy,
+                                                                           uint32_t size)
+  {
+    // Sleep only while this (the slowest) reader is holding us back, as only
+    // its releases wake us.  If another reader is also behind, waitForRoom()
+    // will park on that one next.
+    const int32_t seq = policy.prepareWriterPark();
+    if (writePosition_.load() + size - readers_[reader].readPosition.loadAcquire() <= PIPE_SIZE ||
+        !isWriterRunning_.load())
+    {
+      policy.cancelWriterPark();
+      return;
+    }
+    policy.parkWriter(seq, 0);
+  }
+#endif
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  std::ostream& BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>::print(std::ostream& os) const
+  {
+    os << "\tPipe size (in bytes)        " << PIPE_SIZE << "\n"
+       << "\tWrite position              " << writePosition_.load() << "\n"
+       << "\tNum Written                 " << numWritten_.load() << "\n"
+       << "\tNum Failed Writes           " << numFailedWrites_.load() << "\n"
+       << "\tPipe Writer is running      " << std::boolalpha << isWriterRunning_.load() << "\n";
+
+    for (uint32_t reader = 0; reader < NUM_READERS; ++reader)
+    {
+      os << "\tReader " << reader << "\n"
+         << "\t  Num Read                  " << numRead(reader) << "\n"
+         << "\t  Lag (bytes)               " << lag(reader) << "\n"
+         << "\t  Lag (elements)            " << lagElements(reader) << "\n"
+         << "\t  Max lag when writer full  " << maxLag(reader) << "\n"
+         << "\t  Reader is running         " << std::boolalpha << isReaderRunning(reader) << "\n"
+         << "\t  Wakeup Policy             " << readers_[reader].wakeupPolicy << "\n";
+    }
+
+    return os;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, uint32_t NUM_READERS, class WakeupPolicy>
+  inline
+  std::ostream& operator<<(std::ostream& os, const BroadcastPipe<Data, PIPE_SIZE, NUM_READERS, WakeupPolicy>& pipe)
+  {
+    return pipe.print(os);
+  }
+
+} // Pipe
+
+
+#endif /* PIPE_BROADCAST_PIPE_HPP */
@@ -0,0 +1,151 @@
+#ifndef PIPE_EVENTFDWAKEUPPOLICY_HH
+#define PIPE_EVENTFDWAKEUPPOLICY_HH
+
+#ifdef __linux__
+
+#include "Errno.hh"
+#include "PipeAtomic.hh"
+#include "Utility.h"
+
+#include <ostream>
+#include <poll.h>
+#include <stdint.h>                       // To get int32_t, uint64_t
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Pipe {
+
+  /*
+   * Eventfd wakeup policy (Linux only).
+   *
+   * The reader's wakeups arrive on an eventfd, so a thread that also serves
+   * sockets, or reads from many pipes, can wait for all of them in a single
+   * epoll_wait() or poll() on fd().  A pipe's own blocking pop() waits on the
+   * same fd.
+   *
+   * The writer signals the fd only for an empty to non-empty transition the
+   * reader is waiting for: a reader that finds the pipe empty arms the fd
+   * (raising a waiter-present flag), and the next writer to publish clears
+   * the flag and makes the fd readable.  Pushes onto a pipe that is not
+   * being waited on cost a full fence and a load, never a system call.
+   *
+   * The protocol for a reader that waits outside the pipe is:
+   *
+   *   for (;;)
+   *     while (pipe.timedPop(data, buffer, 0))
+   *       handle data;
+   *     if (pipe.armReader())          // still empty, fd armed
+   *       epoll_wait(...);             // fd() becomes readable on new data
+   *
+   * armReader() drains the eventfd, so the fd is only readable while the
+   * pipe has data it has not been told about.  It returns false, without
+   * arming, if data arrived in the meantime.
+   *
+   * The writer has no fd; when the pipe is full it polls with usleep, as
+   * with NoWakeupPolicy.  The eventfd belongs to the creating process, so
+   * this policy cannot be used for a pipe shared between processes.
+   */
+  class EventFdWakeupPolicy
+  {
+    public:
+      // The eventfd belongs to the process that created the pipe.
+      enum { SHAREABLE = 0 };
+
+      /*
+       * \throws Errno if the eventfd cannot be created
+       */
+      EventFdWakeupPolicy() :
+        fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        readerWaiting_(0),
+        numReaderParks_(0),
+        numReaderWakeups_(0)
+      {
+        if (fd_ == -1)
+        {
+          throw Errno("creating eventfd");
+        }
+      }
+
+      ~EventFdWakeupPolicy() {
+        close(fd_);
+      }
+
+      /*
+       * The fd to poll for readability.
+       */
+      int fd() const NO_THROW {
+        return fd_;
+      }
+
+      void prepareReaderPark() NO_THROW {
+        // Forget wakeups for data the reader has already seen.
+        uint64_t count;
+        while (read(fd_, &count, sizeof(count)) == sizeof(count))
+        {
+        }
+        readerWaiting_.store(1);
+
+        // StoreLoad: the flag must be visible before the caller re-checks the
+        // pipe, pairing with the fence in wakeReader().
+        fullFence();
+      }
+      /*
+       * Wait for the fd, at most timeOut (NULL for no limit).
+       */
+      void parkReader(const struct timespec* timeOut) NO_THROW {
+        numReaderParks_.store(numReaderParks_.load() + 1);
+        struct pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        // EINTR and a timeout just mean the caller should re-check the pipe.
+        ppoll(&pfd, 1, timeOut, NULL);
+        readerWaiting_.store(0);
+      }
+      void cancelReaderPark() NO_THROW {
+        readerWaiting_.store(0);
+      }
+      void wakeReader() NO_THROW {
+        // StoreLoad: the new pointer must be visible before the flag is
+        // checked, pairing with the fence in prepareReaderPark().
+        fullFence();
+
+        // Only the first waker after the reader armed pays for the system call.
+        if (readerWaiting_.load() && readerWaiting_.compareExchange(1, 0))
+        {
+          const uint64_t one = 1;
+          ssize_t written = write(fd_, &one, sizeof(one));
+          (void)written;
+          numReaderWakeups_.fetchAdd(1);
+        }
+      }
+
+      friend std::ostream& operator<<(std::ostream& os, const EventFdWakeupPolicy& policy)
+      {
+        return os << "EventFd Wakeup Policy"
+                  << " (fd: "             << policy.fd_
+                  << ", reader parks: "   << policy.numReaderParks_.load()
+                  << ", reader wakeups: " << policy.numReaderWakeups_.load() << ")";
+      }
+
+    private:
+      const int fd_;
+      PipeAtomic<int32_t> readerWaiting_;
+
+      // Statistics.  The park counter is only bumped by the reader, but is
+      // printed from any thread.  The wakeup counter may be bumped by
+      // stopReader() as well as the writer, but only alongside a system call.
+      PipeAtomic<uint64_t> numReaderParks_;
+      PipeAtomic<uint64_t> numReaderWakeups_;
+
+      // Not copyable: the fd has one owner.
+      EventFdWakeupPolicy(const EventFdWakeupPolicy&);
+      EventFdWakeupPolicy& operator=(const EventFdWakeupPolicy&);
+  };
+
+} // Pipe
+
+#endif /* __linux__ */
+
+#endif /* PIPE_EVENTFDWAKEUPPOLICY_HH */
@@ -0,0 +1,499 @@
+#ifndef PIPE_FIXED_SIZE_PIPE_HPP
+#define PIPE_FIXED_SIZE_PIPE_HPP
+
+#include "LocklessPipe.hpp"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "Utility.h"
+
+#include <iostream>
+#include <new>
+#include <stdint.h>                       // To get uint32_t, uint64_t
+#include <unistd.h>
+#if __cplusplus > 199711L
+#include <utility>                        // To get std::move, std::forward
+#endif
+
+namespace Pipe {
+
+  /*
+   * A single writer / single reader pipe of T objects, for when every element
+   * has the same type.
+   *
+   * Where LocklessPipe copies bytes behind a length prefix and decides at
+   * every element whether to wrap, this stores each T directly in a slot of
+   * sizeof(T) bytes.  CAPACITY is a power of two, so a slot is found by
+   * masking a free-running 64-bit position, and the pipe holds exactly
+   * CAPACITY elements.  Like LocklessPipe, each side keeps a cached copy of
+   * the other side's position and only touches the other side's cache line
+   * when the copy says the pipe is full (or empty).
+   *
+   * Elements are constructed in place by push() or emplace() and destroyed
+   * by pop(), so T need not be default constructible.  With a C++11 compiler
+   * T may be move-only: push(T&&) and pop() move rather than copy.
+   *
+   * NoWakeupPolicy polls with usleep; FutexWakeupPolicy parks either side;
+   * AdaptiveWakeupPolicy spins, then yields, then parks, as for LocklessPipe.
+   */
+  template<class T, uint32_t CAPACITY, class WakeupPolicy = NoWakeupPolicy>
+  class FixedSizePipe {
+    /*
+     * The amount of time read/write will sleep from when the pipe is
+     * empty/full (NoWakeupPolicy only).
+     */
+    enum { SLEEP_ON_BLOCK_USECS = 1000 };
+
+    CT_ASSERT(CapacityIsPowerOfTwo, CAPACITY != 0 && (CAPACITY & (CAPACITY - 1)) == 0);
+    // Slots are aligned by being a whole number of sizeof(T) from a cache
+    // line aligned start.
+    CT_ASSERT(SlotAlignment, __alignof__(T) <= PIPE_CACHE_LINE_SIZE);
+
+    public:
+
+    typedef T ValueType;
+
+    /*
+     * Constructor
+     */
+    explicit FixedSizePipe();
+
+    /*
+     * Destroys any elements still in the pipe.
+     */
+    ~FixedSizePipe();
+
+    /*
+     * push a copy of 'value' into the pipe, blocking if it is full.
+     * \throws Interrupted if the writer has been stopped.
+     */
+    void push(const T& value) {
+      new (startPush(true)) T(value);
+      finishPush();
+    }
+    /*
+     * push a copy of 'value' into the pipe if it is not full.
+     * \return true if pushed, false if the pipe was full
+     * \throws Interrupted if the writer has been stopped.
+     */
+    bool tryPush(const T& value) {
+      T* slot = startPush(false);
+      if (slot == NULL)
+      {
+        return false;
+      }
+      new (slot) T(value);
+      finishPush();
+      return true;
+    }
+#if __cplusplus > 199711L
+    void push(T&& value) {
+      new (startPush(true)) T(std::move(value));
+      finishPush();
+    }
+    bool tryPush(T&& value) {
+      T* slot = startPush(false);
+      if (slot == NULL)
+      {
+        return false;
+      }
+      new (slot) T(std::move(value));
+      finishPush();
+      return true;
+    }
+    /*
+     * Construct an element in the pipe from 'args', blocking if it is full.
+     * \throws Interrupted if the writer has been stopped.
+     */
+    template<class... Args>
+    void emplace(Args&&... args) {
+      new (startPush(true)) T(std::forward<Args>(args)...);
+      finishPush();
+    }
+#endif
+
+    /*
+     * pop the oldest element into 'value', blocking if the pipe is empty.
+     * \param value assigned (moved, with C++11) from the element
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \throws Interrupted if the reader has been stopped.
+     */
+    void pop(T& value, PreWaitFunctor* func = 0);
+    /*
+     * pop the oldest element into 'value' if there is one, whether or not the
+     * reader is running.
+     * \return true if popped, false if the pipe was empty
+     */
+    bool tryPop(T& value);
+    /*
+     * The oldest element, left in the pipe, or NULL if the pipe is empty.
+     * It stays valid until the reader's next pop().
+     */
+    T* front() NO_THROW {
+      return isEmptyForReader() ? NULL : slotAt(headPosition_.load());
+    }
+
+    bool isWriterRunning() const NO_THROW {
+      return isWriterRunning_.load();
+    }
+    bool isReaderRunning() const NO_THROW {
+      return isReaderRunning_.load();
+    }
+    void startWriter() {
+      isWriterRunning_.store(true);
+    }
+    /*
+     * Stop the writer.
+     * All subsequent calls to push will throw Interrupted exceptions.
+     */
+    void stopWriter() {
+      isWriterRunning_.store(false);
+      wakeupWriter(wakeupPolicy_);
+    }
+    void startReader() {
+      isReaderRunning_.store(true);
+    }
+    /*
+     * Stop the reader.
+     * All subsequent calls to pop will throw Interrupted exceptions.
+     */
+    void stopReader() {
+      isReaderRunning_.store(false);
+      wakeup(wakeupPolicy_);
+    }
+    bool isEmpty() const NO_THROW {
+      return headPosition_.load() == tailPosition_.loadAcquire();
+    }
+    /*
+     * How many elements are in the pipe, as of some recent moment.
+     */
+    uint64_t size() const NO_THROW {
+      return tailPosition_.load() - headPosition_.load();
+    }
+    uint32_t capacity() const NO_THROW {
+      return CAPACITY;
+    }
+    uint64_t numRead() const NO_THROW {
+      return headPosition_.load();
+    }
+    uint64_t numWritten() const NO_THROW {
+      return tailPosition_.load();
+    }
+    WakeupPolicy& getWakeupPolicy() NO_THROW {
+      return wakeupPolicy_;
+    }
+    /*
+     * print stats about the pipe
+     */
+    std::ostream& print(std::ostream& os) const;
+
+
+    private:
+    // Producer-owned.  The position of the next slot to write; it is also
+    // the number of elements ever written.
+    PIPE_CALIGNED PipeAtomic<uint64_t> tailPosition_;
+    // The writer's last look at headPosition_.
+    uint64_t cachedHeadPosition_;
+    PipeAtomic<bool> isWriterRunning_;
+
+    // Consumer-owned.  The position of the next slot to read.
+    PIPE_CALIGNED PipeAtomic<uint64_t> headPosition_;
+    // The reader's last look at tailPosition_.
+    uint64_t cachedTailPosition_;
+    PipeAtomic<bool> isReaderRunning_;
+
+    PIPE_CALIGNED WakeupPolicy wakeupPolicy_;
+
+    PIPE_CALIGNED char slots_[CAPACITY * sizeof(T)];
+
+    T* slotAt(uint64_t position) NO_THROW {
+      return reinterpret_cast<T*>(&slots_[(position & (CAPACITY - 1)) * sizeof(T)]);
+    }
+
+    bool isFullForWriter(uint64_t tail) NO_THROW {
+      if (tail - cachedHeadPosition_ < CAPACITY)
+      {
+        return false;
+      }
+      // Acquire: the reader has destroyed the element it released.
+      cachedHeadPosition_ = headPosition_.loadAcquire();
+      return tail - cachedHeadPosition_ >= CAPACITY;
+    }
+    bool isFull() const NO_THROW {
+      return tailPosition_.load() - headPosition_.loadAcquire() >= CAPACITY;
+    }
+
+    bool isEmptyForReader() NO_THROW {
+      const uint64_t head = headPosition_.load();
+      if (head != cachedTailPosition_)
+      {
+        return false;
+      }
+      // Acquire: the writer's element is constructed.
+      cachedTailPosition_ = tailPosition_.loadAcquire();
+      return head == cachedTailPosition_;
+    }
+
+    /*
+     * The slot to construct the next element in, or NULL if the pipe is full
+     * and block is false.
+     */
+    T* startPush(bool block);
+    void finishPush();
+
+    void wakeup(const NoWakeupPolicy&) { }
+    void wakeupWriter(const NoWakeupPolicy&) { }
+    void wait(const NoWakeupPolicy&, PreWaitFunctor* func);
+    void waitForRoom(const NoWakeupPolicy&);
+
+#ifdef __linux__
+    void wakeup(FutexWakeupPolicy& policy) { policy.wakeReader(); }
+    void wakeupWriter(FutexWakeupPolicy& policy) { policy.wakeWriter(); }
+    void wait(FutexWakeupPolicy& policy, PreWaitFunctor* func);
+    void waitForRoom(FutexWakeupPolicy& policy);
+
+    void wait(AdaptiveWakeupPolicy& policy, PreWaitFunctor* func);
+    void waitForRoom(AdaptiveWakeupPolicy& policy);
+#endif
+
+    // Not copyable
+    FixedSizePipe(const FixedSizePipe&);
+    FixedSizePipe& operator=(const FixedSizePipe&);
+  };
+
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  FixedSizePipe<T, CAPACITY, WakeupPolicy>::FixedSizePipe() :
+    cachedHeadPosition_(0),
+    cachedTailPosition_(0)
+  {
+    tailPosition_.store(0);
+    isWriterRunning_.store(true);
+
+    headPosition_.store(0);
+    isReaderRunning_.store(true);
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  FixedSizePipe<T, CAPACITY, WakeupPolicy>::~FixedSizePipe()
+  {
+    const uint64_t tail = tailPosition_.loadAcquire();
+    for (uint64_t position = headPosition_.load(); position != tail; ++position)
+    {
+      slotAt(position)->~T();
+    }
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  T* FixedSizePipe<T, CAPACITY, WakeupPolicy>::startPush(bool block)
+  {
+    const uint64_t tail = tailPosition_.load();
+    while (isFullForWriter(tail))
+    {
+      if (!isWriterRunning_.load())
+      {
+        throw Interrupted();
+      }
+      if (!block)
+      {
+        return NULL;
+      }
+      waitForRoom(wakeupPolicy_);
+    }
+
+    if (!isWriterRunning_.load())
+    {
+      throw Interrupted();
+    }
+
+    return slotAt(tail);
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::finishPush()
+  {
+    // Release: the element is constructed before the reader can see it.
+    tailPosition_.storeRelease(tailPosition_.load() + 1);
+
+    wakeup(wakeupPolicy_);
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  bool FixedSizePipe<T, CAPACITY, WakeupPolicy>::tryPop(T& value)
+  {
+    if (isEmptyForReader())
+    {
+      return false;
+    }
+
+    const uint64_t head = headPosition_.load();
+    T* slot = slotAt(head);
+#if __cplusplus > 199711L
+    value = std::move(*slot);
+#else
+    value = *slot;
+#endif
+    slot->~T();
+
+    // Release: the slot is finished with before the writer can reuse it.
+    headPosition_.storeRelease(head + 1);
+
+    wakeupWriter(wakeupPolicy_);
+    return true;
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::pop(T& value, PreWaitFunctor* func)
+  {
+    for (;;)
+    {
+      // Like LocklessPipe, a stopped reader is told so even if there is
+      // something to pop.
+      if (!isReaderRunning_.load())
+      {
+        throw Interrupted();
+      }
+      if (tryPop(value))
+      {
+        return;
+      }
+      wait(wakeupPolicy_, func);
+    }
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::wait(const NoWakeupPolicy&, PreWaitFunctor* func)
+  {
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      if (func != 0)
+      {
+        (*func)();
+      }
+      usleep(SLEEP_ON_BLOCK_USECS);
+    }
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::waitForRoom(const NoWakeupPolicy&)
+  {
+    usleep(SLEEP_ON_BLOCK_USECS);
+  }
+
+#ifdef __linux__
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::wait(FutexWakeupPolicy& policy, PreWaitFunctor* func)
+  {
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      if (func != 0)
+      {
+        (*func)();
+      }
+
+      const int32_t seq = policy.prepareReaderPark();
+      if (!isEmpty() || !isReaderRunning_.load())
+      {
+        policy.cancelReaderPark();
+        break;
+      }
+      policy.parkReader(seq, 0);
+    }
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::waitForRoom(FutexWakeupPolicy& policy)
+  {
+    const int32_t seq = policy.prepareWriterPark();
+    if (!isFull() || !isWriterRunning_.load())
+    {
+      policy.cancelWriterPark();
+      return;
+    }
+    policy.parkWriter(seq, 0);
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::wait(AdaptiveWakeupPolicy& policy, PreWaitFunctor* func)
+  {
+    const uint64_t startNSecs = monotonicNSecs();
+    AdaptiveWakeupPolicy::Phase phase = AdaptiveWakeupPolicy::SPIN;
+
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      phase = policy.phaseAfter(monotonicNSecs() - startNSecs);
+      if (phase == AdaptiveWakeupPolicy::PARK)
+      {
+        wait(static_cast<FutexWakeupPolicy&>(policy), func);
+      }
+      else
+      {
+        AdaptiveWakeupPolicy::backOff(phase);
+      }
+    }
+
+    policy.recordReaderWait(phase);
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  void FixedSizePipe<T, CAPACITY, WakeupPolicy>::waitForRoom(AdaptiveWakeupPolicy& policy)
+  {
+    const uint64_t startNSecs = monotonicNSecs();
+    AdaptiveWakeupPolicy::Phase phase = AdaptiveWakeupPolicy::SPIN;
+
+    // As in LocklessPipe, the whole wait happens here and is recorded once,
+    // in the phase it ended in.
+    while (isFull() && isWriterRunning_.load())
+    {
+      phase = policy.phaseAfter(monotonicNSecs() - startNSecs);
+      if (phase == AdaptiveWakeupPolicy::PARK)
+      {
+        waitForRoom(static_cast<FutexWakeupPolicy&>(policy));
+      }
+      else
+      {
+        AdaptiveWakeupPolicy::backOff(phase);
+      }
+    }
+
+    policy.recordWriterWait(phase);
+  }
+#endif
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  std::ostream& FixedSizePipe<T, CAPACITY, WakeupPolicy>::print(std::ostream& os) const
+  {
+    os << "\tElements in pipe            " << size() << "\n"
+       << "\tCapacity (in elements)      " << CAPACITY << "\n"
+       << "\tElement size (in bytes)     " << sizeof(T) << "\n"
+       << "\tNum Written                 " << numWritten() << "\n"
+       << "\tNum Read                    " << numRead() << "\n"
+       << "\tPipe Writer is running      " << std::boolalpha << isWriterRunning_.load() << "\n"
+       << "\tPipe Reader is running      " << std::boolalpha << isReaderRunning_.load() << "\n"
+       << "\tWakeup Policy               " << wakeupPolicy_;
+
+    return os;
+  }
+
+  template<class T, uint32_t CAPACITY, class WakeupPolicy>
+  inline
+  std::ostream& operator<<(std::ostream& os, const FixedSizePipe<T, CAPACITY, WakeupPolicy>& pipe)
+  {
+    return pipe.print(os);
+  }
+
+} // Pipe
+
+#endif /* PIPE_FIXED_SIZE_PIPE_HPP */
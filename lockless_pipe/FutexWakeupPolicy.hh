@@ -0,0 +1,171 @@
+#ifndef PIPE_FUTEXWAKEUPPOLICY_HH
+#define PIPE_FUTEXWAKEUPPOLICY_HH
+
+#ifdef __linux__
+
+#include "PipeAtomic.hh"
+#include "Utility.h"
+
+#include <linux/futex.h>
+#include <ostream>
+#include <stdint.h>                       // To get int32_t, uint64_t
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Pipe {
+
+  /*
+   * Futex wakeup policy (Linux only).
+   *
+   * A reader that finds the pipe empty, or a writer that finds it full, parks
+   * in the kernel on a futex word instead of polling with usleep.  Each side
+   * has its own futex word and waiter-present flag; the other side only issues
+   * a FUTEX_WAKE when it sees the flag set, so an uncontended push or pop costs
+   * a full fence and a load, never a system call.
+   *
+   * The protocol for each side is:
+   *
+   * WAITER:
+   *   seq = prepareReaderPark();      // snapshot the word, raise the flag
+   *   if (condition still holds)
+   *     parkReader(seq, timeOut);     // FUTEX_WAIT on the snapshot
+   *   else
+   *     cancelReaderPark();
+   *
+   * WAKER:
+   *   publish the new read/write pointer;
+   *   wakeReader();                   // fence, and only if the flag is set,
+   *                                   // bump the word and FUTEX_WAKE
+   *
+   * The futex calls are deliberately not FUTEX_PRIVATE_FLAG'ed, so the policy
+   * keeps working when the pipe lives in memory shared between processes.
+   */
+  class FutexWakeupPolicy
+  {
+    public:
+      // Both futex words live in the policy, and the calls are not private.
+      enum { SHAREABLE = 1 };
+
+      FutexWakeupPolicy() NO_THROW :
+        readerSeq_(0),
+        readerWaiting_(0),
+        writerSeq_(0),
+        writerWaiting_(0),
+        numReaderParks_(0),
+        numWriterParks_(0),
+        numReaderWakeups_(0),
+        numWriterWakeups_(0)
+      {
+      }
+
+      int32_t prepareReaderPark() NO_THROW {
+        return prepare(readerSeq_, readerWaiting_);
+      }
+      void parkReader(int32_t seq, const struct timespec* timeOut) NO_THROW {
+        numReaderParks_.store(numReaderParks_.load() + 1);
+        park(readerSeq_, readerWaiting_, seq, timeOut);
+      }
+      void cancelReaderPark() NO_THROW {
+        readerWaiting_.store(0);
+      }
+      void wakeReader() NO_THROW {
+        wake(readerSeq_, readerWaiting_, numReaderWakeups_);
+      }
+      /*
+       * wakeReader() for a waker that has already issued the full fence
+       * itself, such as one publish waking the readers of many policies.
+       */
+      void wakeReaderAfterFence() NO_THROW {
+        wakeIfWaiting(readerSeq_, readerWaiting_, numReaderWakeups_);
+      }
+
+      int32_t prepareWriterPark() NO_THROW {
+        return prepare(writerSeq_, writerWaiting_);
+      }
+      void parkWriter(int32_t seq, const struct timespec* timeOut) NO_THROW {
+        numWriterParks_.store(numWriterParks_.load() + 1);
+        park(writerSeq_, writerWaiting_, seq, timeOut);
+      }
+      void cancelWriterPark() NO_THROW {
+        writerWaiting_.store(0);
+      }
+      void wakeWriter() NO_THROW {
+        wake(writerSeq_, writerWaiting_, numWriterWakeups_);
+      }
+
+      friend std::ostream& operator<<(std::ostream& os, const FutexWakeupPolicy& policy)
+      {
+        return os << "Futex Wakeup Policy"
+                  << " (reader parks: "   << policy.numReaderParks_.load()
+                  << ", writer parks: "   << policy.numWriterParks_.load()
+                  << ", reader wakeups: " << policy.numReaderWakeups_.load()
+                  << ", writer wakeups: " << policy.numWriterWakeups_.load() << ")";
+      }
+
+    private:
+      // The futex words.  Bumped by the waker before every FUTEX_WAKE so that a
+      // waiter which snapshotted the old value never sleeps through the wakeup.
+      PipeAtomic<int32_t> readerSeq_;
+      PipeAtomic<int32_t> readerWaiting_;
+      PipeAtomic<int32_t> writerSeq_;
+      PipeAtomic<int32_t> writerWaiting_;
+
+      // Statistics.  The park counters have a single writer, so a relaxed
+      // load and store is enough, but are printed from any thread; the wakeup
+      // counters may have several writers (see MultiProducerPipe), but are
+      // only bumped alongside a system call.
+      PipeAtomic<uint64_t> numReaderParks_;
+      PipeAtomic<uint64_t> numWriterParks_;
+      PipeAtomic<uint64_t> numReaderWakeups_;
+      PipeAtomic<uint64_t> numWriterWakeups_;
+
+      static int32_t prepare(PipeAtomic<int32_t>& seq, PipeAtomic<int32_t>& waiting) NO_THROW
+      {
+        const int32_t snapshot = seq.load();
+        waiting.store(1);
+
+        // StoreLoad: the flag must be visible before the caller re-checks the
+        // pipe, pairing with the fence in wake().
+        fullFence();
+
+        return snapshot;
+      }
+
+      static void park(PipeAtomic<int32_t>& seq, PipeAtomic<int32_t>& waiting,
+                       int32_t snapshot, const struct timespec* timeOut) NO_THROW
+      {
+        // EAGAIN (already woken), EINTR and ETIMEDOUT all just mean the
+        // caller should re-check the pipe.
+        syscall(SYS_futex, seq.address(), FUTEX_WAIT, snapshot, timeOut, NULL, 0);
+        waiting.store(0);
+      }
+
+      static void wake(PipeAtomic<int32_t>& seq, PipeAtomic<int32_t>& waiting,
+                       PipeAtomic<uint64_t>& numWakeups) NO_THROW
+      {
+        // StoreLoad: the new pointer must be visible before the flag is
+        // checked, pairing with the fence in prepare().
+        fullFence();
+
+        wakeIfWaiting(seq, waiting, numWakeups);
+      }
+
+      static void wakeIfWaiting(PipeAtomic<int32_t>& seq, PipeAtomic<int32_t>& waiting,
+                                PipeAtomic<uint64_t>& numWakeups) NO_THROW
+      {
+        // Only the first waker after a park pays for the system call.
+        if (waiting.load() && waiting.compareExchange(1, 0))
+        {
+          seq.fetchAdd(1);
+          syscall(SYS_futex, seq.address(), FUTEX_WAKE, 1, NULL, NULL, 0);
+          numWakeups.fetchAdd(1);
+        }
+      }
+  };
+
+} // Pipe
+
+#endif /* __linux__ */
+
+#endif /* PIPE_FUTEXWAKEUPPOLICY_HH */
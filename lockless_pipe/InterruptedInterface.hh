@@ -14,6 +14,30 @@ namespace Pipe {
         return "InterruptedInterface";
       }
   };
+
+  /*
+   * Thrown by a pipe end that has been stopped, to unblock the thread
+   * using it.
+   */
+  class Interrupted : public InterruptedInterface {
+    public:
+      Interrupted() throw () {}
+      char const * what() const throw () {
+        return "Interrupted";
+      }
+  };
+
+  /*
+   * Thrown by the reader when the pipe handed it something it cannot
+   * use, e.g. a pop() that came back without an element.
+   */
+  class InternalReadError : public std::exception {
+    public:
+      InternalReadError() throw () {}
+      char const * what() const throw () {
+        return "InternalReadError";
+      }
+  };
 } // Pipe
 
 #endif /* PIPE_INTERRUPTEDINTERFACE_HH */
@@ -0,0 +1,168 @@
+#ifndef PIPE_LATENCYHISTOGRAM_HH
+#define PIPE_LATENCYHISTOGRAM_HH
+
+#include "PipeAtomic.hh"
+#include "Utility.h"
+
+#include <ostream>
+#include <stdint.h>                       // To get uint32_t, uint64_t
+
+namespace Pipe {
+
+  /*
+   * A log-linear histogram of latencies in nanoseconds, in the style of
+   * HdrHistogram.  Values below SUB_BUCKETS are counted exactly; above that
+   * each power of two is split into SUB_BUCKETS linear buckets, so a value
+   * is reported to within 1/SUB_BUCKETS (about 3%) whatever its magnitude,
+   * in a fixed 15KB of counters.
+   *
+   * One thread records.  Every counter is a relaxed PipeAtomic, so any other
+   * thread can read the histogram at any time without stopping the recorder;
+   * it sees each counter either before or after a given record(), which is
+   * all a latency report needs.
+   */
+  class LatencyHistogram
+  {
+    public:
+      enum { SUB_BUCKET_BITS = 5, SUB_BUCKETS = 1 << SUB_BUCKET_BITS };
+      enum { NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS };
+
+      LatencyHistogram() NO_THROW {
+        reset();
+      }
+
+      /*
+       * Count one value.  Only one thread may record into a histogram.
+       */
+      void record(uint64_t value) NO_THROW {
+        PipeAtomic<uint64_t>& bucket = counts_[bucketOf(value)];
+        bucket.store(bucket.load() + 1);
+        total_.store(total_.load() + 1);
+        if (value < min_.load())
+        {
+          min_.store(value);
+        }
+        if (value > max_.load())
+        {
+          max_.store(value);
+        }
+      }
+
+      /*
+       * Only safe while nothing is recording.
+       */
+      void reset() NO_THROW {
+        for (uint32_t bucket = 0; bucket < NUM_BUCKETS; ++bucket)
+        {
+          counts_[bucket].store(0);
+        }
+        total_.store(0);
+        min_.store(static_cast<uint64_t>(-1));
+        max_.store(0);
+      }
+
+      uint64_t count() const NO_THROW {
+        return total_.load();
+      }
+      uint64_t min() const NO_THROW {
+        return total_.load() == 0 ? 0 : min_.load();
+      }
+      uint64_t max() const NO_THROW {
+        return max_.load();
+      }
+
+      /*
+       * The value below which 'percentile' percent of the recorded values
+       * fall, rounded up to the top of its bucket (and capped at max()).
+       */
+      uint64_t valueAtPercentile(double percentile) const NO_THROW {
+        const uint64_t total = total_.load();
+        if (total == 0)
+        {
+          return 0;
+        }
+        uint64_t wanted = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+        if (wanted < 1)
+        {
+          wanted = 1;
+        }
+
+        uint64_t seen = 0;
+        for (uint32_t bucket = 0; bucket < NUM_BUCKETS; ++bucket)
+        {
+          seen += counts_[bucket].load();
+          if (seen >= wanted)
+          {
+            const uint64_t value = highestValueIn(bucket);
+            return value < max_.load() ? value : max_.load();
+          }
+        }
+        return max_.load();
+      }
+
+      /*
+       * Print the percentile ladder HdrHistogram users expect.
+       */
+      std::ostream& print(std::ostream& os) const {
+        static const double PERCENTILES[] = { 50.0, 90.0, 99.0, 99.9, 99.99, 99.999 };
+
+        os << "count " << count() << " min " << min();
+        for (uint32_t i = 0; i < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); ++i)
+        {
+          os << " p" << PERCENTILES[i] << " " << valueAtPercentile(PERCENTILES[i]);
+        }
+        return os << " max " << max() << " (nsecs)";
+      }
+
+      friend std::ostream& operator<<(std::ostream& os, const LatencyHistogram& histogram)
+      {
+        return histogram.print(os);
+      }
+
+    private:
+      PipeAtomic<uint64_t> counts_[NUM_BUCKETS];
+      PipeAtomic<uint64_t> total_;
+      PipeAtomic<uint64_t> min_;
+      PipeAtomic<uint64_t> max_;
+
+      static uint32_t mostSignificantBit(uint64_t value) NO_THROW {
+        uint32_t msb = 0;
+        for (uint32_t shift = 32; shift > 0; shift /= 2)
+        {
+          if (value >> shift)
+          {
+            value >>= shift;
+            msb += shift;
+          }
+        }
+        return msb;
+      }
+
+      static uint32_t bucketOf(uint64_t value) NO_THROW {
+        if (value < SUB_BUCKETS)
+        {
+          return static_cast<uint32_t>(value);
+        }
+        // The top SUB_BUCKET_BITS + 1 bits of the value pick the bucket.
+        const uint32_t shift = mostSignificantBit(value) - SUB_BUCKET_BITS;
+        return shift * SUB_BUCKETS + static_cast<uint32_t>(value >> shift);
+      }
+
+      static uint64_t highestValueIn(uint32_t bucket) NO_THROW {
+        if (bucket < 2 * SUB_BUCKETS)
+        {
+          return bucket;
+        }
+        const uint32_t shift = bucket / SUB_BUCKETS - 1;
+        const uint64_t top = bucket - shift * SUB_BUCKETS;
+        return ((top + 1) << shift) - 1;
+      }
+
+      // Not copyable
+      LatencyHistogram(const LatencyHistogram&);
+      LatencyHistogram& operator=(const LatencyHistogram&);
+  };
+
+} // Pipe
+
+#endif /* PIPE_LATENCYHISTOGRAM_HH */
@@ -1,8 +1,15 @@
 #ifndef PIPE_LOCKLESS_PIPE_BUF_HPP
 #define PIPE_LOCKLESS_PIPE_BUF_HPP
 
-#include "Atom/Atom.hh"
+#include "AdaptiveWakeupPolicy.hh"
+#include "Errno.hh"
+#include "EventFdWakeupPolicy.hh"
+#include "FutexWakeupPolicy.hh"
 #include "InterruptedInterface.hh"
+#include "MonotonicClock.hh"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "PipeStats.hh"
 
 #include <cerrno>                         // To get ETIMEDOUT
 #include <cstring>
@@ -11,41 +18,54 @@
 #include <iostream>
 #include <pthread.h>
 #include <stdint.h>                       // To get uint32_t, uint64_t
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
 namespace Pipe {
 
   // Whether LocklessPipe class will be used by multiple processes or a
-  // single process with multiple threads.  Only to be considered when
-  // using the MutexWakeupPolicy template parameter.
+  // single process with multiple threads.  SharedPipeFactory places
+  // PROCESS_SHARED pipes in POSIX shared memory, PersistentPipeFactory in a
+  // file that outlives the processes.
   namespace SharedType {
     enum Type { PROCESS_SHARED, PROCESS_PRIVATE };
   }
 
+  // What push() does when the pipe is full: wait for room, or drop the new
+  // element (counting it in numFailedWrites()) so the writer never stalls.
+  namespace OverflowPolicy {
+    enum Type { BLOCK, DROP_NEWEST };
+  }
+
   class NoWakeupPolicy;
   class NoWakeupUsecPolicy;
+  class FutexWakeupPolicy;
+  class AdaptiveWakeupPolicy;
+  class EventFdWakeupPolicy;
 
 
   /*
-   * A Base class for passing callbacks into the pop() and timedpop() functions
+   * A Base class for passing callbacks into the pop() and timedPop() functions
    * of the lockless pipe. These callbacks are called just before the pipe goes
-   * to sleep, employing either NoWakeupPolicy or MutexWakeupPolicy.
+   * to sleep, employing either NoWakeupPolicy or MutexWakeupPolicy.  Passed to
+   * push() or pushFor(), they are called just before the writer waits for
+   * room, as a backpressure signal.
    */
 
   class PreWaitFunctor {
     public:
-      virtual ~PreWaitFunction() { }
+      virtual ~PreWaitFunctor() { }
       virtual void operator()() = 0;
   };
 
 
   /*
    * A single reader / single writer pipe that allows data of varying length.
-   * The implementation of read/write is lockless (uses read and write memory
-   * barriers via MemoryFence).  Whether the class is composed of any locks
-   * is dependent on the wakeup policy, which is a template parameter.
+   * The implementation of read/write is lockless: the writer publishes
+   * writeVPtr_ with a release store and the reader consumes it with an
+   * acquire load, and vice versa for readVPtr_ (see PipeAtomic).  Whether the
+   * class is composed of any locks is dependent on the wakeup policy, which is
+   * a template parameter.
    *
    * The wakeup policy specifies how the writer wakes up the reader (when the
    * reader is waiting on an empty pipe).
@@ -54,8 +74,42 @@ namespace Pipe {
    * blocking read (via the pop method) from the empty pipe, it will just poll
    * (and usleep) until the pipe has data.  In this case the wakeupReader
    * method is a NO-OP.
+   *
+   * The class FutexWakeupPolicy (Linux only) parks an empty reader, or a full
+   * writer, on a futex.  The other side issues a FUTEX_WAKE only when a waiter
+   * is present, so neither side pays the usleep granularity on a handoff.
+   *
+   * The class AdaptiveWakeupPolicy (Linux only) spins, then yields, then parks
+   * on the futex, with the spin and yield budgets tunable per pipe through
+   * getWakeupPolicy().
+   *
+   * The class EventFdWakeupPolicy (Linux only) wakes the reader through an
+   * eventfd, signalled only when an empty pipe the reader is waiting on gets
+   * data.  A reader can arm it with armReader() and wait on its fd in epoll
+   * alongside sockets and other pipes.
+   *
+   * Each wakeup policy sets SHAREABLE when it keeps all of its state inside
+   * the policy object, so it still works with the pipe placed in memory
+   * shared between processes; EventFdWakeupPolicy's fd does not.
+   *
+   * The buffer policy specifies where the ring lives.  EmbeddedBuffer keeps it
+   * inside the pipe object and never splits an element across the end of the
+   * ring, so elements are limited to just under half the pipe size.
+   * MirroredBuffer (Linux only) maps the ring twice back to back, so an
+   * element may run past the end and still be contiguous; elements can then
+   * be nearly as large as the pipe.  HeapBuffer (Linux only) puts the ring in
+   * its own prefaulted mapping, in huge pages where possible and bound to the
+   * reader's NUMA node.
+   *
+   * Building with PIPE_INSTRUMENTATION defined adds a timestamp to every
+   * element's header and keeps the PipeStats returned by getStats(): an
+   * enqueue to dequeue latency histogram, the occupancy high water mark, and
+   * counts of pushes that blocked on a full pipe and pops that waited on an
+   * empty one.  Without it none of this is compiled in.
    */
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy = NoWakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE,
+           class WakeupPolicy = NoWakeupPolicy,
+           class BufferPolicy = EmbeddedBuffer<PIPE_SIZE> >
   class LocklessPipe {
     /*
      * The amount of time read/write will sleep from when the pipe is
@@ -64,9 +118,20 @@ namespace Pipe {
      *       for less than the OS timeer interrupt.
      */
     enum { SLEEP_ON_BLOCK_USECS = 1000 };
+    /*
+     * A timed wait with less than this many nanoseconds left polls the clock
+     * instead of sleeping, since a sleep can overshoot by the timer slack
+     * (50 usecs by default on Linux).  clock_gettime(CLOCK_MONOTONIC) is
+     * answered from the vDSO on Linux, so polling it costs no system call.
+     */
+    enum { POLL_BELOW_NSECS = 50000 };
     public:
 
     typedef Data DataHandle;
+    typedef WakeupPolicy WakeupPolicyType;
+    typedef BufferPolicy BufferPolicyType;
+
+    static const uint64_t NEVER_TIME_OUT;
     /*
      * Constructor
      */
@@ -75,16 +140,44 @@ namespace Pipe {
     ~LocklessPipe() { }
 
     /*
-     * push 'Data' into the pipe, blocking if there is not enough room.
+     * push 'Data' into the pipe.  If there is not enough room, block, or with
+     * OverflowPolicy::DROP_NEWEST drop 'value' and count a failed write.
      * \param value the 'Data' to push.
+     * \param func pointer to the functor to call just before waiting for room
      * \throws Interrupted if the writer has been stopped.
      */
-    void push(const Data& value) {
-      void *ptr = startWrite(static_cast<uint32_t>(value.length()), true);
-      if (ptr) {
-        std::memcpy(ptr, value.data(), value.length());
-        finishWrite();
-      }
+    void push(const Data& value, PreWaitFunctor* func = 0) {
+      write(value, overflowTimeOut(), func);
+    }
+    /*
+     * push 'Data' into the pipe only if there is room right now.
+     * \param value the 'Data' to push.
+     * \return true if pushed, false (and a failed write) if the pipe was full
+     * \throws Interrupted if the writer has been stopped.
+     */
+    bool tryPush(const Data& value) {
+      return write(value, 0, 0);
+    }
+    /*
+     * push 'Data' into the pipe, waiting at most timeOut nanoseconds for room.
+     * \param value the 'Data' to push.
+     * \param timeOut how long to wait, in nanoseconds
+     * \param func pointer to the functor to call just before waiting for room
+     * \return true if pushed, false (and a failed write) if it timed out
+     * \throws Interrupted if the writer has been stopped.
+     */
+    bool pushFor(const Data& value, uint64_t timeOut, PreWaitFunctor* func = 0) {
+      return write(value, timeOut, func);
+    }
+    /*
+     * What push(), pushBatch() and reserve() do when the pipe is full.
+     * Only the writer may change it.
+     */
+    void setOverflowPolicy(OverflowPolicy::Type policy) NO_THROW {
+      overflowPolicy_ = policy;
+    }
+    OverflowPolicy::Type getOverflowPolicy() const NO_THROW {
+      return overflowPolicy_;
     }
 
     /*
@@ -95,18 +188,112 @@ namespace Pipe {
      * \throws Interrupted if the reader has been stopped.
      */
     void pop(Data& data, void* buffer, PreWaitFunctor* func = 0);
+    /*
+     * pop 'Data' off the pipe, waiting at most timeOut nanoseconds if the pipe
+     * is empty.  A timeOut of 0 never waits.
+     * \param value The 'Data' to pop (this wil be a handle over the raw data copied into buffer)
+     * \param buffer pointer to a raw buffer where the popped item will be copied to
+     * \param timeOut how long to wait, in nanoseconds
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \return true if 'data' was popped, an element of length 0 included,
+     *         false if the pipe was still empty
+     * \throws Interrupted if the reader has been stopped.
+     */
+    bool timedPop(Data& data, void* buffer, uint64_t timeOut, PreWaitFunctor* func = 0);
+
+    /*
+     * push 'count' Data into the pipe, blocking if there is not enough room
+     * (or with OverflowPolicy::DROP_NEWEST, dropping what does not fit).
+     * The reader is shown the whole batch with a single update of the write
+     * pointer, rather than one per element.  If the batch does not fit, the
+     * elements written so far are published before waiting for room.
+     * \param values the 'Data' to push
+     * \param count the number of values
+     * \throws Interrupted if the writer has been stopped.
+     */
+    void pushBatch(const Data* values, uint32_t count);
+
+    /*
+     * pop up to 'maxCount' Data off the pipe, blocking only if the pipe is
+     * empty.  Every element already visible is drained (as far as maxCount and
+     * bufferSize allow) and the read pointer is then updated once.
+     * \param values array of at least maxCount handles over the copied elements
+     * \param maxCount the most elements to pop
+     * \param buffer raw buffer the popped elements are copied to, back to back
+     * \param bufferSize the size of buffer; must hold the largest element
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \return the number of elements popped (at least 1 if maxCount > 0)
+     * \throws Interrupted if the reader has been stopped.
+     */
+    uint32_t popBatch(Data* values, uint32_t maxCount, void* buffer, uint32_t bufferSize,
+                      PreWaitFunctor* func = 0);
+
+    /*
+     * Consume, in place, every element visible when called (up to maxCount)
+     * in one pass, calling visitor(const Data&) on each with a handle over
+     * the element inside the pipe.  The handle is only valid during the call.
+     * The next records are prefetched while the visitor runs, and the read
+     * pointer is updated once at the end.  If the visitor throws, the
+     * elements before the one it threw on are consumed.
+     * \param visitor called once per element, in order
+     * \param maxCount the most elements to consume
+     * \param timeOut how long to wait, in nanoseconds, if the pipe is empty
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \return the number of elements consumed, 0 if the pipe stayed empty
+     * \throws Interrupted if the reader has been stopped.
+     */
+    template<class Visitor>
+    uint32_t drain(Visitor& visitor, uint32_t maxCount = static_cast<uint32_t>(-1),
+                   uint64_t timeOut = 0, PreWaitFunctor* func = 0);
+
+    /*
+     * Zero-copy push: reserve room for an element of 'length' bytes directly
+     * in the pipe, blocking if there is not enough room.  The caller builds
+     * the element in place and then calls commit() to publish it.
+     * \param length the exact size of the element
+     * \return where to write the element, or NULL if length is larger than
+     *         getMaxPipeElementSize() or, with OverflowPolicy::DROP_NEWEST,
+     *         the pipe is full
+     * \throws Interrupted if the writer has been stopped.
+     */
+    void* reserve(uint32_t length) {
+      return startWrite(length, overflowTimeOut());
+    }
+    /*
+     * Publish the element written into the space returned by reserve().
+     */
+    void commit() {
+      finishWrite();
+    }
+    /*
+     * Zero-copy pop: wait for the next element and hand it out in place,
+     * blocking if the pipe is empty.  The element stays in the pipe, and
+     * 'value' stays valid, until release() is called.
+     * \param value a handle over the element inside the pipe
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \throws Interrupted if the reader has been stopped.
+     */
+    void peekView(Data& value, PreWaitFunctor* func = 0);
+    /*
+     * Remove the element handed out by peekView() and give its space back to
+     * the writer.
+     */
+    void release() {
+      recordDequeue();
+      finishRead();
+    }
 
     /*
      * Indicates if the writer is running.
      */
     bool isWriterRunning() const NO_THROW {
-      return isWriterRunning_;
+      return isWriterRunning_.load();
     }
     /*
      * Indicates if the reader is running.
      */
     bool isReaderRunning() const NO_THROW {
-      return isReaderRunning_;
+      return isReaderRunning_.load();
     }
     /*
      * Start the writer.
@@ -114,14 +301,15 @@ namespace Pipe {
      * This call has no effect if the writer is already running
      */
     void startWriter() {
-      isWriterRunning_ = true;
+      isWriterRunning_.store(true);
     }
     /*
      * Stop the writer.
      * All subsequent calls to push will throw Interrupted exceptions.
      */
     void stopWriter() {
-      isWriterRunning_ = false;
+      isWriterRunning_.store(false);
+      wakeupWriter(wakeupPolicy_);
     }
     /*
      * Start the reader.
@@ -129,57 +317,76 @@ namespace Pipe {
      * This call has no effect if the reader is already running.
      */
     void startReader() {
-      isReaderRunning_ = true;
+      isReaderRunning_.store(true);
     }
     /*
      * Stop the reader.
      * All subsequent calls to pop will throw Interrupted exceptions.
      */
     void stopReader() {
-      isReaderRunning = false;
+      isReaderRunning_.store(false);
       wakeup(wakeupPolicy_);
     }
+    /*
+     * Resume the writer, or the reader, of a pipe whose memory outlived the
+     * process that used it, as PersistentPipeFactory does after a crash.
+     * recoverWriter() drops an element that was reserved, or the part of a
+     * batch that was written, but not yet published.  recoverReader() resumes
+     * at the last released element, so one that was popped but not released
+     * is read again, and checks that the published elements still chain from
+     * the read pointer to the write pointer.  Both recount their side's
+     * numWritten or numRead from the published elements, so count() is right
+     * again once a pipe end dies between updating one and the other.  Either
+     * may be called while the other side is in use, but not while its own
+     * side is.  Each leaves its side running.
+     * \return for recoverReader(), false if the elements are corrupt
+     */
+    void recoverWriter() NO_THROW;
+    bool recoverReader() NO_THROW;
     /*
      * Is there no room for a datum of size length in the buffer?
      * \param length The length of the item to put in the buffer.
      * \return true if it cannot fit, else false.
      */
-    bool isFull(uint32_t length) const NO_THROW;
+    bool isFull(uint32_t length) const NO_THROW {
+      return isFull(length, readVPtr_.loadAcquire(), writeVPtr_.load());
+    }
     /*
      * How many items are in the pipe?
      * \return the count of items in the pipe.
      */
     uint32_t count() const NO_THROW {
-      return static_cast<uint32_t>(numWritten_ - numRead_);
+      return static_cast<uint32_t>(numWritten_.load() - numRead_.load());
     }
     /*
      * Number of items written so far
      * \return the number of items written
      */
     uint64_t numWritten() const NO_THROW {
-      return numWritten_;
+      return numWritten_.load();
     }
     /*
      * Number of items read so far
      * \return The number of items read
      */
     uint64_t numRead() const NO_THROW {
-      return numRead_;
+      return numRead_.load();
     }
     /*
-     * How many writes have failed (for non-blocking writes)
+     * How many elements were not pushed: too large, dropped by tryPush(),
+     * pushFor() or OverflowPolicy::DROP_NEWEST.
      * \return the number of failed writes
      */
     uint64_t numFailedWrites() const NO_THROW {
-      return numFailedWrites_;
+      return numFailedWrites_.load();
     }
     /*
      * How full is the pipe, expressed as a percentage?
      * \return percentage of pipe containing data
      */
     double percentFull() const NO_THROW {
-      const uint32_t rptr = getPointer(readVPtr_);
-      const uint32_t wptr = getPointer(writeVPtr_);
+      const uint32_t rptr = getPointer(readVPtr_.load());
+      const uint32_t wptr = getPointer(writeVPtr_.load());
       const double percent = 100.0 * (rptr > wptr               ?
                                       PIPE_SIZE - (rptr - wptr) :
                                       wptr - rptr) / PIPE_SIZE;
@@ -190,7 +397,7 @@ namespace Pipe {
      * \return ture if it's empty, else false.
      */
     bool isEmpty() const NO_THROW {
-      return (readVPtr_ == writeVPtr_);
+      return (readVPtr_.load() == writeVPtr_.loadAcquire());
     }
     /*
      * How many bytes can be stored in this pipe?
@@ -216,6 +423,47 @@ namespace Pipe {
         wakeup(wakeupPolicy_);
       }
     }
+    /*
+     * For a reader that waits on EventFdWakeupPolicy's fd() (in epoll or
+     * poll) rather than in pop(): arm the fd to become readable when data
+     * arrives.  Call it after popping until the pipe is empty.
+     * \return true if the pipe is still empty and the caller may wait on the
+     *         fd, false if data has arrived (the fd is not armed)
+     */
+    bool armReader() {
+      wakeupPolicy_.prepareReaderPark();
+      if (!isEmpty() || !isReaderRunning_.load())
+      {
+        wakeupPolicy_.cancelReaderPark();
+        return false;
+      }
+      return true;
+    }
+    /*
+     * The wakeup policy instance, e.g. to tune it or read its statistics.
+     * \return the pipe's wakeup policy
+     */
+    WakeupPolicy& getWakeupPolicy() NO_THROW {
+      return wakeupPolicy_;
+    }
+    const WakeupPolicy& getWakeupPolicy() const NO_THROW {
+      return wakeupPolicy_;
+    }
+    /*
+     * The buffer policy instance, e.g. to rebind a HeapBuffer's pages.
+     * \return the pipe's buffer policy
+     */
+    BufferPolicy& getBufferPolicy() NO_THROW {
+      return buffer_;
+    }
+#ifdef PIPE_INSTRUMENTATION
+    /*
+     * The pipe's instrumentation, readable from any thread while it runs.
+     */
+    const PipeStats& getStats() const NO_THROW {
+      return stats_;
+    }
+#endif
     /*
      * print stats about the pipe
      */
@@ -230,28 +478,63 @@ namespace Pipe {
     private:
     typedef uint64_t VersionedPointerType;
 
-    // Statistics
-    volatile uint64_t numRead_;
-    volatile uint64_t numWritten_;
-    uint64_t numFailedWrites_;
-
     // The 'stomp' data is on the inordinately pessimistic size. And also
     // misses the possibility that you'll stomp over the end of the buffer.
     const uint64_t stomp1;
-    Atom<VersionedPointerType> readVPtr_;
+
+    // Producer-owned state.  Only the writer stores to this line; the reader
+    // loads writeVPtr_ when its cached copy says the pipe is empty.
+    PIPE_CALIGNED PipeAtomic<VersionedPointerType> writeVPtr_;
+    PipeAtomic<VersionedPointerType> nextWriteVPtr_;
+    PipeAtomic<uint64_t> numWritten_;
+    PipeAtomic<uint64_t> numFailedWrites_;
+    OverflowPolicy::Type overflowPolicy_;
+    // Elements written since writeVPtr_ was last published (batches only).
+    uint32_t numPendingWrites_;
+    // The writer's last look at readVPtr_.  The reader only ever advances, so
+    // a stale copy can only make the pipe look fuller than it is.
+    VersionedPointerType cachedReadVPtr_;
+    PipeAtomic<bool> isWriterRunning_;
     const uint64_t stomp2;
-    Atom<VersionedPointerType> writeVPtr_;
+
+    // Consumer-owned state.  Only the reader stores to this line; the writer
+    // loads readVPtr_ when its cached copy says the pipe is full.
+    PIPE_CALIGNED PipeAtomic<VersionedPointerType> readVPtr_;
+    PipeAtomic<uint64_t> numRead_;
+    // The reader's last look at writeVPtr_.  The writer only ever advances, so
+    // a stale copy can only make the pipe look emptier than it is.
+    VersionedPointerType cachedWriteVPtr_;
+    // Where readVPtr_ moves to when the element found by startRead() is done.
+    VersionedPointerType nextReadVPtr_;
+    PipeAtomic<bool> isReaderRunning_;
     const uint64_t stomp3;
-    Atom<VersionedPointerType> nextWriteVPtr_;
+
+    // Written only when a side parks, so it gets a line of its own too.
+    PIPE_CALIGNED WakeupPolicy wakeupPolicy_;
     const uint64_t stomp4;
 
-    volatile bool isReaderRunning_;
-    volatile bool isWriterRunning_;
+#ifdef PIPE_INSTRUMENTATION
+    PipeStats stats_;
+    // The timestamp of the element elementAt() last found (reader-owned).
+    uint64_t elementEnqueueNSecs_;
+#endif
+
+    /*
+     * Every element is preceded by its length and, when instrumented, the
+     * time it was written.
+     */
+#ifdef PIPE_INSTRUMENTATION
+    enum { HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t) };
+#else
+    enum { HEADER_SIZE = sizeof(uint32_t) };
+#endif
+
     /*
      * The size of the element pushed onto the pipe will be the length param
-     * to push + sizeof(length).
-     * Current implementation never wraps around in the buffer for the same element.
-     * So effectively, (element + sizeof(length) can not exceed half of pipe size.
+     * to push + HEADER_SIZE.
+     * Unless the buffer is MIRRORED, the implementation never wraps around in
+     * the buffer for the same element.
+     * So effectively, (element + HEADER_SIZE) can not exceed half of pipe size.
      * Otherwise, deadlock will occur.
      * In adddition, pipe can not be pushed into as the total full state which would
      * increment the write pointer to be equal to the readptr (which is the empty condition).
@@ -263,20 +546,12 @@ namespace Pipe {
 
     static const uint64_t STOMP;
 
-    WakeupPolicy wakeupPolicy_;
-
-    /* Pessimism. Guarantee buf_ is 32 aligned.
-     * I'd like to guarantee 64 bit, but it gets very messy as different
-     * compilers behave rather strangely with padding. In particular, on
-     * gcc x686 compiler, AND NO OTHER, the size of this structure ends up
-     * smaller on 32 bit than 64 bit
+    /*
+     * How far ahead of the element being visited drain() prefetches.
      */
+    enum { PREFETCH_AHEAD_BYTES = 4 * PIPE_CACHE_LINE_SIZE };
 
-    union
-    {
-      uint32_t pipe_align__unused__;
-      char buf_[PIPE_SIZE];
-    };
+    BufferPolicy buffer_;
 
     void wakeup(const NoWakeupPolicy&) { }
 
@@ -286,21 +561,201 @@ namespace Pipe {
 
     void wait(const NoWakeupUsecPolicy&, uint64_t timeOut, PreWaitFunctor* func = 0);
 
+    void wakeupWriter(const NoWakeupPolicy&) { }
+
+    /*
+     * Wait, once, for room for an element of 'length' bytes, returning by
+     * deadlineNSecs (a monotonicNSecs() time, or NEVER_TIME_OUT) at the
+     * latest.  It may return sooner; the caller checks for room and loops.
+     */
+    void waitForRoom(const NoWakeupPolicy&, uint32_t length, uint64_t deadlineNSecs);
+
+    void wakeupWriter(const NoWakeupUsecPolicy&) { }
+
+    void waitForRoom(const NoWakeupUsecPolicy&, uint32_t length, uint64_t deadlineNSecs);
+
+#ifdef __linux__
+    void wakeup(FutexWakeupPolicy& policy) { policy.wakeReader(); }
+
+    void wait(FutexWakeupPolicy& policy, uint64_t timeOut, PreWaitFunctor* func = 0);
+
+    void wakeupWriter(FutexWakeupPolicy& policy) { policy.wakeWriter(); }
+
+    void waitForRoom(FutexWakeupPolicy& policy, uint32_t length, uint64_t deadlineNSecs);
+
+    void wait(AdaptiveWakeupPolicy& policy, uint64_t timeOut, PreWaitFunctor* func = 0);
+
+    void waitForRoom(AdaptiveWakeupPolicy& policy, uint32_t length, uint64_t deadlineNSecs);
+
+    void wakeup(EventFdWakeupPolicy& policy) { policy.wakeReader(); }
+
+    void wait(EventFdWakeupPolicy& policy, uint64_t timeOut, PreWaitFunctor* func = 0);
+
+    void wakeupWriter(EventFdWakeupPolicy&) { }
+
+    void waitForRoom(EventFdWakeupPolicy&, uint32_t length, uint64_t deadlineNSecs);
+#endif
+
+    /*
+     * How many usecs to sleep, at most SLEEP_ON_BLOCK_USECS and no later than
+     * deadlineNSecs.  0 when less than POLL_BELOW_NSECS is left, when the
+     * caller should poll rather than sleep.
+     */
+    static useconds_t sleepUsecsUntil(uint64_t deadlineNSecs);
+
     void clear();
 
-    void* startWrite(uint32_t length, bool block = true);
+    /*
+     * Find room for an element of 'length' bytes, waiting at most timeOut
+     * nanoseconds (0 means not at all) and calling func before waiting.
+     * \return where to write the element, or NULL (a failed write) if there
+     *         was no room in time or length is too large
+     */
+    void* startWrite(uint32_t length, uint64_t timeOut = NEVER_TIME_OUT, PreWaitFunctor* func = 0);
     void finishWrite(void);
 
+    bool write(const Data& value, uint64_t timeOut, PreWaitFunctor* func) {
+      void *ptr = startWrite(static_cast<uint32_t>(value.length()), timeOut, func);
+      if (ptr == NULL)
+      {
+        return false;
+      }
+      std::memcpy(ptr, value.data(), value.length());
+      finishWrite();
+      return true;
+    }
+
+    uint64_t overflowTimeOut() const NO_THROW {
+      return overflowPolicy_ == OverflowPolicy::DROP_NEWEST ? 0 : NEVER_TIME_OUT;
+    }
+
+    void countFailedWrite() NO_THROW {
+      numFailedWrites_.store(numFailedWrites_.load() + 1);
+    }
+    void publishWrites(void);
+
+    bool isFull(uint32_t length,
+                VersionedPointerType readVPtr,
+                VersionedPointerType writeVPtr) const NO_THROW;
+
+    /*
+     * isFull for the writer, checked against its cached copy of readVPtr_.
+     * The consumer's line is only touched when the cached copy says the
+     * element does not fit.  Room is measured from the end of the last element
+     * written, which runs ahead of writeVPtr_ while a batch is in progress.
+     */
+    bool isFullForWriter(uint32_t length) NO_THROW {
+      const VersionedPointerType writeVPtr = nextWriteVPtr_.load();
+      if (!isFull(length, cachedReadVPtr_, writeVPtr))
+      {
+        return false;
+      }
+      // Acquire: the reader has finished copying out of the space it released.
+      cachedReadVPtr_ = readVPtr_.loadAcquire();
+      return isFull(length, cachedReadVPtr_, writeVPtr);
+    }
+
+    /*
+     * isEmpty for the reader, checked against its cached copy of writeVPtr_.
+     * The producer's line is only touched when the cached copy says the pipe
+     * is empty.
+     */
+    bool isEmptyForReader() NO_THROW {
+      return isEmptyForReader(readVPtr_.load());
+    }
+    bool isEmptyForReader(VersionedPointerType readVPtr) NO_THROW {
+      if (readVPtr != cachedWriteVPtr_)
+      {
+        return false;
+      }
+      // Acquire: the writer's copy into the buffer is visible.
+      cachedWriteVPtr_ = writeVPtr_.loadAcquire();
+      return readVPtr == cachedWriteVPtr_;
+    }
+
+    /*
+     * Instrumentation hooks; empty unless PIPE_INSTRUMENTATION is defined.
+     */
+    void stampElement(char* header) NO_THROW {
+#ifdef PIPE_INSTRUMENTATION
+      const uint64_t now = monotonicNSecs();
+      std::memcpy(header + sizeof(uint32_t), &now, sizeof(now));
+#else
+      (void)header;
+#endif
+    }
+    void readElementStamp(const char* header) NO_THROW {
+#ifdef PIPE_INSTRUMENTATION
+      std::memcpy(&elementEnqueueNSecs_, header + sizeof(uint32_t), sizeof(elementEnqueueNSecs_));
+#else
+      (void)header;
+#endif
+    }
+    void recordDequeue() NO_THROW {
+#ifdef PIPE_INSTRUMENTATION
+      stats_.recordLatency(elementEnqueueNSecs_);
+#endif
+    }
+    void recordPublish() NO_THROW {
+#ifdef PIPE_INSTRUMENTATION
+      stats_.recordOccupancy(numWritten_.load() - numRead_.load());
+#endif
+    }
+    void countFullBlock() NO_THROW {
+#ifdef PIPE_INSTRUMENTATION
+      stats_.countFullBlock();
+#endif
+    }
+    void countEmptyWait() NO_THROW {
+#ifdef PIPE_INSTRUMENTATION
+      stats_.countEmptyWait();
+#endif
+    }
+
+    /*
+     * Must an element of 'length' bytes at 'ptr' be moved to the start of the
+     * buffer?  Never for a mirrored buffer, where it can run past the end.
+     */
     bool isWrap(uint32_t length, uint32_t ptr) const NO_THROW {
-        return (ptr + length > PIPE_SIZE);
+        return (!BufferPolicy::MIRRORED && ptr + length > PIPE_SIZE);
+    }
+
+    /*
+     * For a mirrored buffer, bring a pointer that has run past the end of the
+     * buffer back into the first copy, starting the next version.
+     */
+    void unmirror(uint32_t& ptr, uint32_t& version) const NO_THROW {
+        if (BufferPolicy::MIRRORED && ptr >= PIPE_SIZE)
+        {
+            ptr -= PIPE_SIZE;
+            version++;
+        }
     }
 
-    uint32_t peek(char* buf) {
+    bool peek(char* buf, uint32_t& length) {
         const bool peek = true;
-        return read(buf, peek, 0);
+        return read(buf, peek, 0, length);
     }
 
-    uint32_t read(char* buf, bool peek, uint64_t timeOut, PreWaitFunctor* func = 0);
+    /*
+     * Copy the next element into buf and set length to its length.  Returns
+     * false if the pipe was still empty after timeOut, so an element of
+     * length 0 is told apart from a timeout.
+     */
+    bool read(char* buf, bool peek, uint64_t timeOut, uint32_t& length, PreWaitFunctor* func = 0);
+
+    char* startRead(uint32_t& length, uint64_t timeOut, PreWaitFunctor* func = 0);
+    void finishRead(uint32_t count = 1);
+    char* elementAt(VersionedPointerType readVPtr,
+                    uint32_t& length,
+                    VersionedPointerType& nextReadVPtr) NO_THROW;
+    /*
+     * Count the published elements from fromVPtr up to toVPtr.  Returns false
+     * if they do not chain from one to the other, i.e. they are corrupt.
+     */
+    bool countElements(VersionedPointerType fromVPtr,
+                       VersionedPointerType toVPtr,
+                       uint64_t& count) NO_THROW;
 
     VersionedPointerType
     getVersionedPointer(uint32_t version, uint32_t pointer) const NO_THROW {
@@ -320,55 +775,61 @@ namespace Pipe {
   };
 
   // Initialize Constants
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   const uint64_t
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::NEVER_TIME_OUT
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::NEVER_TIME_OUT
     = static_cast<uint64_t>(-1);
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   const uint64_t
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::NUM_NANOSECONDS_PER_MICROSECOND = 1000;
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::NUM_NANOSECONDS_PER_MICROSECOND = 1000;
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   const uint64_t
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::NUM_NANOSECONDS_PER_SECOND = 1000000000;
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::NUM_NANOSECONDS_PER_SECOND = 1000000000;
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   const uint64_t
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::NUM_MICROSECONDS_PER_SECOND = 1000000;
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::NUM_MICROSECONDS_PER_SECOND = 1000000;
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   const uint32_t
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::MAX_PIPE_ELEMENT_SIZE = PIPE_SIZE/2 - (sizeof(uint32_t) + 1);
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::MAX_PIPE_ELEMENT_SIZE =
+    BufferPolicy::MIRRORED ? PIPE_SIZE - (HEADER_SIZE + 1) : PIPE_SIZE/2 - (HEADER_SIZE + 1);
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   const uint64_t
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::STOMP = 0xDEADBEEF;
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::STOMP = 0xDEADBEEF;
 
 
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::LocklessPipe():
-    numFailedWrites_(0),
+  LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::LocklessPipe():
     stomp1(STOMP),
+    numFailedWrites_(0),
+    overflowPolicy_(OverflowPolicy::BLOCK),
+    numPendingWrites_(0),
     stomp2(STOMP),
     stomp3(STOMP),
     stomp4(STOMP)
+#ifdef PIPE_INSTRUMENTATION
+    , elementEnqueueNSecs_(0)
+#endif
   {
     clear();
 
-    isWriterRunning_ = true;
-    isReaderRunning_ = true;
+    isWriterRunning_.store(true);
+    isReaderRunning_.store(true);
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::pop(Data& value, void* buffer, PreWaitFunctor* func)
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::pop(Data& value, void* buffer, PreWaitFunctor* func)
   {
       const bool peek = false;
-      const uint32_t length = read(static_cast<char*>(buffer), peek, NEVER_TIME_OUT, func);
-      if (length == 0)
+      uint32_t length;
+      if (!read(static_cast<char*>(buffer), peek, NEVER_TIME_OUT, length, func))
       {
           // Something has gone *badly* wrong inside of read. Abort, abort!
           throw InternalReadError();
@@ -377,21 +838,44 @@ namespace Pipe {
       value = Data(static_cast<char*>(buffer), length);
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::clear()
+  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::timedPop(Data& value,
+                                                             void* buffer,
+                                                             uint64_t timeOut,
+                                                             PreWaitFunctor* func)
   {
-      readVPtr_.set(0);
-      writeVPtr_.set(0);
-      nextWriteVPtr_.set(0);
+      const bool peek = false;
+      uint32_t length;
+      if (!read(static_cast<char*>(buffer), peek, timeOut, length, func))
+      {
+          return false;
+      }
+
+      value = Data(static_cast<char*>(buffer), length);
+      return true;
+  }
 
-      numRead_    = 0;
-      numWritten_ = 0;
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::clear()
+  {
+      readVPtr_.store(0);
+      writeVPtr_.store(0);
+      nextWriteVPtr_.store(0);
+      cachedReadVPtr_  = 0;
+      cachedWriteVPtr_ = 0;
+      nextReadVPtr_    = 0;
+
+      numRead_.store(0);
+      numWritten_.store(0);
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  void* LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::startWrite(uint32_t length, bool block)
+  void* LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::startWrite(uint32_t length,
+                                                                    uint64_t timeOut,
+                                                                    PreWaitFunctor* func)
   {
     /**
      * Check if the pipe is physically capable of holding this element.
@@ -401,42 +885,65 @@ namespace Pipe {
         std::cerr << "LocklessPipe: Data Passed in is too large! Length: " << length /* purecov: inspected */
                   << "\nPipe: \n"  /* purecov: inspected */
                   << *this;  /* purecov: inspected */
+        countFailedWrite();  /* purecov: inspected */
         return NULL;  /* purecov: inspected */
     }
 
-    bool full;
-    while ((full = isFull(length)) && isWriterRunning_ && block)
+    bool full = isFullForWriter(length);
+    if (full)
     {
-      /*
-       * For the MutexWakeupPolicy only:
-       * If the writer calls wakeupReader rarely or not at all, we may get into
-       * the case where the reader is hanging on cond-wait, and the
-       * the pipe is full.  In this case, the writer must wakeup the reader, or
-       * deadlock will ensue.
-       */
-      wakeup(wakeupPolicy_);
-      usleep(SLEEP_ON_BLOCK_USECS);
+      // Never wait for room with batched elements the reader cannot see yet,
+      // or both sides will wait on each other.
+      publishWrites();
+    }
+    // Sampled once per look at the pipe, so a stopWriter() that ends a wait
+    // is reported even if startWriter() follows straight away.
+    bool running = isWriterRunning_.load();
+    if (full && timeOut != 0 && running)
+    {
+      countFullBlock();
+      const uint64_t deadlineNSecs = NEVER_TIME_OUT == timeOut ? NEVER_TIME_OUT :
+                                                                 monotonicNSecs() + timeOut;
+      if (func != 0)
+      {
+        (*func)();
+      }
+      while (full && running)
+      {
+        if (NEVER_TIME_OUT != deadlineNSecs && monotonicNSecs() >= deadlineNSecs)
+        {
+          break;
+        }
+        waitForRoom(wakeupPolicy_, length, deadlineNSecs);
+        full = isFullForWriter(length);
+        running = isWriterRunning_.load();
+      }
     }
 
-    if (!isWriterRunning_)
+    if (!running)
     {
+      publishWrites();
       throw Interrupted();
     }
 
-    if (!block && full)
+    if (full)
     {
+      countFailedWrite();
       return NULL;
     }
 
-    uint32_t localWritePtr = getPointer(writeVPtr_);
-    uint32_t localWriteVersion = getVersion(writeVPtr_);
-    if (isWrap(static_cast<uint32_t>(sizeof(length)), localWritePtr))
+    // Carry on from the end of the last element, which is only ahead of
+    // writeVPtr_ while a batch is being written.
+    const VersionedPointerType writeVPtr = nextWriteVPtr_.load();
+    uint32_t localWritePtr = getPointer(writeVPtr);
+    uint32_t localWriteVersion = getVersion(writeVPtr);
+    if (isWrap(static_cast<uint32_t>(HEADER_SIZE), localWritePtr))
     {
       localWritePtr = 0;
       localWriteVersion++;
     }
     uint32_t lengthPtr = localWritePtr;
-    localWritePtr = localWritePtr + static_cast<uint32_t>(sizeof(length));
+    localWritePtr = localWritePtr + static_cast<uint32_t>(HEADER_SIZE);
 
     if (isWrap(length, localWritePtr))
     {
@@ -444,108 +951,694 @@ namespace Pipe {
       localWriteVersion++;
     }
 
-    nextWriteVPtr_ = getVersionedPointer(localWriteVersion, localWritePtr + length);
+    uint32_t endPtr = localWritePtr + length;
+    unmirror(endPtr, localWriteVersion);
 
     // Make sure that the nextWritePtr is written before the data is written into
     // the buffer.  This is important because the separateThreadPeek method looks
     // at the nextWriteVPtr_
-    MF_write_sync();
+    nextWriteVPtr_.storeRelease(getVersionedPointer(localWriteVersion, endPtr));
 
-    std::memcpy(&buf_[lengthPtr], static_cast<void *>(&length), sizeof(length));
+    char* const buf = buffer_.data();
+    std::memcpy(&buf[lengthPtr], static_cast<void *>(&length), sizeof(length));
+    stampElement(&buf[lengthPtr]);
 
-    return &buf_[localWritePtr];
+    return &buf[localWritePtr];
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::finishWrite(void)
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::finishWrite(void)
   {
-    // numWritten_ must be incremented before the write_sync so that
+    ++numPendingWrites_;
+    publishWrites();
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::publishWrites(void)
+  {
+    if (numPendingWrites_ == 0)
+    {
+      return;
+    }
+
+    // numWritten_ must be incremented before the release so that
     // the validate method can correctly sense corruption when numRead_ > numWritten_
-    numWritten_++;
+    numWritten_.store(numWritten_.load() + numPendingWrites_);
+    numPendingWrites_ = 0;
 
     // Make sure the data is written to the queue before the pointers are incremented.
     // This way if the queue reader sees incremented tick pointers, then the data will
     // be sure to be updated as well.
-    MF_write_sync();
+    writeVPtr_.storeRelease(nextWriteVPtr_.load());
+    recordPublish();
 
-    writeVPtr_ = nextWriteVPtr_;
+    wakeup(wakeupPolicy_);
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::wait(const NoWakeupPolicy&,
+  char* LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::startRead(uint32_t& length,
+                                                               uint64_t timeOut,
+                                                               PreWaitFunctor* func)
+  {
+    // A timeOut of 0 is a poll: it never waits, so it is not counted as one.
+    if (timeOut != 0 && isEmptyForReader())
+    {
+      countEmptyWait();
+      wait(wakeupPolicy_, timeOut, func);
+
+      // A stopReader() and startReader() while waiting can end the wait
+      // with the pipe still empty; an untimed wait just carries on.
+      while (NEVER_TIME_OUT == timeOut && isReaderRunning_.load() && isEmptyForReader())
+      {
+        wait(wakeupPolicy_, timeOut, func);
+      }
+    }
+
+    if (!isReaderRunning_.load())
+    {
+      throw Interrupted();
+    }
+
+    if (isEmptyForReader())
+    {
+      // Timed out
+      length = 0;
+      return NULL;
+    }
+
+    // The data is visible: isEmptyForReader() acquired writeVPtr_, the mirror
+    // of the release in publishWrites.
+    return elementAt(readVPtr_.load(), length, nextReadVPtr_);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  char* LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::elementAt(VersionedPointerType readVPtr,
+                                                               uint32_t& length,
+                                                               VersionedPointerType& nextReadVPtr) NO_THROW
+  {
+    // Follow exactly the same wrap decisions as startWrite did.
+    uint32_t localReadPtr = getPointer(readVPtr);
+    uint32_t localReadVersion = getVersion(readVPtr);
+    if (isWrap(static_cast<uint32_t>(HEADER_SIZE), localReadPtr))
+    {
+      localReadPtr = 0;
+      localReadVersion++;
+    }
+    char* const buf = buffer_.data();
+    std::memcpy(static_cast<void *>(&length), &buf[localReadPtr], sizeof(length));
+    readElementStamp(&buf[localReadPtr]);
+    localReadPtr = localReadPtr + static_cast<uint32_t>(HEADER_SIZE);
+
+    if (isWrap(length, localReadPtr))
+    {
+      localReadPtr = 0;
+      localReadVersion++;
+    }
+
+    uint32_t endPtr = localReadPtr + length;
+    unmirror(endPtr, localReadVersion);
+    nextReadVPtr = getVersionedPointer(localReadVersion, endPtr);
+
+    return &buf[localReadPtr];
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::finishRead(uint32_t count)
+  {
+    numRead_.store(numRead_.load() + count);
+
+    // Make sure the data has been consumed before the writer is allowed
+    // to reuse the space.
+    readVPtr_.storeRelease(nextReadVPtr_);
+
+    wakeupWriter(wakeupPolicy_);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::recoverWriter() NO_THROW
+  {
+    numPendingWrites_ = 0;
+    nextWriteVPtr_.store(writeVPtr_.load());
+    cachedReadVPtr_ = readVPtr_.loadAcquire();
+
+    // numWritten_ is stored before writeVPtr_, so a writer that died in
+    // between leaves it counting elements the reader will never see.  Count
+    // them again from what is really published.  numRead_ is read after
+    // readVPtr_, so a reader running meanwhile can only make this high by
+    // what it pops during the recovery, never low.
+    uint64_t published;
+    if (countElements(cachedReadVPtr_, writeVPtr_.load(), published))
+    {
+      numWritten_.store(numRead_.load() + published);
+    }
+    else if (numWritten_.load() < numRead_.load())
+    {
+      // Corrupt; recoverReader() will say so.  Keep count() sane meanwhile.
+      numWritten_.store(numRead_.load());
+    }
+    isWriterRunning_.store(true);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::recoverReader() NO_THROW
+  {
+    const VersionedPointerType firstVPtr = readVPtr_.load();
+    cachedWriteVPtr_ = writeVPtr_.loadAcquire();
+    nextReadVPtr_ = firstVPtr;
+
+    uint64_t unread;
+    if (!countElements(firstVPtr, cachedWriteVPtr_, unread))
+    {
+      return false;
+    }
+
+    // numRead_ is stored before readVPtr_, so a reader that died in between
+    // counted elements it will read again.  numWritten_ is read after
+    // writeVPtr_, so a writer running meanwhile can only make this high by
+    // what it pushes during the recovery, and never above numWritten_.
+    numRead_.store(numWritten_.load() - unread);
+
+    isReaderRunning_.store(true);
+    return true;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::countElements(VersionedPointerType fromVPtr,
+                                                                    VersionedPointerType toVPtr,
+                                                                    uint64_t& count) NO_THROW
+  {
+    // Each element takes at least HEADER_SIZE bytes, so a chain that has not
+    // met toVPtr after PIPE_SIZE of them, or that runs into a later version,
+    // is corrupt.
+    const uint32_t lastVersion = getVersion(toVPtr) - getVersion(fromVPtr);
+    VersionedPointerType readVPtr = fromVPtr;
+    for (count = 0; readVPtr != toVPtr; ++count)
+    {
+      uint32_t length;
+      VersionedPointerType nextReadVPtr;
+      elementAt(readVPtr, length, nextReadVPtr);
+      if (count >= PIPE_SIZE / HEADER_SIZE ||
+          length > MAX_PIPE_ELEMENT_SIZE ||
+          getVersion(nextReadVPtr) - getVersion(fromVPtr) > lastVersion)
+      {
+        return false;
+      }
+      readVPtr = nextReadVPtr;
+    }
+    return true;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::read(char* buf,
+                                                         bool peek,
                                                          uint64_t timeOut,
+                                                         uint32_t& length,
                                                          PreWaitFunctor* func)
   {
-      if (NEVER_TIME_OUT == timeOut)
+    const char* element = startRead(length, timeOut, func);
+    if (element == NULL)
+    {
+      return false;
+    }
+
+    std::memcpy(buf, element, length);
+
+    if (!peek)
+    {
+      recordDequeue();
+      finishRead();
+    }
+
+    return true;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::pushBatch(const Data* values, uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      void *ptr = startWrite(static_cast<uint32_t>(values[i].length()), overflowTimeOut());
+      if (ptr)
+      {
+        std::memcpy(ptr, values[i].data(), values[i].length());
+        ++numPendingWrites_;
+      }
+    }
+    publishWrites();
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  uint32_t LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::popBatch(Data* values,
+                                                                 uint32_t maxCount,
+                                                                 void* buffer,
+                                                                 uint32_t bufferSize,
+                                                                 PreWaitFunctor* func)
+  {
+      if (maxCount == 0)
       {
-          while (isEmpty() && isReaderRunning_)
+          return 0;
+      }
+
+      char* out = static_cast<char*>(buffer);
+      uint32_t length;
+      const char* element = startRead(length, NEVER_TIME_OUT, func);
+      if (element == NULL || length > bufferSize)
+      {
+          // Something has gone *badly* wrong inside of startRead. Abort, abort!
+          throw InternalReadError();
+      }
+      std::memcpy(out, element, length);
+      values[0] = Data(out, length);
+      recordDequeue();
+
+      uint32_t used = length;
+      uint32_t count = 1;
+      VersionedPointerType readVPtr = nextReadVPtr_;
+      while (count < maxCount && !isEmptyForReader(readVPtr))
+      {
+          VersionedPointerType nextReadVPtr;
+          element = elementAt(readVPtr, length, nextReadVPtr);
+          if (length > bufferSize - used)
           {
-              if(func != 0)
-              {
-                  (*func)();
-              }
-              usleep(SLEEP_ON_BLOCK_USECS);
+              break;
           }
+          std::memcpy(out + used, element, length);
+          values[count++] = Data(out + used, length);
+          recordDequeue();
+          used += length;
+          readVPtr = nextReadVPtr;
       }
-      else
+
+      nextReadVPtr_ = readVPtr;
+      finishRead(count);
+
+      return count;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  template<class Visitor>
+  inline
+  uint32_t LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::drain(Visitor& visitor,
+                                                              uint32_t maxCount,
+                                                              uint64_t timeOut,
+                                                              PreWaitFunctor* func)
+  {
+      uint32_t length;
+      if (maxCount == 0 || startRead(length, timeOut, func) == NULL)
       {
-          bool timedOut = false;
-          if (timeOut < 1000 * NUM_NANOSECONDS_PER_MICROSECOND)
+          return 0;
+      }
+
+      // Everything the writer has published so far; one look at its line
+      // per drain.  Acquire: those elements' data is visible.
+      cachedWriteVPtr_ = writeVPtr_.loadAcquire();
+      const VersionedPointerType endVPtr = cachedWriteVPtr_;
+      const uint32_t endPtr = getPointer(endVPtr);
+      char* const buf = buffer_.data();
+      const char* lastPrefetch = NULL;
+
+      VersionedPointerType readVPtr = readVPtr_.load();
+      uint32_t count = 0;
+      try
+      {
+          while (count < maxCount && readVPtr != endVPtr)
           {
-              if (func != 0 && timeOut != 0)
+              VersionedPointerType nextReadVPtr;
+              char* element = elementAt(readVPtr, length, nextReadVPtr);
+
+              // Fetch the line PREFETCH_AHEAD_BYTES past this element, if the
+              // writer has finished with it, while the visitor works on this one.
+              const uint32_t nextPtr = getPointer(nextReadVPtr);
+              const uint32_t visibleBytes = endPtr >= nextPtr ? endPtr - nextPtr :
+                                                                PIPE_SIZE - nextPtr + endPtr;
+              if (visibleBytes > static_cast<uint32_t>(PREFETCH_AHEAD_BYTES))
               {
-                  (*func)();
+                  uint32_t aheadPtr = nextPtr + static_cast<uint32_t>(PREFETCH_AHEAD_BYTES);
+                  if (aheadPtr >= PIPE_SIZE)
+                  {
+                      aheadPtr -= PIPE_SIZE;
+                  }
+                  const char* ahead = &buf[aheadPtr & ~static_cast<uint32_t>(PIPE_CACHE_LINE_SIZE - 1)];
+                  if (ahead != lastPrefetch)
+                  {
+                      PIPE_prefetch(ahead);
+                      lastPrefetch = ahead;
+                  }
               }
-              struct timespec timeOutSpec;
-              TimeFraction<Second, NanoSecond> waitSeconds;
-              waitSeconds.assign<NanoSecond>(timeOut);
-              timeOutSpec.tv_sec  = static_cast<long>(waitSeconds.whole);
-              timeOutSpec.tv_nsec = static_cast<long>(waitSeconds.fract);
-              nanosleep(&timeOutSpec, NULL);
+
+              const Data value(element, length);
+              visitor(value);
+              recordDequeue();
+              readVPtr = nextReadVPtr;
+              ++count;
           }
-          else
-          {
-              struct timeval currentTime;
+      }
+      catch (...)
+      {
+          nextReadVPtr_ = readVPtr;
+          finishRead(count);
+          throw;
+      }
 
-              if (gettimeofday(&currentTime, NULL) != 0)
-              {
-                  throw Errno("returned from gettimeofday");
-              }
+      nextReadVPtr_ = readVPtr;
+      finishRead(count);
 
-              const uint64_t timeoutNSecs = timeOut + (currentTime.tv_sec*NUM_NANOSECONDS_PER_SECOND) +
-                                                      (currentTime.tv_usec*NUM_NANOSECONDS_PER_MICROSECOND);
+      return count;
+  }
 
-              while (isEmpty() && isReaderRunning_ && !timedOut)
-              {
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::peekView(Data& value, PreWaitFunctor* func)
+  {
+      uint32_t length;
+      char* element = startRead(length, NEVER_TIME_OUT, func);
+      if (element == NULL)
+      {
+          // Something has gone *badly* wrong inside of startRead. Abort, abort!
+          throw InternalReadError();
+      }
 
-                  if (func != 0 && timeOut != 0)
-                  {
-                      (*func)();
-                  }
-                  // In theory this can return early due to things like signals, but I don't think that we really care.
-                  usleep(SLEEP_ON_BLOCK_USECS);
+      value = Data(element, length);
+  }
 
-                  if (gettimeofday(&currentTime, NULL) != 0)
-                  {
-                      throw Errno("returned from gettimeofday");
-                  }
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::waitForRoom(const NoWakeupPolicy&,
+                                                                uint32_t /*length*/,
+                                                                uint64_t deadlineNSecs)
+  {
+    /*
+     * For the MutexWakeupPolicy only:
+     * If the writer calls wakeupReader rarely or not at all, we may get into
+     * the case where the reader is hanging on cond-wait, and the
+     * the pipe is full.  In this case, the writer must wakeup the reader, or
+     * deadlock will ensue.
+     */
+    wakeup(wakeupPolicy_);
+    const useconds_t sleepUsecs = sleepUsecsUntil(deadlineNSecs);
+    if (sleepUsecs != 0)
+    {
+      usleep(sleepUsecs);
+    }
+  }
 
-                  const uint64_t currtimeNSecs = (currentTime.tv_sec*NUM_NANOSECONDS_PER_SECOND)
-                                               + (currentTime.tv_usec*NUM_NANOSECONDS_PER_MICROSECOND);
-                  if (currtimeNSecs >= timeoutNSecs)
-                  {
-                      timedOut = true;
-                  }
-              }
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::waitForRoom(const NoWakeupUsecPolicy&,
+                                                                uint32_t /*length*/,
+                                                                uint64_t deadlineNSecs)
+  {
+    wakeup(wakeupPolicy_);
+    const useconds_t sleepUsecs = sleepUsecsUntil(deadlineNSecs);
+    if (sleepUsecs != 0)
+    {
+      usleep(sleepUsecs);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  useconds_t LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::sleepUsecsUntil(uint64_t deadlineNSecs)
+  {
+    if (NEVER_TIME_OUT == deadlineNSecs)
+    {
+      return SLEEP_ON_BLOCK_USECS;
+    }
+    const uint64_t nowNSecs = monotonicNSecs();
+    if (nowNSecs + static_cast<uint64_t>(POLL_BELOW_NSECS) >= deadlineNSecs)
+    {
+      return 0;
+    }
+    // Leave the last POLL_BELOW_NSECS to polling, so an overshooting sleep
+    // still ends before the deadline.
+    const uint64_t remainingUsecs = (deadlineNSecs - nowNSecs - static_cast<uint64_t>(POLL_BELOW_NSECS)) /
+                                    NUM_NANOSECONDS_PER_MICROSECOND;
+    const uint64_t maxUsecs = static_cast<uint64_t>(SLEEP_ON_BLOCK_USECS);
+    return static_cast<useconds_t>(remainingUsecs < maxUsecs ? remainingUsecs : maxUsecs);
+  }
+
+#ifdef __linux__
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::wait(FutexWakeupPolicy& policy,
+                                                         uint64_t timeOut,
+                                                         PreWaitFunctor* func)
+  {
+    const bool timed = (NEVER_TIME_OUT != timeOut);
+    const uint64_t deadlineNSecs = timed ? monotonicNSecs() + timeOut : 0;
+
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      struct timespec remainingSpec;
+      struct timespec* timeOutSpec = 0;
+      if (timed)
+      {
+        const uint64_t nowNSecs = monotonicNSecs();
+        if (nowNSecs >= deadlineNSecs)
+        {
+          break;
+        }
+        const uint64_t remainingNSecs = deadlineNSecs - nowNSecs;
+        if (remainingNSecs < static_cast<uint64_t>(POLL_BELOW_NSECS))
+        {
+          // A futex wait this short would overshoot; keep looking for data.
+          continue;
+        }
+        // Park until POLL_BELOW_NSECS before the deadline and poll the rest.
+        const uint64_t parkNSecs = remainingNSecs - static_cast<uint64_t>(POLL_BELOW_NSECS);
+        remainingSpec.tv_sec  = static_cast<time_t>(parkNSecs / NUM_NANOSECONDS_PER_SECOND);
+        remainingSpec.tv_nsec = static_cast<long>(parkNSecs % NUM_NANOSECONDS_PER_SECOND);
+        timeOutSpec = &remainingSpec;
+      }
+
+      if (func != 0)
+      {
+        (*func)();
+      }
+
+      const int32_t seq = policy.prepareReaderPark();
+      if (!isEmpty() || !isReaderRunning_.load())
+      {
+        policy.cancelReaderPark();
+        break;
+      }
+      policy.parkReader(seq, timeOutSpec);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::waitForRoom(FutexWakeupPolicy& policy,
+                                                                uint32_t length,
+                                                                uint64_t deadlineNSecs)
+  {
+    struct timespec remainingSpec;
+    struct timespec* timeOutSpec = 0;
+    if (NEVER_TIME_OUT != deadlineNSecs)
+    {
+      const uint64_t nowNSecs = monotonicNSecs();
+      if (nowNSecs >= deadlineNSecs)
+      {
+        return;
+      }
+      const uint64_t remainingNSecs = deadlineNSecs - nowNSecs;
+      remainingSpec.tv_sec  = static_cast<time_t>(remainingNSecs / NUM_NANOSECONDS_PER_SECOND);
+      remainingSpec.tv_nsec = static_cast<long>(remainingNSecs % NUM_NANOSECONDS_PER_SECOND);
+      timeOutSpec = &remainingSpec;
+    }
+
+    const int32_t seq = policy.prepareWriterPark();
+    if (!isFull(length) || !isWriterRunning_.load())
+    {
+      policy.cancelWriterPark();
+      return;
+    }
+    policy.parkWriter(seq, timeOutSpec);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::wait(AdaptiveWakeupPolicy& policy,
+                                                         uint64_t timeOut,
+                                                         PreWaitFunctor* func)
+  {
+    const uint64_t startNSecs = monotonicNSecs();
+    uint64_t elapsedNSecs = 0;
+    AdaptiveWakeupPolicy::Phase phase = policy.phaseAfter(elapsedNSecs);
+
+    while (isEmpty() && isReaderRunning_.load() && phase != AdaptiveWakeupPolicy::PARK)
+    {
+      if (NEVER_TIME_OUT != timeOut && elapsedNSecs >= timeOut)
+      {
+        break;
+      }
+      AdaptiveWakeupPolicy::backOff(phase);
+      elapsedNSecs = monotonicNSecs() - startNSecs;
+      phase = policy.phaseAfter(elapsedNSecs);
+    }
+
+    if (phase == AdaptiveWakeupPolicy::PARK && isEmpty() && isReaderRunning_.load())
+    {
+      const uint64_t remaining = NEVER_TIME_OUT == timeOut ? NEVER_TIME_OUT :
+                                 timeOut > elapsedNSecs    ? timeOut - elapsedNSecs : 0;
+      wait(static_cast<FutexWakeupPolicy&>(policy), remaining, func);
+    }
+
+    // A wait that ran out of time did not end in any phase.
+    if (!isEmpty() || !isReaderRunning_.load())
+    {
+      policy.recordReaderWait(phase);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::waitForRoom(AdaptiveWakeupPolicy& policy,
+                                                                uint32_t length,
+                                                                uint64_t deadlineNSecs)
+  {
+    const uint64_t startNSecs = monotonicNSecs();
+    AdaptiveWakeupPolicy::Phase phase = AdaptiveWakeupPolicy::SPIN;
+
+    // The whole wait happens here, so a futex wakeup that still leaves too
+    // little room parks again rather than starting over with a spin, and the
+    // wait is recorded once, in the phase it ended in, unless it timed out.
+    while (isFull(length) && isWriterRunning_.load())
+    {
+      const uint64_t nowNSecs = monotonicNSecs();
+      if (NEVER_TIME_OUT != deadlineNSecs && nowNSecs >= deadlineNSecs)
+      {
+        break;
+      }
+      phase = policy.phaseAfter(nowNSecs - startNSecs);
+      if (phase == AdaptiveWakeupPolicy::PARK)
+      {
+        waitForRoom(static_cast<FutexWakeupPolicy&>(policy), length, deadlineNSecs);
+      }
+      else
+      {
+        AdaptiveWakeupPolicy::backOff(phase);
+      }
+    }
+
+    if (!isFull(length) || !isWriterRunning_.load())
+    {
+      policy.recordWriterWait(phase);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::wait(EventFdWakeupPolicy& policy,
+                                                         uint64_t timeOut,
+                                                         PreWaitFunctor* func)
+  {
+    const bool timed = (NEVER_TIME_OUT != timeOut);
+    const uint64_t deadlineNSecs = timed ? monotonicNSecs() + timeOut : 0;
+
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      struct timespec remainingSpec;
+      struct timespec* timeOutSpec = 0;
+      if (timed)
+      {
+        const uint64_t nowNSecs = monotonicNSecs();
+        if (nowNSecs >= deadlineNSecs)
+        {
+          break;
+        }
+        const uint64_t remainingNSecs = deadlineNSecs - nowNSecs;
+        if (remainingNSecs < static_cast<uint64_t>(POLL_BELOW_NSECS))
+        {
+          continue;
+        }
+        const uint64_t parkNSecs = remainingNSecs - static_cast<uint64_t>(POLL_BELOW_NSECS);
+        remainingSpec.tv_sec  = static_cast<time_t>(parkNSecs / NUM_NANOSECONDS_PER_SECOND);
+        remainingSpec.tv_nsec = static_cast<long>(parkNSecs % NUM_NANOSECONDS_PER_SECOND);
+        timeOutSpec = &remainingSpec;
+      }
+
+      if (func != 0)
+      {
+        (*func)();
+      }
+
+      if (!armReader())
+      {
+        break;
+      }
+      policy.parkReader(timeOutSpec);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::waitForRoom(EventFdWakeupPolicy&,
+                                                                uint32_t /*length*/,
+                                                                uint64_t deadlineNSecs)
+  {
+    // Only the reader has an fd; the writer polls.
+    const useconds_t sleepUsecs = sleepUsecsUntil(deadlineNSecs);
+    if (sleepUsecs != 0)
+    {
+      usleep(sleepUsecs);
+    }
+  }
+#endif
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
+  inline
+  void LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::wait(const NoWakeupPolicy&,
+                                                         uint64_t timeOut,
+                                                         PreWaitFunctor* func)
+  {
+      if (timeOut == 0)
+      {
+          // A poll: startRead has already seen the pipe empty.
+          return;
+      }
+
+      // The deadline is fixed once, on a clock that wall-clock steps don't move.
+      const uint64_t deadlineNSecs = NEVER_TIME_OUT == timeOut ? NEVER_TIME_OUT :
+                                                                 monotonicNSecs() + timeOut;
+      while (isEmpty() && isReaderRunning_.load())
+      {
+          if (NEVER_TIME_OUT != deadlineNSecs && monotonicNSecs() >= deadlineNSecs)
+          {
+              break;
+          }
+          const useconds_t sleepUsecs = sleepUsecsUntil(deadlineNSecs);
+          if (sleepUsecs == 0)
+          {
+              // Too close to the deadline to sleep; keep looking for data.
+              continue;
           }
+          if (func != 0)
+          {
+              (*func)();
+          }
+          // This can return early on a signal, which just means another look.
+          usleep(sleepUsecs);
       }
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::isFull(uint32_t length) const NO_THROW
+  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::isFull(uint32_t length,
+                                                           VersionedPointerType readVPtr,
+                                                           VersionedPointerType writeVPtr) const NO_THROW
   {
     //in a simpler way- we could increment the writeVPtr_ and then check
     //isFull = (incrementedVersionedWritePtr >= readVPtr_)
@@ -555,20 +1648,32 @@ namespace Pipe {
 
     bool result = true;
 
-    uint32_t localReadPtr  = getPointer(readVPtr_);
-    uint32_t localWritePtr = getPointer(writeVPtr_);
-    if (localReadPtr > localWritePtr)
+    uint32_t localReadPtr  = getPointer(readVPtr);
+    uint32_t localWritePtr = getPointer(writeVPtr);
+    if (BufferPolicy::MIRRORED)
     {
-      if ((localWritePtr + (length + static_cast<uint32_t>(sizeof(length)))) < localReadPtr)
+      // Elements never skip the tail of a mirrored buffer, so all that matters
+      // is the free space, less the byte that tells full from empty.
+      const uint32_t used = localReadPtr > localWritePtr ?
+                            PIPE_SIZE - (localReadPtr - localWritePtr) :
+                            localWritePtr - localReadPtr;
+      if (length + static_cast<uint32_t>(HEADER_SIZE) < PIPE_SIZE - used)
+      {
+          result = false;
+      }
+    }
+    else if (localReadPtr > localWritePtr)
+    {
+      if ((localWritePtr + (length + static_cast<uint32_t>(HEADER_SIZE))) < localReadPtr)
       {
           result = false;
       }
     }
     else // if (localReadPtr <= localWritePtr)
     {
-      if (isWrap(static_cast<uint32_t>(sizeof(length)), localWritePtr))
+      if (isWrap(static_cast<uint32_t>(HEADER_SIZE), localWritePtr))
       {
-        if (length + static_cast<uint32_t>(sizeof(length)) < localReadPtr)
+        if (length + static_cast<uint32_t>(HEADER_SIZE) < localReadPtr)
         {
             result = false;
         }
@@ -576,7 +1681,7 @@ namespace Pipe {
       else
       {
         uint32_t tempIndex;
-        tempIndex = localWritePtr + static_cast<uint32_t>(sizeof(length));
+        tempIndex = localWritePtr + static_cast<uint32_t>(HEADER_SIZE);
         if (isWrap(length, tempIndex))
         {
           if (length < localReadPtr)
@@ -593,14 +1698,14 @@ namespace Pipe {
     return result;
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::validate(bool print) const NO_THROW
+  bool LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::validate(bool print) const NO_THROW
   {
     bool valid = true;
 
-    const uint64_t numRead = numRead_;
-    const uint64_t numWritten = numWritten_;
+    const uint64_t numRead = numRead_.load();
+    const uint64_t numWritten = numWritten_.load();
 
     if (numRead > numWritten)
     {
@@ -612,8 +1717,8 @@ namespace Pipe {
       valid = false;
     }
 
-    VersionedPointerType readVPtr = readVPtr_;
-    VersionedPointerType writeVPtr = writeVPtr_;
+    VersionedPointerType readVPtr = readVPtr_.load();
+    VersionedPointerType writeVPtr = writeVPtr_.load();
 
     if (getVersion(writeVPtr) - getVersion(readVPtr) > 1)
     {
@@ -674,13 +1779,14 @@ namespace Pipe {
     return valid;
   }
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  std::ostream& LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>::print(std::ostream& os) const
+  std::ostream& LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>::print(std::ostream& os) const
   {
     StreamGuard sg(os);
-    const VersionedPointerType rptr = readVPtr_;
-    const VersionedPointerType wptr = writeVPtr_;
+    const VersionedPointerType rptr = readVPtr_.load();
+    const VersionedPointerType wptr = writeVPtr_.load();
+    const VersionedPointerType nptr = nextWriteVPtr_.load();
 
     os << "\tNumber of items in pipe     " << count() << "\n"
        << "\tPercent full                " << percentFull() << "\n"
@@ -693,22 +1799,26 @@ namespace Pipe {
        << "(" << std::setw(8) << getVersion(rptr) << ", " << std::setw(8) << getPointer(rptr) << ")\n"
 
        << "\tNext write location         "
-       << "(" << std::setw(8) << getVersion(nextWriteVPtr_) << ", " << std::setw(8) << getPointer(nextWriteVPtr_) << ")\n"
+       << "(" << std::setw(8) << getVersion(nptr) << ", " << std::setw(8) << getPointer(nptr) << ")\n"
 
-       << "\tNum Written                 " << numWritten_ << "\n"
-       << "\tNum Read                    " << numRead_ << "\n"
-       << "\tNum Failed Writes           " << numFailedWrites_ << "\n"
-       << "\tPipe Writer is running      " << std::boolalpha << isWriterRunning_ << "\n"
-       << "\tPipe Reader is running      " << std::boolalpha << isReaderRunning_ << "\n"
+       << "\tNum Written                 " << numWritten_.load() << "\n"
+       << "\tNum Read                    " << numRead_.load() << "\n"
+       << "\tNum Failed Writes           " << numFailedWrites_.load() << "\n"
+       << "\tPipe Writer is running      " << std::boolalpha << isWriterRunning_.load() << "\n"
+       << "\tPipe Reader is running      " << std::boolalpha << isReaderRunning_.load() << "\n"
        << "\tWakeup Policy               " << wakeupPolicy_;
 
+#ifdef PIPE_INSTRUMENTATION
+    os << "\n" << stats_;
+#endif
+
     return os;
   }
 
 
-  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy, class BufferPolicy>
   inline
-  std::ostream& operator<<(std::ostream& os, const LocklessPipe<Data, PIPE_SIZE, WakeupPolicy>& pipe)
+  std::ostream& operator<<(std::ostream& os, const LocklessPipe<Data, PIPE_SIZE, WakeupPolicy, BufferPolicy>& pipe)
   {
     return pipe.print(os);
   }
@@ -723,6 +1833,8 @@ namespace Pipe {
     enum { SLEEP_ON_BLOCK_USECS = 10 };
 
     public:
+      enum { SHAREABLE = 1 };
+
       friend std::ostream& operator<<(std::ostream& os, const NoWakeupPolicy& /*policy*/)
       {
         return os << "No Wakeup Policy";
@@ -0,0 +1,27 @@
+#ifndef PIPE_MONOTONICCLOCK_HH
+#define PIPE_MONOTONICCLOCK_HH
+
+#include "Utility.h"
+
+#include <stdint.h>                       // To get uint64_t
+#include <time.h>
+
+namespace Pipe {
+
+  /*
+   * Nanoseconds on CLOCK_MONOTONIC: the clock every pipe deadline, element
+   * timestamp and sync interval is measured on, since wall-clock steps
+   * don't move it.  It is answered from the vDSO on Linux, so it costs no
+   * system call.  CLOCK_MONOTONIC is always supported, so clock_gettime()
+   * cannot fail here.
+   */
+  inline uint64_t monotonicNSecs() NO_THROW
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+  }
+
+} // Pipe
+
+#endif /* PIPE_MONOTONICCLOCK_HH */
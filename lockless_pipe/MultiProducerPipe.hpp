@@ -0,0 +1,464 @@
+#ifndef PIPE_MULTI_PRODUCER_PIPE_HPP
+#define PIPE_MULTI_PRODUCER_PIPE_HPP
+
+#include "LocklessPipe.hpp"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "Utility.h"
+
+#include <cstring>
+#include <iostream>
+#include <stdint.h>                       // To get uint32_t, uint64_t
+#include <unistd.h>
+
+namespace Pipe {
+
+  /*
+   * A multiple writer / single reader pipe that allows data of varying length.
+   *
+   * Writers claim space with a compare-and-swap on a shared tail position,
+   * fill their element in, and commit it by setting a ready flag in the
+   * element's header.  Writers may commit in any order; the reader always
+   * sees elements in the order their space was claimed, and stops at the
+   * first claimed but uncommitted element.  A writer that stalls between
+   * reserve() and commit() therefore stalls the reader too.
+   *
+   * The reader zeroes every element it consumes before handing the space
+   * back, so a header in the next lap of the ring always starts out
+   * uncommitted.
+   *
+   * Only the reader may wait in the wakeup policy (NoWakeupPolicy or
+   * FutexWakeupPolicy); writers that find the pipe full poll with usleep.
+   *
+   * PIPE_SIZE must be a power of two.
+   */
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy = NoWakeupPolicy>
+  class MultiProducerPipe {
+    /*
+     * The amount of time a writer will sleep when the pipe is full, and the
+     * reader when it is empty (NoWakeupPolicy only).
+     */
+    enum { SLEEP_ON_BLOCK_USECS = 1000 };
+
+    CT_ASSERT(PipeSizeIsPowerOfTwo, (PIPE_SIZE & (PIPE_SIZE - 1)) == 0);
+
+    public:
+
+    typedef Data DataHandle;
+    /*
+     * Constructor
+     */
+    explicit MultiProducerPipe();
+
+    ~MultiProducerPipe() { }
+
+    /*
+     * push 'Data' into the pipe, blocking if there is not enough room.
+     * Safe to call from any number of threads at once.
+     * \param value the 'Data' to push.
+     * \throws Interrupted if the writers have been stopped.
+     */
+    void push(const Data& value) {
+      void *ptr = reserve(static_cast<uint32_t>(value.length()), true);
+      if (ptr) {
+        std::memcpy(ptr, value.data(), value.length());
+        commit(ptr);
+      }
+    }
+    /*
+     * push 'Data' into the pipe if there is room, without blocking.
+     * \param value the 'Data' to push.
+     * \return true if pushed, false if the pipe was full.
+     * \throws Interrupted if the writers have been stopped.
+     */
+    bool tryPush(const Data& value) {
+      void *ptr = reserve(static_cast<uint32_t>(value.length()), false);
+      if (ptr) {
+        std::memcpy(ptr, value.data(), value.length());
+        commit(ptr);
+      }
+      return ptr != NULL;
+    }
+    /*
+     * Claim room for an element of 'length' bytes.  The element becomes
+     * visible to the reader (in claim order) once it is passed to commit().
+     * \param length the exact size of the element
+     * \param block wait for room if the pipe is full
+     * \return where to write the element, or NULL if the element is too large
+     *         or the pipe is full and block is false (either is counted in
+     *         numFailedWrites())
+     * \throws Interrupted if the writers have been stopped.
+     */
+    void* reserve(uint32_t length, bool block = true);
+    /*
+     * Publish an element obtained from reserve().
+     */
+    void commit(void* ptr);
+
+    /*
+     * pop 'Data' off the pipe, blocking if the pipe is empty.
+     * \param value The 'Data' to pop (this wil be a handle over the raw data copied into buffer)
+     * \param buffer pointer to a raw buffer where the popped item will be copied to
+     * \param func pointer to the functor to call just before the pipe goes to sleep
+     * \throws Interrupted if the reader has been stopped.
+     */
+    void pop(Data& value, void* buffer, PreWaitFunctor* func = 0);
+    /*
+     * pop 'Data' off the pipe if the next element has been committed, whether
+     * or not the reader is running.
+     * \return true if popped, false if there was nothing to pop
+     */
+    bool tryPop(Data& value, void* buffer);
+
+    bool isWriterRunning() const NO_THROW {
+      return isWriterRunning_.load();
+    }
+    bool isReaderRunning() const NO_THROW {
+      return isReaderRunning_.load();
+    }
+    void startWriter() {
+      isWriterRunning_.store(true);
+    }
+    /*
+     * Stop all the writers.
+     * All subsequent calls to push will throw Interrupted exceptions.
+     */
+    void stopWriter() {
+      isWriterRunning_.store(false);
+    }
+    void startReader() {
+      isReaderRunning_.store(true);
+    }
+    /*
+     * Stop the reader.
+     * All subsequent calls to pop will throw Interrupted exceptions.
+     */
+    void stopReader() {
+      isReaderRunning_.store(false);
+      wakeup(wakeupPolicy_);
+    }
+    /*
+     * Is the next element to read still uncommitted (or not even claimed)?
+     */
+    bool isEmpty() const NO_THROW {
+      return headerAt(headPosition_.load())->committed.loadAcquire() == 0;
+    }
+    /*
+     * How many bytes of the pipe are claimed, including padding and headers?
+     */
+    uint64_t bytesClaimed() const NO_THROW {
+      return tailPosition_.load() - headPosition_.load();
+    }
+    uint64_t numRead() const NO_THROW {
+      return numRead_.load();
+    }
+    uint64_t numFailedWrites() const NO_THROW {
+      return numFailedWrites_.load();
+    }
+    uint32_t getPipeSize() const NO_THROW {
+      return PIPE_SIZE;
+    }
+    uint32_t getMaxPipeElementSize() const NO_THROW {
+      return MAX_PIPE_ELEMENT_SIZE;
+    }
+    WakeupPolicy& getWakeupPolicy() NO_THROW {
+      return wakeupPolicy_;
+    }
+    /*
+     * print stats about the pipe
+     */
+    std::ostream& print(std::ostream& os) const;
+
+
+    private:
+    /*
+     * Every element is preceded by a header and padded to RECORD_ALIGNMENT.
+     * 'committed' is 0 until the writer commits, then DATA, or PADDING for the
+     * filler a writer leaves when an element will not fit before the end of
+     * the ring.
+     */
+    struct RecordHeader {
+      PipeAtomic<int32_t> committed;
+      uint32_t            length;
+    };
+    enum { HEADER_SIZE = 8, RECORD_ALIGNMENT = 8 };
+    enum RecordType { DATA = 1, PADDING = 2 };
+
+    CT_ASSERT(HeaderSize, sizeof(RecordHeader) == HEADER_SIZE);
+
+    static const uint32_t MAX_PIPE_ELEMENT_SIZE = PIPE_SIZE - HEADER_SIZE;
+
+    // Shared by all the writers.
+    PIPE_CALIGNED PipeAtomic<uint64_t> tailPosition_;
+    // The last headPosition_ any writer saw; only ever behind the real one.
+    PipeAtomic<uint64_t> headCache_;
+    PipeAtomic<uint64_t> numFailedWrites_;
+    PipeAtomic<bool> isWriterRunning_;
+
+    // Reader-owned.
+    PIPE_CALIGNED PipeAtomic<uint64_t> headPosition_;
+    PipeAtomic<uint64_t> numRead_;
+    PipeAtomic<bool> isReaderRunning_;
+
+    PIPE_CALIGNED WakeupPolicy wakeupPolicy_;
+
+    EmbeddedBuffer<PIPE_SIZE> buffer_;
+
+    RecordHeader* headerAt(uint64_t position) const NO_THROW {
+      char* buf = const_cast<EmbeddedBuffer<PIPE_SIZE>&>(buffer_).data();
+      return reinterpret_cast<RecordHeader*>(&buf[position & (PIPE_SIZE - 1)]);
+    }
+
+    bool hasRoom(uint64_t tail, uint32_t size) NO_THROW;
+
+    void wakeup(const NoWakeupPolicy&) { }
+
+    void wait(const NoWakeupPolicy&, PreWaitFunctor* func);
+
+#ifdef __linux__
+    void wakeup(FutexWakeupPolicy& policy) { policy.wakeReader(); }
+
+    void wait(FutexWakeupPolicy& policy, PreWaitFunctor* func);
+#endif
+  };
+
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::MultiProducerPipe()
+  {
+    tailPosition_.store(0);
+    headCache_.store(0);
+    numFailedWrites_.store(0);
+    isWriterRunning_.store(true);
+
+    headPosition_.store(0);
+    numRead_.store(0);
+    isReaderRunning_.store(true);
+
+    // Every header must start out uncommitted.
+    std::memset(buffer_.data(), 0, PIPE_SIZE);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  bool MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::hasRoom(uint64_t tail, uint32_t size) NO_THROW
+  {
+    if (tail + size - headCache_.loadAcquire() <= PIPE_SIZE)
+    {
+      return true;
+    }
+    // Acquire: the reader has zeroed the space it released.  Passed on to the
+    // other writers through headCache_.
+    const uint64_t head = headPosition_.loadAcquire();
+    headCache_.storeRelease(head);
+    return tail + size - head <= PIPE_SIZE;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  void* MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::reserve(uint32_t length, bool block)
+  {
+    if (length > MAX_PIPE_ELEMENT_SIZE)
+    {
+        std::cerr << "MultiProducerPipe: Data Passed in is too large! Length: " << length << "\n";
+        numFailedWrites_.fetchAdd(1);
+        return NULL;
+    }
+
+    const uint32_t recordSize = static_cast<uint32_t>(align_up<RECORD_ALIGNMENT>(HEADER_SIZE + length));
+    char* const buf = buffer_.data();
+
+    for (;;)
+    {
+      if (!isWriterRunning_.load())
+      {
+        throw Interrupted();
+      }
+
+      const uint64_t tail = tailPosition_.load();
+      const uint32_t offset = static_cast<uint32_t>(tail & (PIPE_SIZE - 1));
+      const uint32_t toEnd = PIPE_SIZE - offset;
+
+      // An element that would run off the end of the ring is preceded by a
+      // padding record up to the end, claimed on its own so that an element
+      // as large as the ring can still be placed once the reader has
+      // skipped the padding.
+      const uint32_t claimSize = recordSize <= toEnd ? recordSize : toEnd;
+
+      if (!hasRoom(tail, claimSize))
+      {
+        if (tailPosition_.load() != tail)
+        {
+          // Other writers have claimed space since tail was read, and the
+          // reader may have consumed it, leaving the head past this tail and
+          // the pipe looking full.  Try again with the current tail.
+          continue;
+        }
+        if (!block)
+        {
+          numFailedWrites_.fetchAdd(1);
+          return NULL;
+        }
+        usleep(SLEEP_ON_BLOCK_USECS);
+        continue;
+      }
+
+      if (!tailPosition_.compareExchange(tail, tail + claimSize))
+      {
+        // Another writer got there first
+        continue;
+      }
+
+      RecordHeader* header = reinterpret_cast<RecordHeader*>(&buf[offset]);
+      if (claimSize != recordSize)
+      {
+        // The reader may already be parked on this header, with elements
+        // committed beyond it.
+        header->committed.storeRelease(PADDING);
+        wakeup(wakeupPolicy_);
+        continue;
+      }
+
+      header->length = length;
+      return &buf[offset + HEADER_SIZE];
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  void MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::commit(void* ptr)
+  {
+    RecordHeader* header = reinterpret_cast<RecordHeader*>(static_cast<char*>(ptr) - HEADER_SIZE);
+
+    // Release: the element's data is visible before it is marked committed.
+    header->committed.storeRelease(DATA);
+
+    wakeup(wakeupPolicy_);
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  bool MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::tryPop(Data& value, void* buffer)
+  {
+    char* const buf = buffer_.data();
+
+    for (;;)
+    {
+      const uint64_t head = headPosition_.load();
+      const uint32_t offset = static_cast<uint32_t>(head & (PIPE_SIZE - 1));
+      RecordHeader* header = reinterpret_cast<RecordHeader*>(&buf[offset]);
+
+      const int32_t committed = header->committed.loadAcquire();
+      if (committed == 0)
+      {
+        return false;
+      }
+
+      uint32_t recordSize = PIPE_SIZE - offset;
+      if (committed == DATA)
+      {
+        const uint32_t length = header->length;
+        recordSize = static_cast<uint32_t>(align_up<RECORD_ALIGNMENT>(HEADER_SIZE + length));
+        std::memcpy(buffer, &buf[offset + HEADER_SIZE], length);
+        value = Data(static_cast<char*>(buffer), length);
+      }
+
+      // Release: the element is zeroed (and copied out) before writers can
+      // claim the space again.
+      std::memset(&buf[offset], 0, recordSize);
+      headPosition_.storeRelease(head + recordSize);
+
+      if (committed == DATA)
+      {
+        numRead_.store(numRead_.load() + 1);
+        return true;
+      }
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  void MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::pop(Data& value, void* buffer, PreWaitFunctor* func)
+  {
+    for (;;)
+    {
+      // Like LocklessPipe, a stopped reader is told so even if there is
+      // something to pop.
+      if (!isReaderRunning_.load())
+      {
+        throw Interrupted();
+      }
+      if (tryPop(value, buffer))
+      {
+        return;
+      }
+      wait(wakeupPolicy_, func);
+    }
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  void MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::wait(const NoWakeupPolicy&, PreWaitFunctor* func)
+  {
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      if (func != 0)
+      {
+        (*func)();
+      }
+      usleep(SLEEP_ON_BLOCK_USECS);
+    }
+  }
+
+#ifdef __linux__
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  void MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::wait(FutexWakeupPolicy& policy, PreWaitFunctor* func)
+  {
+    while (isEmpty() && isReaderRunning_.load())
+    {
+      if (func != 0)
+      {
+        (*func)();
+      }
+
+      const int32_t seq = policy.prepareReaderPark();
+      if (!isEmpty() || !isReaderRunning_.load())
+      {
+        policy.cancelReaderPark();
+        break;
+      }
+      policy.parkReader(seq, 0);
+    }
+  }
+#endif
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  std::ostream& MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>::print(std::ostream& os) const
+  {
+    os << "\tBytes claimed               " << bytesClaimed() << "\n"
+       << "\tPipe size (in bytes)        " << PIPE_SIZE << "\n"
+       << "\tTail position               " << tailPosition_.load() << "\n"
+       << "\tHead position               " << headPosition_.load() << "\n"
+       << "\tNum Read                    " << numRead_.load() << "\n"
+       << "\tNum Failed Writes           " << numFailedWrites_.load() << "\n"
+       << "\tPipe Writers are running    " << std::boolalpha << isWriterRunning_.load() << "\n"
+       << "\tPipe Reader is running      " << std::boolalpha << isReaderRunning_.load() << "\n"
+       << "\tWakeup Policy               " << wakeupPolicy_;
+
+    return os;
+  }
+
+  template<class Data, uint32_t PIPE_SIZE, class WakeupPolicy>
+  inline
+  std::ostream& operator<<(std::ostream& os, const MultiProducerPipe<Data, PIPE_SIZE, WakeupPolicy>& pipe)
+  {
+    return pipe.print(os);
+  }
+
+} // Pipe
+
+
+#endif /* PIPE_MULTI_PRODUCER_PIPE_HPP */
@@ -0,0 +1,387 @@
+#ifndef PIPE_PERSISTENTPIPEFACTORY_HH
+#define PIPE_PERSISTENTPIPEFACTORY_HH
+
+#include "Errno.hh"
+#include "LocklessPipe.hpp"
+#include "MonotonicClock.hh"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "Utility.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <new>
+#include <stdint.h>                       // To get uint32_t, uint64_t
+#include <stdlib.h>                       // To get mkstemp
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Pipe {
+
+  // Which side of a persistent pipe a process is reopening.
+  namespace PipeEnd {
+    enum Type { WRITER, READER, BOTH };
+  }
+
+  /*
+   * The start of every persistent pipe file.  It is written in full before
+   * the file gets its name, so a file that has a name has a whole header.
+   */
+  struct PersistentPipeHeader
+  {
+    static const uint64_t MAGIC = 0x4C4B4C5350504552ULL;      // "LKLSPPER"
+    enum { VERSION = 1 };
+
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pad;
+    // The size of the whole file, header included.
+    uint64_t regionSize;
+    // What the creator's pipe type looked like, so an opener compiled with a
+    // different one is turned away.
+    uint64_t pipeObjectSize;
+    uint32_t pipeSize;
+    uint32_t maxPipeElementSize;
+    // When syncIfDue() last synced, on the monotonic clock.
+    PipeAtomic<uint64_t> lastSyncNSecs;
+  };
+
+  /*
+   * Places a LocklessPipe in a memory-mapped file, so that what was pushed
+   * survives the processes that use it: a writer or reader that crashes, or
+   * is restarted, reopens the file and carries on from the last published
+   * element and the last released one.  It makes a cheap local write-ahead
+   * queue between two processes, or between two runs of one.
+   *
+   * The file is a PersistentPipeHeader followed, on a fresh cache line, by
+   * the pipe itself, so the ring and the versioned pointers are all in the
+   * file.  open() creates the file if it does not exist.  Otherwise it
+   * checks that the header matches this PipeType and the pipe validates,
+   * then recovers the side being reopened (see LocklessPipe::recoverWriter()
+   * and recoverReader()): the reader starts again at the element after the
+   * last one it released, and the writer loses only what it had not
+   * published.  Each process calls close() when done.
+   *
+   * Stores into the pipe go to the page cache, so they survive a process
+   * crash as soon as they are made; the kernel writes them back to the disk
+   * in its own time.  To survive an operating system crash too, call sync(),
+   * which waits for the write-back, or have the writer call syncIfDue() after
+   * pushing to sync at most once per interval.  A crash between syncs can
+   * leave the write pointer on disk ahead of records that were not written
+   * back yet; recoverReader() catches a broken chain of lengths, but records
+   * that must be proven whole should carry their own checksum.
+   *
+   * The pipe must use an EmbeddedBuffer; the rings of MirroredBuffer and
+   * HeapBuffer are not in the pipe object.  EventFdWakeupPolicy's fd does not
+   * survive the process, so it cannot be used either.  Both are checked at
+   * compile time, through the policies' SHAREABLE.
+   */
+  template<class PipeType>
+  class PersistentPipeFactory
+  {
+    public:
+      /*
+       * Map the pipe in the file at 'path', creating the file and the pipe if
+       * it does not exist yet, or recovering 'end' of the pipe if it does.
+       * Open a side only while no other process is using it.
+       * \param path the file to keep the pipe in
+       * \param end the side, or sides, of the pipe this process will use
+       * \param created set to whether the file was created, if not NULL
+       * \param mode the permissions of a new file
+       * \throws Errno if the file cannot be created or mapped, or does not
+       *         hold a valid pipe of this type (EINVAL)
+       */
+      static PipeType* open(const std::string& path,
+                            PipeEnd::Type end = PipeEnd::BOTH,
+                            bool* created = NULL,
+                            mode_t mode = 0600);
+
+      /*
+       * Write everything stored in the pipe back to the file.
+       * \param wait whether to wait for the write-back (MS_SYNC) or only
+       *        schedule it (MS_ASYNC, which Linux leaves to its flusher)
+       * \throws Errno if the write-back fails
+       */
+      static void sync(PipeType* pipe, bool wait = true);
+
+      /*
+       * sync(pipe, wait) if no syncIfDue() has in the last intervalNSecs, so
+       * the writer can call it after every push for a bounded loss window.
+       * \return whether it synced
+       * \throws Errno if the write-back fails
+       */
+      static bool syncIfDue(PipeType* pipe, uint64_t intervalNSecs, bool wait = true);
+
+      /*
+       * Sync and unmap a pipe returned by open().  The file keeps the pipe.
+       */
+      static void close(PipeType* pipe) NO_THROW;
+
+      /*
+       * Remove the file.  Processes that have it mapped keep it until they
+       * close.
+       * \throws Errno if the file cannot be removed
+       */
+      static void unlink(const std::string& path);
+
+    private:
+      CT_ASSERT(EmbeddedBufferOnly, PipeType::BufferPolicyType::SHAREABLE);
+      CT_ASSERT(ShareableWakeupPolicyOnly, PipeType::WakeupPolicyType::SHAREABLE);
+
+      enum {
+        PIPE_OFFSET = (sizeof(PersistentPipeHeader) + PIPE_CACHE_LINE_SIZE - 1) /
+                      PIPE_CACHE_LINE_SIZE * PIPE_CACHE_LINE_SIZE
+      };
+
+      static PipeType* create(const std::string& path, mode_t mode);
+      static PipeType* attach(const std::string& path, int fd, PipeEnd::Type end);
+
+      static PersistentPipeHeader* headerOf(PipeType* pipe) NO_THROW {
+        return reinterpret_cast<PersistentPipeHeader*>(reinterpret_cast<char*>(pipe) - PIPE_OFFSET);
+      }
+  };
+
+
+  template<class PipeType>
+  inline
+  PipeType* PersistentPipeFactory<PipeType>::open(const std::string& path,
+                                                  PipeEnd::Type end,
+                                                  bool* created,
+                                                  mode_t mode)
+  {
+    for (;;)
+    {
+      const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+      if (fd != -1)
+      {
+        if (created != NULL)
+        {
+          *created = false;
+        }
+        return attach(path, fd, end);
+      }
+      if (errno != ENOENT)
+      {
+        throw Errno("opening persistent pipe") << " " << path;
+      }
+
+      PipeType* pipe = create(path, mode);
+      if (pipe != NULL)
+      {
+        if (created != NULL)
+        {
+          *created = true;
+        }
+        return pipe;
+      }
+      // Another process created it first; open theirs.
+    }
+  }
+
+  /*
+   * Build the pipe in a temporary file and link it to 'path' once it is
+   * complete, so a crash part way leaves no half made pipe behind.
+   * \return NULL if another process linked its pipe to 'path' first
+   */
+  template<class PipeType>
+  inline
+  PipeType* PersistentPipeFactory<PipeType>::create(const std::string& path, mode_t mode)
+  {
+    std::string tempPath = path + ".XXXXXX";
+    const int fd = mkstemp(&tempPath[0]);
+    if (fd == -1)
+    {
+      throw Errno("creating persistent pipe") << " " << path;
+    }
+
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t regionSize = (PIPE_OFFSET + sizeof(PipeType) + pageSize - 1) / pageSize * pageSize;
+
+    void* base = MAP_FAILED;
+    if (fchmod(fd, mode) == 0 && ftruncate(fd, static_cast<off_t>(regionSize)) == 0)
+    {
+      base = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED)
+    {
+      Errno e("creating persistent pipe");
+      ::close(fd);
+      ::unlink(tempPath.c_str());
+      throw e << " " << path << " of " << regionSize << " bytes";
+    }
+
+    PersistentPipeHeader* header = new (base) PersistentPipeHeader();
+    PipeType* pipe = new (static_cast<char*>(base) + PIPE_OFFSET) PipeType();
+
+    header->magic = PersistentPipeHeader::MAGIC;
+    header->version = PersistentPipeHeader::VERSION;
+    header->regionSize = regionSize;
+    header->pipeObjectSize = sizeof(PipeType);
+    header->pipeSize = pipe->getPipeSize();
+    header->maxPipeElementSize = pipe->getMaxPipeElementSize();
+
+    // The whole file is on the disk before it has a name.
+    int err = 0;
+    if (fsync(fd) != 0 || link(tempPath.c_str(), path.c_str()) != 0)
+    {
+      err = errno;
+    }
+    ::close(fd);
+    ::unlink(tempPath.c_str());
+
+    if (err != 0)
+    {
+      munmap(base, regionSize);
+      if (err == EEXIST)
+      {
+        return NULL;
+      }
+      throw Errno(err, "creating persistent pipe") << " " << path;
+    }
+
+    // And the name is on the disk before anything is pushed.
+    const std::string::size_type slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." :
+                            slash == 0 ? "/" : path.substr(0, slash);
+    const int dirFd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dirFd != -1)
+    {
+      fsync(dirFd);
+      ::close(dirFd);
+    }
+
+    return pipe;
+  }
+
+  template<class PipeType>
+  inline
+  PipeType* PersistentPipeFactory<PipeType>::attach(const std::string& path,
+                                                    int fd,
+                                                    PipeEnd::Type end)
+  {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      Errno e("opening persistent pipe");
+      ::close(fd);
+      throw e << " " << path;
+    }
+    const size_t regionSize = static_cast<size_t>(st.st_size);
+    if (regionSize < PIPE_OFFSET + sizeof(PipeType))
+    {
+      ::close(fd);
+      throw Errno(EINVAL, "opening persistent pipe")
+              << " " << path << " of " << regionSize << " bytes";
+    }
+
+    void* base = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+      Errno e("opening persistent pipe");
+      ::close(fd);
+      throw e << " " << path;
+    }
+    // The mapping keeps the file open.
+    ::close(fd);
+
+    PersistentPipeHeader* header = static_cast<PersistentPipeHeader*>(base);
+    PipeType* pipe = reinterpret_cast<PipeType*>(static_cast<char*>(base) + PIPE_OFFSET);
+
+    const char* problem = NULL;
+    if (header->magic != PersistentPipeHeader::MAGIC)
+    {
+      problem = "it is not a persistent pipe";
+    }
+    else if (header->version != PersistentPipeHeader::VERSION)
+    {
+      problem = "it has a different header version";
+    }
+    else if (header->regionSize != regionSize ||
+             header->pipeObjectSize != sizeof(PipeType) ||
+             header->pipeSize != pipe->getPipeSize() ||
+             header->maxPipeElementSize != pipe->getMaxPipeElementSize())
+    {
+      problem = "it was created for a different pipe type";
+    }
+    else if (!pipe->validate(true))
+    {
+      problem = "the pipe failed validation";
+    }
+    else
+    {
+      if (end != PipeEnd::READER)
+      {
+        pipe->recoverWriter();
+      }
+      if (end != PipeEnd::WRITER && !pipe->recoverReader())
+      {
+        problem = "the elements in the pipe are corrupt";
+      }
+    }
+
+    if (problem != NULL)
+    {
+      munmap(base, regionSize);
+      throw Errno(EINVAL, "opening persistent pipe") << " " << path << ", " << problem;
+    }
+
+    return pipe;
+  }
+
+  template<class PipeType>
+  inline
+  void PersistentPipeFactory<PipeType>::sync(PipeType* pipe, bool wait)
+  {
+    PersistentPipeHeader* header = headerOf(pipe);
+    if (msync(header, header->regionSize, wait ? MS_SYNC : MS_ASYNC) != 0)
+    {
+      throw Errno("syncing persistent pipe");
+    }
+  }
+
+  template<class PipeType>
+  inline
+  bool PersistentPipeFactory<PipeType>::syncIfDue(PipeType* pipe, uint64_t intervalNSecs, bool wait)
+  {
+    PersistentPipeHeader* header = headerOf(pipe);
+    const uint64_t now = monotonicNSecs();
+    const uint64_t last = header->lastSyncNSecs.load();
+    // The clock restarts at boot, so a time from before then counts as due.
+    if (now >= last && now - last < intervalNSecs)
+    {
+      return false;
+    }
+    // Only one caller syncs for the interval.
+    if (!header->lastSyncNSecs.compareExchange(last, now))
+    {
+      return false;
+    }
+    sync(pipe, wait);
+    return true;
+  }
+
+  template<class PipeType>
+  inline
+  void PersistentPipeFactory<PipeType>::close(PipeType* pipe) NO_THROW
+  {
+    PersistentPipeHeader* header = headerOf(pipe);
+    const size_t regionSize = header->regionSize;
+    msync(header, regionSize, MS_SYNC);
+    munmap(header, regionSize);
+  }
+
+  template<class PipeType>
+  inline
+  void PersistentPipeFactory<PipeType>::unlink(const std::string& path)
+  {
+    if (::unlink(path.c_str()) != 0)
+    {
+      throw Errno("removing persistent pipe") << " " << path;
+    }
+  }
+
+} // Pipe
+
+#endif /* PIPE_PERSISTENTPIPEFACTORY_HH */
@@ -0,0 +1,489 @@
+/******************************************************************************
+ * Throughput and latency benchmark for LocklessPipe.
+ *
+ * One writer thread pushes timestamped messages as fast as it can, one reader
+ * thread pops them, for every combination of
+ *
+ *   wakeup policy  NoWakeupPolicy, FutexWakeupPolicy, AdaptiveWakeupPolicy,
+ *                  EventFdWakeupPolicy (the last three on Linux only)
+ *   pipe size      64KB, 1MB
+ *   message size   8 bytes, then x8 up to MAX_PIPE_ELEMENT_SIZE
+ *   CPU pair       unpinned, and on Linux and Solaris writer and reader
+ *                  pinned to two hardware threads of one core, two cores of
+ *                  one socket, and two sockets, where the machine has them
+ *
+ * and reports messages/sec, MB/sec and the enqueue-to-dequeue latency
+ * histogram.  The latency is measured at full load, so it includes the time
+ * a message spends queued behind the ones before it.
+ *
+ * Options:
+ * --messages=<count>  (200000 by default)
+ *  How many messages each run pushes through the pipe
+ * --policy=(none|futex|adaptive|eventfd|all)
+ *  Which wakeup policies to run
+ * --pairs=<list>  (unpinned,same-core,same-socket,cross-socket by default)
+ *  Which CPU pairs to run, comma separated
+ * --histogram
+ *  Print the full latency percentile ladder for every run
+ ******************************************************************************/
+
+#include "LatencyHistogram.hh"
+#include "LocklessPipe.hpp"
+#include "MonotonicClock.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef __sun
+#include <kstat.h>
+#include <sys/processor.h>
+#include <sys/procset.h>
+#endif
+
+namespace {
+
+  /*
+   * The Data handle pushed through the pipe: just a pointer and a length.
+   */
+  class Message
+  {
+    public:
+      Message() : data_(NULL), length_(0) { }
+      Message(char* data, uint32_t length) : data_(data), length_(length) { }
+
+      const char* data() const { return data_; }
+      uint32_t length() const { return length_; }
+
+    private:
+      char*    data_;
+      uint32_t length_;
+  };
+
+  // The smallest message carries just its send time.
+  const uint32_t MIN_MESSAGE_SIZE = sizeof(uint64_t);
+
+  struct CpuPair
+  {
+    std::string name;
+    int         writerCpu;              // -1 for unpinned
+    int         readerCpu;
+  };
+
+  struct Options
+  {
+    uint64_t    messages;
+    std::string policy;
+    std::string pairs;
+    bool        histogram;
+  };
+
+  Options options;
+
+  bool wanted(const std::string& list, const std::string& item)
+  {
+    return ("," + list + ",").find("," + item + ",") != std::string::npos;
+  }
+
+  /*
+   * Bind the calling thread to one CPU.  Returns false if that fails.
+   */
+  bool pinTo(int cpu)
+  {
+    if (cpu < 0)
+    {
+      return true;
+    }
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(__sun)
+    return processor_bind(P_LWPID, P_MYID, cpu, NULL) == 0;
+#else
+    return false;
+#endif
+  }
+
+#if defined(__linux__)
+  int readTopology(int cpu, const char* item)
+  {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, item);
+
+    int value = -1;
+    FILE* file = fopen(path, "r");
+    if (file != NULL)
+    {
+      if (fscanf(file, "%d", &value) != 1)
+      {
+        value = -1;
+      }
+      fclose(file);
+    }
+    return value;
+  }
+
+  /*
+   * The socket and core a CPU sits on, or -1 if the kernel doesn't say.
+   */
+  void cpuLocation(int cpu, int& socket, int& core)
+  {
+    socket = readTopology(cpu, "physical_package_id");
+    core = readTopology(cpu, "core_id");
+  }
+#elif defined(__sun)
+  int kstatValue(kstat_t* ksp, const char* item)
+  {
+    const kstat_named_t* named =
+      static_cast<const kstat_named_t*>(kstat_data_lookup(ksp, const_cast<char*>(item)));
+    if (named == NULL)
+    {
+      return -1;
+    }
+    switch (named->data_type)
+    {
+      case KSTAT_DATA_INT32:  return named->value.i32;
+      case KSTAT_DATA_UINT32: return static_cast<int>(named->value.ui32);
+      case KSTAT_DATA_INT64:  return static_cast<int>(named->value.i64);
+      case KSTAT_DATA_UINT64: return static_cast<int>(named->value.ui64);
+      default:                return -1;
+    }
+  }
+
+  /*
+   * The socket (chip) and core a CPU sits on, from its cpu_info kstat,
+   * or -1 if the CPU doesn't exist or the kstat can't be read.
+   */
+  void cpuLocation(int cpu, int& socket, int& core)
+  {
+    socket = core = -1;
+
+    kstat_ctl_t* kc = kstat_open();
+    if (kc == NULL)
+    {
+      return;
+    }
+    kstat_t* ksp = kstat_lookup(kc, const_cast<char*>("cpu_info"), cpu, NULL);
+    if (ksp != NULL && kstat_read(kc, ksp, NULL) != -1)
+    {
+      socket = kstatValue(ksp, "chip_id");
+      core = kstatValue(ksp, "core_id");
+    }
+    kstat_close(kc);
+  }
+#endif
+
+  /*
+   * The CPU pairs this machine has, starting from CPU 0.
+   */
+  std::vector<CpuPair> findCpuPairs()
+  {
+    std::vector<CpuPair> pairs;
+
+    CpuPair unpinned = { "unpinned", -1, -1 };
+    pairs.push_back(unpinned);
+
+#if defined(__linux__) || defined(__sun)
+    const int numCpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    int socket0, core0;
+    cpuLocation(0, socket0, core0);
+
+    int sameCore = -1, sameSocket = -1, crossSocket = -1;
+    for (int cpu = 1; cpu < numCpus; ++cpu)
+    {
+      int socket, core;
+      cpuLocation(cpu, socket, core);
+      if (socket < 0 || core < 0)
+      {
+        continue;
+      }
+      if (socket == socket0 && core == core0 && sameCore < 0)
+      {
+        sameCore = cpu;
+      }
+      else if (socket == socket0 && core != core0 && sameSocket < 0)
+      {
+        sameSocket = cpu;
+      }
+      else if (socket != socket0 && crossSocket < 0)
+      {
+        crossSocket = cpu;
+      }
+    }
+
+    const char* names[] = { "same-core", "same-socket", "cross-socket" };
+    const int readers[] = { sameCore, sameSocket, crossSocket };
+    for (int i = 0; i < 3; ++i)
+    {
+      if (readers[i] >= 0)
+      {
+        CpuPair pair = { names[i], 0, readers[i] };
+        pairs.push_back(pair);
+      }
+    }
+#endif
+
+    return pairs;
+  }
+
+  /*
+   * Lets the writer and the reader start together, once both are pinned.
+   */
+  class StartLine
+  {
+    public:
+      StartLine() : arrived_(0) { }
+
+      void arrive() {
+        arrived_.fetchAdd(1);
+        while (arrived_.load() < 2)
+        {
+        }
+      }
+
+    private:
+      Pipe::PipeAtomic<uint32_t> arrived_;
+  };
+
+  template<class PipeType>
+  struct Run
+  {
+    PipeType*                pipe;
+    uint32_t                 messageSize;
+    const CpuPair*           pair;
+    StartLine                start;
+    uint64_t                 startNSecs;
+    uint64_t                 endNSecs;
+    Pipe::LatencyHistogram   latency;
+  };
+
+  template<class PipeType>
+  void* writer(void* arg)
+  {
+    Run<PipeType>& run = *static_cast<Run<PipeType>*>(arg);
+    pinTo(run.pair->writerCpu);
+
+    std::vector<char> buffer(run.messageSize, 'x');
+    Message message(&buffer[0], run.messageSize);
+
+    run.start.arrive();
+    run.startNSecs = Pipe::monotonicNSecs();
+
+    for (uint64_t i = 0; i < options.messages; ++i)
+    {
+      const uint64_t sent = Pipe::monotonicNSecs();
+      std::memcpy(&buffer[0], &sent, sizeof(sent));
+      run.pipe->push(message);
+    }
+    return NULL;
+  }
+
+  template<class PipeType>
+  void* reader(void* arg)
+  {
+    Run<PipeType>& run = *static_cast<Run<PipeType>*>(arg);
+    pinTo(run.pair->readerCpu);
+
+    std::vector<char> buffer(run.pipe->getMaxPipeElementSize());
+    Message message;
+
+    run.start.arrive();
+
+    for (uint64_t i = 0; i < options.messages; ++i)
+    {
+      run.pipe->pop(message, &buffer[0]);
+
+      uint64_t sent;
+      std::memcpy(&sent, message.data(), sizeof(sent));
+      run.latency.record(Pipe::monotonicNSecs() - sent);
+    }
+    run.endNSecs = Pipe::monotonicNSecs();
+    return NULL;
+  }
+
+  /*
+   * The pipes are large and cache line aligned, which plain new does not
+   * promise before C++17.
+   */
+  template<class PipeType>
+  PipeType* newPipe()
+  {
+    void* memory = NULL;
+    if (posix_memalign(&memory, PIPE_CACHE_LINE_SIZE, sizeof(PipeType)) != 0)
+    {
+      perror("posix_memalign failed");
+      exit(1);
+    }
+    return new (memory) PipeType();
+  }
+
+  template<class PipeType>
+  void deletePipe(PipeType* pipe)
+  {
+    pipe->~PipeType();
+    free(pipe);
+  }
+
+  template<class PipeType>
+  void runOne(const char* policyName, const CpuPair& pair, uint32_t messageSize)
+  {
+    Run<PipeType> run;
+    run.pipe = newPipe<PipeType>();
+    run.messageSize = messageSize;
+    run.pair = &pair;
+
+    pthread_t writerThread, readerThread;
+    if (pthread_create(&readerThread, NULL, reader<PipeType>, &run) != 0 ||
+        pthread_create(&writerThread, NULL, writer<PipeType>, &run) != 0)
+    {
+      perror("pthread_create failed");
+      exit(2);
+    }
+    pthread_join(writerThread, NULL);
+    pthread_join(readerThread, NULL);
+
+    const double seconds = (run.endNSecs - run.startNSecs) / 1e9;
+    const double messagesPerSec = options.messages / seconds;
+
+    printf("%-9s %8u %-13s %8u %12.0f %10.1f %9llu %9llu %9llu %11llu\n",
+           policyName, run.pipe->getPipeSize(), pair.name.c_str(), messageSize,
+           messagesPerSec, messagesPerSec * messageSize / (1024.0 * 1024.0),
+           (unsigned long long)run.latency.valueAtPercentile(50.0),
+           (unsigned long long)run.latency.valueAtPercentile(99.0),
+           (unsigned long long)run.latency.valueAtPercentile(99.9),
+           (unsigned long long)run.latency.max());
+    if (options.histogram)
+    {
+      std::cout << "    " << run.latency << std::endl;
+    }
+
+    deletePipe(run.pipe);
+  }
+
+  template<class PipeType>
+  void runPipe(const char* policyName, const std::vector<CpuPair>& pairs)
+  {
+    PipeType* probe = newPipe<PipeType>();
+    const uint32_t maxSize = probe->getMaxPipeElementSize();
+    deletePipe(probe);
+
+    for (size_t p = 0; p < pairs.size(); ++p)
+    {
+      if (!wanted(options.pairs, pairs[p].name))
+      {
+        continue;
+      }
+      for (uint32_t size = MIN_MESSAGE_SIZE; ; size *= 8)
+      {
+        const uint32_t messageSize = size < maxSize ? size : maxSize;
+        runOne<PipeType>(policyName, pairs[p], messageSize);
+        if (messageSize == maxSize)
+        {
+          break;
+        }
+      }
+    }
+  }
+
+  template<class WakeupPolicy>
+  void runPolicy(const char* policyName, const std::vector<CpuPair>& pairs)
+  {
+    if (options.policy != "all" && options.policy != policyName)
+    {
+      return;
+    }
+    runPipe<Pipe::LocklessPipe<Message, 64 * 1024, WakeupPolicy> >(policyName, pairs);
+    runPipe<Pipe::LocklessPipe<Message, 1024 * 1024, WakeupPolicy> >(policyName, pairs);
+  }
+
+  void usage(const char* program)
+  {
+    fprintf(stderr,
+            "Usage: %s [--messages=<count>] [--policy=none|futex|adaptive|eventfd|all]\n"
+            "          [--pairs=unpinned,same-core,same-socket,cross-socket] [--histogram]\n",
+            program);
+  }
+
+  void collectOptions(int argc, char** argv)
+  {
+    static struct option long_options[] =
+    {
+      {"messages",  required_argument, 0, 'n'},
+      {"policy",    required_argument, 0, 'w'},
+      {"pairs",     required_argument, 0, 'p'},
+      {"histogram", no_argument,       0, 'H'},
+      {0,                           0, 0,   0}
+    };
+
+    options.messages = 200000;
+    options.policy = "all";
+    options.pairs = "unpinned,same-core,same-socket,cross-socket";
+    options.histogram = false;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:w:p:H", long_options, NULL)) != -1)
+    {
+      switch (c)
+      {
+        case 'n':
+          options.messages = strtoull(optarg, NULL, 10);
+          break;
+        case 'w':
+          options.policy = optarg;
+          break;
+        case 'p':
+          options.pairs = optarg;
+          break;
+        case 'H':
+          options.histogram = true;
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+  }
+
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+  collectOptions(argc, argv);
+
+  const std::vector<CpuPair> pairs = findCpuPairs();
+  for (size_t p = 0; p < pairs.size(); ++p)
+  {
+    if (pairs[p].writerCpu >= 0)
+    {
+      printf("%s: writer on CPU %d, reader on CPU %d\n",
+             pairs[p].name.c_str(), pairs[p].writerCpu, pairs[p].readerCpu);
+    }
+  }
+  printf("%llu messages per run\n\n", (unsigned long long)options.messages);
+
+  printf("%-9s %8s %-13s %8s %12s %10s %9s %9s %9s %11s\n",
+         "policy", "pipe", "cpus", "msgsize", "msgs/sec", "MB/sec",
+         "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+  runPolicy<Pipe::NoWakeupPolicy>("none", pairs);
+#ifdef __linux__
+  runPolicy<Pipe::FutexWakeupPolicy>("futex", pairs);
+  runPolicy<Pipe::AdaptiveWakeupPolicy>("adaptive", pairs);
+  runPolicy<Pipe::EventFdWakeupPolicy>("eventfd", pairs);
+#endif
+
+  return 0;
+}
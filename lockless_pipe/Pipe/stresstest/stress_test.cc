@@ -0,0 +1,1753 @@
+/******************************************************************************
+ * Concurrent stress test for LocklessPipe, MultiProducerPipe, BroadcastPipe
+ * and FixedSizePipe.
+ *
+ * One writer thread pushes numbered messages, one reader thread pops them and
+ * checks that they arrive in order, none is lost or repeated, and none is
+ * corrupted, while a third thread stops and restarts the writer and the
+ * reader at random.  For LocklessPipe it is run for every combination of
+ *
+ *   wakeup policy  NoWakeupPolicy, FutexWakeupPolicy, AdaptiveWakeupPolicy,
+ *                  EventFdWakeupPolicy (the last three on Linux only)
+ *   buffer policy  EmbeddedBuffer, MirroredBuffer, HeapBuffer (the last two
+ *                  on Linux only)
+ *
+ * MultiProducerPipe and BroadcastPipe are run with NoWakeupPolicy and
+ * FutexWakeupPolicy.  MultiProducerPipe has NUM_WRITERS writer threads.
+ * Each writer's messages form a stream of their own, with the writer in the
+ * top bits of the sequence number, and the reader checks each stream is in
+ * order.  BroadcastPipe has NUM_READERS reader threads, each of which checks
+ * that it sees every message, in order; the stopper stops one of them at a
+ * time.  FixedSizePipe is run with NoWakeupPolicy, FutexWakeupPolicy and
+ * AdaptiveWakeupPolicy, carrying the same messages in FIXED_MESSAGE_SIZE
+ * slots.
+ *
+ * A LocklessPipe is also run in a file, through PersistentPipeFactory, and
+ * in POSIX shared memory, through SharedPipeFactory, with NoWakeupPolicy,
+ * FutexWakeupPolicy and AdaptiveWakeupPolicy.  The persistent writer and
+ * reader each map the file for themselves, and now and then close their
+ * end part way through an element, as a crashed process would, and open it
+ * again; the reader must carry on from the last message it released, and
+ * both counts must be recovered exactly.  The shared pipe's writer is a
+ * child process that attaches to the region.  Both runs end by checking
+ * that a spoilt header, or a different pipe type, is refused.
+ *
+ * Every message carries its sequence number, its length and a checksum of a
+ * payload generated from the sequence number, so the reader can check all
+ * three.  Message sizes, and the push and pop calls used for each message
+ * (push, tryPush, pushFor, pushBatch, reserve/commit; pop, timedPop,
+ * popBatch, peekView/release, drain), are chosen at random, with a quarter
+ * of the messages within 64 bytes of MAX_PIPE_ELEMENT_SIZE.
+ *
+ * A writer or reader that is stopped catches Interrupted, waits to be
+ * started again, and carries on; after a stopped pushBatch the writer
+ * resumes from numWritten(), which counts what it did publish.  A run
+ * making no progress for 10 seconds is reported as hung.
+ *
+ * Any failure prints what went wrong and exits non-zero.  Build with
+ * -fsanitize=thread (make Pipe/stresstest/stress_test_tsan) to have
+ * ThreadSanitizer check the pipe's synchronisation as well.
+ *
+ * Options:
+ * --messages=<count>  (2000000 by default)
+ *  How many messages each writer pushes through the pipe in each run
+ * --pipe=(lockless|multi|broadcast|fixed|persistent|shared|all)
+ *  Which pipes to run
+ * --policy=(none|futex|adaptive|eventfd|all)
+ *  Which wakeup policies to run
+ * --buffer=(embedded|mirrored|heap|all)
+ *  Which buffer policies to run
+ * --stop-interval=<usecs>  (2000 by default, 0 for never)
+ *  The mean time between random stops of the writer or reader
+ * --seed=<n>
+ *  Seed for the random choices, to repeat a failing run
+ ******************************************************************************/
+
+#include "BroadcastPipe.hpp"
+#include "Errno.hh"
+#include "FixedSizePipe.hpp"
+#include "LocklessPipe.hpp"
+#include "MonotonicClock.hh"
+#include "MultiProducerPipe.hpp"
+#include "PersistentPipeFactory.hh"
+#include "SharedPipeFactory.hh"
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iostream>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+  /*
+   * The Data handle pushed through the pipe: just a pointer and a length.
+   */
+  class Message
+  {
+    public:
+      Message() : data_(NULL), length_(0) { }
+      Message(char* data, uint32_t length) : data_(data), length_(length) { }
+
+      const char* data() const { return data_; }
+      uint32_t length() const { return length_; }
+
+    private:
+      char*    data_;
+      uint32_t length_;
+  };
+
+  /*
+   * The start of every message.  The payload after it is generated from seq.
+   */
+  struct MessageHeader
+  {
+    uint64_t seq;
+    uint32_t length;
+    uint32_t checksum;
+  };
+
+  const uint32_t MIN_MESSAGE_SIZE = sizeof(MessageHeader);
+  const uint32_t PIPE_SIZE = 64 * 1024;
+  const uint32_t FIXED_MESSAGE_SIZE = 128;
+  const uint32_t FIXED_CAPACITY = 512;
+  const uint32_t MAX_BATCH = 16;
+  const uint32_t NUM_WRITERS = 3;
+  const uint32_t NUM_READERS = 3;
+  // A sequence number is the writer's stream in the top byte, and the
+  // message's place in that stream below it.
+  const uint32_t STREAM_SHIFT = 56;
+  const uint32_t MAX_STREAMS = 4;
+  const uint64_t HANG_NSECS = 10ULL * 1000 * 1000 * 1000;
+  // A persistent pipe's writer or reader reopens its end once in this many
+  // goes, and the writer syncs at most once per SYNC_INTERVAL_NSECS.
+  const uint32_t REOPEN_ODDS = 1024;
+  const uint64_t SYNC_INTERVAL_NSECS = 10ULL * 1000 * 1000;
+
+  /*
+   * The element of a FixedSizePipe: a message in a slot of its own, its
+   * length in its header.
+   */
+  struct FixedMessage
+  {
+    char bytes[FIXED_MESSAGE_SIZE];
+  };
+
+  /*
+   * The message in a slot, as the reader sees it.
+   */
+  Message messageIn(FixedMessage& slot)
+  {
+    MessageHeader header;
+    std::memcpy(&header, slot.bytes, sizeof(header));
+    return Message(slot.bytes, header.length < FIXED_MESSAGE_SIZE ? header.length : FIXED_MESSAGE_SIZE);
+  }
+
+  struct Options
+  {
+    uint64_t    messages;
+    std::string pipe;
+    std::string policy;
+    std::string buffer;
+    uint32_t    stopIntervalUsecs;
+    uint64_t    seed;
+  };
+
+  Options options;
+
+  bool wanted(const std::string& list, const std::string& item)
+  {
+    return list == "all" || ("," + list + ",").find("," + item + ",") != std::string::npos;
+  }
+
+  /*
+   * xorshift64*: small, fast and good enough to pick sizes and calls.
+   */
+  class Random
+  {
+    public:
+      explicit Random(uint64_t seed) : state_(seed * 0x9E3779B97F4A7C15ULL + 1) { }
+
+      uint64_t next() {
+        state_ ^= state_ >> 12;
+        state_ ^= state_ << 25;
+        state_ ^= state_ >> 27;
+        return state_ * 0x2545F4914F6CDD1DULL;
+      }
+      uint32_t below(uint32_t limit) {
+        return static_cast<uint32_t>(next() % limit);
+      }
+
+    private:
+      uint64_t state_;
+  };
+
+  /*
+   * The size of message 'seq', which the reader works out again to check it.
+   */
+  uint32_t messageSize(uint64_t seq, uint32_t maxSize)
+  {
+    Random random(seq ^ options.seed);
+    switch (random.below(4))
+    {
+      case 0:
+        return maxSize - random.below(64);
+      case 1:
+        return MIN_MESSAGE_SIZE + random.below(maxSize - MIN_MESSAGE_SIZE + 1);
+      default:
+      {
+        const uint32_t size = MIN_MESSAGE_SIZE + random.below(256);
+        return size < maxSize ? size : maxSize;
+      }
+    }
+  }
+
+  uint32_t checksum(const char* payload, uint32_t length)
+  {
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < length; ++i)
+    {
+      hash = (hash ^ static_cast<unsigned char>(payload[i])) * 16777619U;
+    }
+    return hash;
+  }
+
+  void fillPayload(uint64_t seq, char* payload, uint32_t length)
+  {
+    Random random(seq);
+    uint32_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+      const uint64_t bytes = random.next();
+      std::memcpy(&payload[i], &bytes, sizeof(bytes));
+    }
+    for (; i < length; ++i)
+    {
+      payload[i] = static_cast<char>(random.next() >> 56);
+    }
+  }
+
+  /*
+   * Build message 'seq' in 'buffer', which must hold maxSize bytes.
+   */
+  uint32_t buildMessage(uint64_t seq, uint32_t maxSize, char* buffer)
+  {
+    MessageHeader header;
+    header.seq = seq;
+    header.length = messageSize(seq, maxSize);
+    char* payload = buffer + sizeof(header);
+    const uint32_t payloadLength = header.length - MIN_MESSAGE_SIZE;
+    fillPayload(seq, payload, payloadLength);
+    header.checksum = checksum(payload, payloadLength);
+    std::memcpy(buffer, &header, sizeof(header));
+    return header.length;
+  }
+
+  template<class PipeType>
+  struct Run
+  {
+    const char*              name;
+    PipeType*                pipe;
+    uint32_t                 maxSize;
+    uint32_t                 numWriters;
+    uint32_t                 numReaders;
+    // One stream per writer, read by each reader.
+    uint32_t                 numStreams;
+    // The next sequence number each stream expects, within the stream,
+    // which is also how many of its messages have been checked.
+    Pipe::PipeAtomic<uint64_t> expected[MAX_STREAMS];
+    Pipe::PipeAtomic<bool>   done;
+    Pipe::PipeAtomic<uint64_t> numWriterStops;
+    Pipe::PipeAtomic<uint64_t> numReaderStops;
+  };
+
+  /*
+   * The sequence number of a stream's first message.  With one writer every
+   * stream, one per reader, is the same sequence.
+   */
+  template<class PipeType>
+  uint64_t firstSeq(const Run<PipeType>& run, uint32_t stream)
+  {
+    return run.numWriters > 1 ? static_cast<uint64_t>(stream) << STREAM_SHIFT : 0;
+  }
+
+  /*
+   * How many messages, over all the streams, have been checked.
+   */
+  template<class PipeType>
+  uint64_t numChecked(const Run<PipeType>& run)
+  {
+    uint64_t checked = 0;
+    for (uint32_t stream = 0; stream < run.numStreams; ++stream)
+    {
+      checked += run.expected[stream].load();
+    }
+    return checked;
+  }
+
+  template<class PipeType>
+  void fail(Run<PipeType>& run, const char* what, uint64_t seq)
+  {
+    fprintf(stderr, "%s: FAILED at message %llu: %s\n",
+            run.name, (unsigned long long)seq, what);
+    std::cerr << *run.pipe << std::endl;
+    exit(1);
+  }
+
+  /*
+   * Check one message of 'stream' as the reader sees it.
+   */
+  template<class PipeType>
+  void check(Run<PipeType>& run, const Message& message, uint32_t stream = 0)
+  {
+    const uint64_t expected = firstSeq(run, stream) + run.expected[stream].load();
+    if (message.length() < MIN_MESSAGE_SIZE)
+    {
+      fail(run, "message shorter than its header", expected);
+    }
+
+    MessageHeader header;
+    std::memcpy(&header, message.data(), sizeof(header));
+    if (header.seq < expected)
+    {
+      fail(run, "message repeated, or out of order", header.seq);
+    }
+    if (header.seq > expected)
+    {
+      fail(run, "message lost, or out of order", expected);
+    }
+    if (header.length != message.length() ||
+        header.length != messageSize(header.seq, run.maxSize))
+    {
+      fail(run, "wrong length", header.seq);
+    }
+    const char* payload = message.data() + sizeof(header);
+    if (header.checksum != checksum(payload, header.length - MIN_MESSAGE_SIZE))
+    {
+      fail(run, "checksum mismatch, payload corrupted", header.seq);
+    }
+
+    run.expected[stream].store(run.expected[stream].load() + 1);
+  }
+
+  /*
+   * The stream a message claims to be part of, failing if it is no stream.
+   */
+  template<class PipeType>
+  uint32_t streamOf(Run<PipeType>& run, const Message& message)
+  {
+    MessageHeader header;
+    if (message.length() < MIN_MESSAGE_SIZE)
+    {
+      fail(run, "message shorter than its header", numChecked(run));
+    }
+    std::memcpy(&header, message.data(), sizeof(header));
+    const uint64_t stream = header.seq >> STREAM_SHIFT;
+    if (stream >= run.numStreams)
+    {
+      fail(run, "message from no writer", header.seq);
+    }
+    return static_cast<uint32_t>(stream);
+  }
+
+  template<class PipeType>
+  struct CheckVisitor
+  {
+    Run<PipeType>* run;
+
+    void operator()(const Message& message) {
+      check(*run, message);
+    }
+  };
+
+  void pause()
+  {
+    usleep(10);
+  }
+
+  /*
+   * A writer or reader thread, and which one of its kind it is.
+   */
+  template<class PipeType>
+  struct Worker
+  {
+    Run<PipeType>* run;
+    uint32_t       index;
+  };
+
+  template<uint32_t SIZE, class WakeupPolicy, class BufferPolicy>
+  void write(Run<Pipe::LocklessPipe<Message, SIZE, WakeupPolicy, BufferPolicy> >& run, uint32_t)
+  {
+    Pipe::LocklessPipe<Message, SIZE, WakeupPolicy, BufferPolicy>& pipe = *run.pipe;
+    Random random(options.seed + 1);
+
+    std::vector<char> buffer(MAX_BATCH * run.maxSize);
+    std::vector<Message> batch(MAX_BATCH);
+
+    uint64_t seq = 0;
+    while (seq < options.messages)
+    {
+      try
+      {
+        switch (random.below(6))
+        {
+          case 0:
+          {
+            const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+            pipe.push(Message(&buffer[0], length));
+            ++seq;
+            break;
+          }
+          case 1:
+          {
+            const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+            if (pipe.tryPush(Message(&buffer[0], length)))
+            {
+              ++seq;
+            }
+            break;
+          }
+          case 2:
+          {
+            const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+            if (pipe.pushFor(Message(&buffer[0], length), random.below(100000)))
+            {
+              ++seq;
+            }
+            break;
+          }
+          case 3:
+          {
+            uint32_t count = 1 + random.below(MAX_BATCH);
+            if (count > options.messages - seq)
+            {
+              count = static_cast<uint32_t>(options.messages - seq);
+            }
+            for (uint32_t i = 0; i < count; ++i)
+            {
+              char* message = &buffer[i * run.maxSize];
+              batch[i] = Message(message, buildMessage(seq + i, run.maxSize, message));
+            }
+            pipe.pushBatch(&batch[0], count);
+            seq += count;
+            break;
+          }
+          default:
+          {
+            const uint32_t length = messageSize(seq, run.maxSize);
+            void* space = pipe.reserve(length);
+            if (space == NULL)
+            {
+              fail(run, "reserve returned NULL", seq);
+            }
+            buildMessage(seq, run.maxSize, static_cast<char*>(space));
+            pipe.commit();
+            ++seq;
+            break;
+          }
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        // Whatever was published before the stop is in the pipe; carry on
+        // from there.
+        seq = pipe.numWritten();
+        while (!pipe.isWriterRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  template<uint32_t SIZE, class WakeupPolicy, class BufferPolicy>
+  void read(Run<Pipe::LocklessPipe<Message, SIZE, WakeupPolicy, BufferPolicy> >& run, uint32_t)
+  {
+    typedef Pipe::LocklessPipe<Message, SIZE, WakeupPolicy, BufferPolicy> PipeType;
+    PipeType& pipe = *run.pipe;
+    Random random(options.seed + 2);
+
+    std::vector<char> buffer(MAX_BATCH * run.maxSize);
+    std::vector<Message> batch(MAX_BATCH);
+    CheckVisitor<PipeType> visitor = { &run };
+    Message message;
+
+    while (run.expected[0].load() < options.messages)
+    {
+      try
+      {
+        switch (random.below(5))
+        {
+          case 0:
+            pipe.pop(message, &buffer[0]);
+            check(run, message);
+            break;
+          case 1:
+            if (pipe.timedPop(message, &buffer[0], random.below(100000)))
+            {
+              check(run, message);
+            }
+            break;
+          case 2:
+          {
+            const uint32_t count = pipe.popBatch(&batch[0], 1 + random.below(MAX_BATCH),
+                                                 &buffer[0], static_cast<uint32_t>(buffer.size()));
+            for (uint32_t i = 0; i < count; ++i)
+            {
+              check(run, batch[i]);
+            }
+            break;
+          }
+          case 3:
+            pipe.peekView(message);
+            check(run, message);
+            pipe.release();
+            break;
+          default:
+            pipe.drain(visitor, 1 + random.below(4 * MAX_BATCH), random.below(100000));
+            break;
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        while (!pipe.isReaderRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  template<uint32_t SIZE, class WakeupPolicy, class BufferPolicy>
+  void checkEnd(Run<Pipe::LocklessPipe<Message, SIZE, WakeupPolicy, BufferPolicy> >& run)
+  {
+    Pipe::LocklessPipe<Message, SIZE, WakeupPolicy, BufferPolicy>& pipe = *run.pipe;
+    if (!pipe.isEmpty() || pipe.numWritten() != options.messages ||
+        pipe.numRead() != options.messages)
+    {
+      fail(run, "pipe not empty, or counts wrong, at the end", numChecked(run));
+    }
+    if (!pipe.validate(true))
+    {
+      fail(run, "validate() failed at the end", numChecked(run));
+    }
+  }
+
+  /*
+   * NUM_WRITERS writers each push their own stream with push(), tryPush()
+   * and reserve()/commit().
+   */
+  template<uint32_t SIZE, class WakeupPolicy>
+  void write(Run<Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy> >& run, uint32_t writer)
+  {
+    Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy>& pipe = *run.pipe;
+    Random random(options.seed + 1 + writer);
+
+    std::vector<char> buffer(run.maxSize);
+
+    const uint64_t first = firstSeq(run, writer);
+    uint64_t seq = first;
+    while (seq < first + options.messages)
+    {
+      try
+      {
+        switch (random.below(3))
+        {
+          case 0:
+          {
+            const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+            pipe.push(Message(&buffer[0], length));
+            ++seq;
+            break;
+          }
+          case 1:
+          {
+            const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+            if (pipe.tryPush(Message(&buffer[0], length)))
+            {
+              ++seq;
+            }
+            break;
+          }
+          default:
+          {
+            const uint32_t length = messageSize(seq, run.maxSize);
+            void* space = pipe.reserve(length, random.below(2) == 0);
+            if (space != NULL)
+            {
+              buildMessage(seq, run.maxSize, static_cast<char*>(space));
+              pipe.commit(space);
+              ++seq;
+            }
+            break;
+          }
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        // A stopped writer claims nothing, so the message is pushed again.
+        while (!pipe.isWriterRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  template<uint32_t SIZE, class WakeupPolicy>
+  void read(Run<Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy> >& run, uint32_t)
+  {
+    Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy>& pipe = *run.pipe;
+    Random random(options.seed + 2);
+
+    std::vector<char> buffer(run.maxSize);
+    Message message;
+
+    while (numChecked(run) < run.numStreams * options.messages)
+    {
+      try
+      {
+        if (random.below(2) == 0)
+        {
+          pipe.pop(message, &buffer[0]);
+          check(run, message, streamOf(run, message));
+        }
+        else if (pipe.tryPop(message, &buffer[0]))
+        {
+          check(run, message, streamOf(run, message));
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        while (!pipe.isReaderRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  template<uint32_t SIZE, class WakeupPolicy>
+  void checkEnd(Run<Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy> >& run)
+  {
+    Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy>& pipe = *run.pipe;
+    if (!pipe.isEmpty() || pipe.bytesClaimed() != 0 ||
+        pipe.numRead() != run.numStreams * options.messages)
+    {
+      fail(run, "pipe not empty, or counts wrong, at the end", numChecked(run));
+    }
+  }
+
+  /*
+   * One writer pushes with push(); it is the only push BroadcastPipe has.
+   */
+  template<uint32_t SIZE, uint32_t READERS, class WakeupPolicy>
+  void write(Run<Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy> >& run, uint32_t)
+  {
+    Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy>& pipe = *run.pipe;
+
+    std::vector<char> buffer(run.maxSize);
+
+    uint64_t seq = 0;
+    while (seq < options.messages)
+    {
+      try
+      {
+        const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+        pipe.push(Message(&buffer[0], length));
+        ++seq;
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        seq = pipe.numWritten();
+        while (!pipe.isWriterRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  /*
+   * Each reader checks the whole sequence as its own stream, with pop() and
+   * peekView()/release().
+   */
+  template<uint32_t SIZE, uint32_t READERS, class WakeupPolicy>
+  void read(Run<Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy> >& run, uint32_t reader)
+  {
+    Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy>& pipe = *run.pipe;
+    Random random(options.seed + 2 + reader);
+
+    std::vector<char> buffer(run.maxSize);
+    Message message;
+
+    while (run.expected[reader].load() < options.messages)
+    {
+      try
+      {
+        if (random.below(2) == 0)
+        {
+          pipe.pop(reader, message, &buffer[0]);
+          check(run, message, reader);
+        }
+        else
+        {
+          pipe.peekView(reader, message);
+          check(run, message, reader);
+          pipe.release(reader);
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        while (!pipe.isReaderRunning(reader))
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  template<uint32_t SIZE, uint32_t READERS, class WakeupPolicy>
+  void checkEnd(Run<Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy> >& run)
+  {
+    Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy>& pipe = *run.pipe;
+    if (pipe.numWritten() != options.messages || pipe.numFailedWrites() != 0)
+    {
+      fail(run, "counts wrong at the end", numChecked(run));
+    }
+    for (uint32_t reader = 0; reader < READERS; ++reader)
+    {
+      if (!pipe.isEmpty(reader) || pipe.numRead(reader) != options.messages)
+      {
+        fail(run, "a reader not caught up, or its count wrong, at the end", numChecked(run));
+      }
+    }
+  }
+
+  /*
+   * One writer pushes with push() and tryPush().
+   */
+  template<uint32_t CAPACITY, class WakeupPolicy>
+  void write(Run<Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy> >& run, uint32_t)
+  {
+    Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy>& pipe = *run.pipe;
+    Random random(options.seed + 1);
+
+    FixedMessage message;
+
+    uint64_t seq = 0;
+    while (seq < options.messages)
+    {
+      try
+      {
+        buildMessage(seq, run.maxSize, message.bytes);
+        if (random.below(2) == 0)
+        {
+          pipe.push(message);
+          ++seq;
+        }
+        else if (pipe.tryPush(message))
+        {
+          ++seq;
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        seq = pipe.numWritten();
+        while (!pipe.isWriterRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  /*
+   * The reader uses pop(), tryPop(), and front() before a tryPop().
+   */
+  template<uint32_t CAPACITY, class WakeupPolicy>
+  void read(Run<Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy> >& run, uint32_t)
+  {
+    Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy>& pipe = *run.pipe;
+    Random random(options.seed + 2);
+
+    FixedMessage message;
+
+    while (run.expected[0].load() < options.messages)
+    {
+      try
+      {
+        switch (random.below(3))
+        {
+          case 0:
+            pipe.pop(message);
+            check(run, messageIn(message));
+            break;
+          case 1:
+            if (pipe.tryPop(message))
+            {
+              check(run, messageIn(message));
+            }
+            break;
+          default:
+          {
+            FixedMessage* front = pipe.front();
+            if (front != NULL)
+            {
+              check(run, messageIn(*front));
+              pipe.tryPop(message);
+            }
+            break;
+          }
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        while (!pipe.isReaderRunning())
+        {
+          pause();
+        }
+      }
+    }
+  }
+
+  template<uint32_t CAPACITY, class WakeupPolicy>
+  void checkEnd(Run<Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy> >& run)
+  {
+    Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy>& pipe = *run.pipe;
+    if (!pipe.isEmpty() || pipe.numWritten() != options.messages ||
+        pipe.numRead() != options.messages)
+    {
+      fail(run, "pipe not empty, or counts wrong, at the end", numChecked(run));
+    }
+  }
+
+  template<class PipeType>
+  uint32_t numWriters(const PipeType&)
+  {
+    return 1;
+  }
+  template<uint32_t SIZE, class WakeupPolicy>
+  uint32_t numWriters(const Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy>&)
+  {
+    return NUM_WRITERS;
+  }
+
+  template<class PipeType>
+  uint32_t numReaders(const PipeType&)
+  {
+    return 1;
+  }
+  template<uint32_t SIZE, uint32_t READERS, class WakeupPolicy>
+  uint32_t numReaders(const Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy>&)
+  {
+    return READERS;
+  }
+
+  template<class PipeType>
+  uint32_t maxMessageSize(const PipeType& pipe)
+  {
+    return pipe.getMaxPipeElementSize();
+  }
+  /*
+   * MultiProducerPipe writers poll with usleep when the pipe is full, so
+   * keep its messages small enough for several to be in flight at once.
+   */
+  template<uint32_t SIZE, class WakeupPolicy>
+  uint32_t maxMessageSize(const Pipe::MultiProducerPipe<Message, SIZE, WakeupPolicy>& pipe)
+  {
+    return pipe.getMaxPipeElementSize() / 16;
+  }
+  template<uint32_t CAPACITY, class WakeupPolicy>
+  uint32_t maxMessageSize(const Pipe::FixedSizePipe<FixedMessage, CAPACITY, WakeupPolicy>&)
+  {
+    return FIXED_MESSAGE_SIZE;
+  }
+
+  template<class PipeType>
+  void* writer(void* arg)
+  {
+    Worker<PipeType>& worker = *static_cast<Worker<PipeType>*>(arg);
+    write(*worker.run, worker.index);
+    return NULL;
+  }
+
+  template<class PipeType>
+  void* reader(void* arg)
+  {
+    Worker<PipeType>& worker = *static_cast<Worker<PipeType>*>(arg);
+    read(*worker.run, worker.index);
+    return NULL;
+  }
+
+  template<class PipeType>
+  void stopAndStartReader(PipeType& pipe, Random& random)
+  {
+    pipe.stopReader();
+    usleep(random.below(100));
+    pipe.startReader();
+  }
+  template<uint32_t SIZE, uint32_t READERS, class WakeupPolicy>
+  void stopAndStartReader(Pipe::BroadcastPipe<Message, SIZE, READERS, WakeupPolicy>& pipe, Random& random)
+  {
+    const uint32_t reader = random.below(READERS);
+    pipe.stopReader(reader);
+    usleep(random.below(100));
+    pipe.startReader(reader);
+  }
+
+  /*
+   * Stops and restarts the writer or a reader at random until the run is
+   * done.
+   */
+  template<class PipeType>
+  void* stopper(void* arg)
+  {
+    Run<PipeType>& run = *static_cast<Run<PipeType>*>(arg);
+    PipeType& pipe = *run.pipe;
+    Random random(options.seed + 3);
+
+    while (!run.done.load())
+    {
+      usleep(random.below(2 * options.stopIntervalUsecs) + 1);
+      if (run.done.load())
+      {
+        break;
+      }
+      if (random.below(2) == 0)
+      {
+        pipe.stopWriter();
+        run.numWriterStops.store(run.numWriterStops.load() + 1);
+        usleep(random.below(100));
+        pipe.startWriter();
+      }
+      else
+      {
+        run.numReaderStops.store(run.numReaderStops.load() + 1);
+        stopAndStartReader(pipe, random);
+      }
+    }
+    return NULL;
+  }
+
+  /*
+   * The pipes are large and cache line aligned, which plain new does not
+   * promise before C++17.
+   */
+  template<class PipeType>
+  PipeType* newPipe()
+  {
+    void* memory = NULL;
+    if (posix_memalign(&memory, PIPE_CACHE_LINE_SIZE, sizeof(PipeType)) != 0)
+    {
+      perror("posix_memalign failed");
+      exit(1);
+    }
+    return new (memory) PipeType();
+  }
+
+  template<class PipeType>
+  void deletePipe(PipeType* pipe)
+  {
+    pipe->~PipeType();
+    free(pipe);
+  }
+
+  /*
+   * Wait for 'total' messages to be checked, failing if the run stops making
+   * progress: a lost wakeup, or a writer and reader each waiting for the
+   * other.
+   */
+  template<class PipeType>
+  void watch(Run<PipeType>& run, uint64_t total, uint64_t startNSecs)
+  {
+    uint64_t lastChecked = 0;
+    uint64_t lastProgressNSecs = startNSecs;
+    while (numChecked(run) < total)
+    {
+      usleep(100000);
+      const uint64_t checked = numChecked(run);
+      const uint64_t now = Pipe::monotonicNSecs();
+      if (checked != lastChecked)
+      {
+        lastChecked = checked;
+        lastProgressNSecs = now;
+      }
+      else if (now - lastProgressNSecs > HANG_NSECS)
+      {
+        fail(run, "no progress for 10 seconds, hung", checked);
+      }
+    }
+  }
+
+  template<class PipeType>
+  void runOne(const char* name)
+  {
+    Run<PipeType> run;
+    run.name = name;
+    run.pipe = newPipe<PipeType>();
+    run.maxSize = maxMessageSize(*run.pipe);
+    run.numWriters = numWriters(*run.pipe);
+    run.numReaders = numReaders(*run.pipe);
+    run.numStreams = run.numWriters * run.numReaders;
+    const uint64_t total = run.numStreams * options.messages;
+
+    const uint64_t startNSecs = Pipe::monotonicNSecs();
+
+    std::vector<Worker<PipeType> > writers(run.numWriters);
+    std::vector<Worker<PipeType> > readers(run.numReaders);
+    std::vector<pthread_t> writerThreads(run.numWriters);
+    std::vector<pthread_t> readerThreads(run.numReaders);
+    pthread_t stopperThread;
+    for (uint32_t i = 0; i < run.numReaders; ++i)
+    {
+      readers[i].run = &run;
+      readers[i].index = i;
+      if (pthread_create(&readerThreads[i], NULL, reader<PipeType>, &readers[i]) != 0)
+      {
+        perror("pthread_create failed");
+        exit(2);
+      }
+    }
+    for (uint32_t i = 0; i < run.numWriters; ++i)
+    {
+      writers[i].run = &run;
+      writers[i].index = i;
+      if (pthread_create(&writerThreads[i], NULL, writer<PipeType>, &writers[i]) != 0)
+      {
+        perror("pthread_create failed");
+        exit(2);
+      }
+    }
+    if (options.stopIntervalUsecs != 0 &&
+        pthread_create(&stopperThread, NULL, stopper<PipeType>, &run) != 0)
+    {
+      perror("pthread_create failed");
+      exit(2);
+    }
+
+    watch(run, total, startNSecs);
+
+    run.done.store(true);
+    for (uint32_t i = 0; i < run.numWriters; ++i)
+    {
+      pthread_join(writerThreads[i], NULL);
+    }
+    for (uint32_t i = 0; i < run.numReaders; ++i)
+    {
+      pthread_join(readerThreads[i], NULL);
+    }
+    if (options.stopIntervalUsecs != 0)
+    {
+      pthread_join(stopperThread, NULL);
+    }
+
+    checkEnd(run);
+
+    printf("%-20s %10llu messages %8.2f s  writer stops %6llu  reader stops %6llu  OK\n",
+           name, (unsigned long long)total, (Pipe::monotonicNSecs() - startNSecs) / 1e9,
+           (unsigned long long)run.numWriterStops.load(),
+           (unsigned long long)run.numReaderStops.load());
+
+    deletePipe(run.pipe);
+  }
+
+  template<class WakeupPolicy>
+  void runPolicy(const char* policyName)
+  {
+    if (!wanted(options.pipe, "lockless") || !wanted(options.policy, policyName))
+    {
+      return;
+    }
+    const std::string name(policyName);
+    if (wanted(options.buffer, "embedded"))
+    {
+      runOne<Pipe::LocklessPipe<Message, PIPE_SIZE, WakeupPolicy> >((name + "/embedded").c_str());
+    }
+#ifdef __linux__
+    if (wanted(options.buffer, "mirrored"))
+    {
+      runOne<Pipe::LocklessPipe<Message, PIPE_SIZE, WakeupPolicy,
+                                Pipe::MirroredBuffer<PIPE_SIZE> > >((name + "/mirrored").c_str());
+    }
+    if (wanted(options.buffer, "heap"))
+    {
+      runOne<Pipe::LocklessPipe<Message, PIPE_SIZE, WakeupPolicy,
+                                Pipe::HeapBuffer<PIPE_SIZE> > >((name + "/heap").c_str());
+    }
+#endif
+  }
+
+  /*
+   * Run one of the other pipes, named pipeName/policyName.
+   */
+  template<class PipeType>
+  void runPipe(const char* pipeName, const char* policyName)
+  {
+    if (wanted(options.pipe, pipeName) && wanted(options.policy, policyName))
+    {
+      runOne<PipeType>((std::string(pipeName) + "/" + policyName).c_str());
+    }
+  }
+
+  /*
+   * A name for this process's shared memory region or pipe file, so that
+   * two stress tests can run at once.
+   */
+  std::string uniqueName(const char* prefix, const char* policyName)
+  {
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%sstress_test.%ld.%s", prefix, static_cast<long>(getpid()), policyName);
+    return name;
+  }
+
+  /*
+   * Swap 'value' with the field of 'size' bytes at 'offset' in the header at
+   * the start of 'fd', to spoil a pipe's header and then put it back.
+   */
+  void swapHeaderField(int fd, size_t offset, void* value, size_t size)
+  {
+    char old[sizeof(uint64_t)];
+    if (pread(fd, old, size, static_cast<off_t>(offset)) != static_cast<ssize_t>(size) ||
+        pwrite(fd, value, size, static_cast<off_t>(offset)) != static_cast<ssize_t>(size))
+    {
+      perror("rewriting a pipe header failed");
+      exit(2);
+    }
+    std::memcpy(value, old, size);
+  }
+
+  /*
+   * A run of a pipe kept in a file by PersistentPipeFactory.  run.pipe is a
+   * mapping of its own, to check the pipe with; the writer and the reader
+   * each have another, as separate processes would, and now and then close
+   * it part way through an element and open their end again.  A side only
+   * reopens while the other is stopped and idle, so the counts it recovers
+   * can be checked exactly.
+   */
+  template<class PipeType>
+  struct PersistentRun : Run<PipeType>
+  {
+    std::string            path;
+    PipeType*              writerPipe;
+    PipeType*              readerPipe;
+    // Held by the side that is reopening, so the two never stop each other.
+    pthread_mutex_t        reopenLock;
+    Pipe::PipeAtomic<bool> writerIdle;
+    Pipe::PipeAtomic<bool> writerDone;
+    Pipe::PipeAtomic<bool> readerIdle;
+    Pipe::PipeAtomic<bool> readerDone;
+  };
+
+  template<class PipeType>
+  PipeType* openEnd(PersistentRun<PipeType>& run, Pipe::PipeEnd::Type end, bool* created = NULL)
+  {
+    try
+    {
+      return Pipe::PersistentPipeFactory<PipeType>::open(run.path, end, created);
+    }
+    catch (const Errno& e)
+    {
+      fprintf(stderr, "%s: FAILED: %s\n", run.name, e.what());
+      exit(1);
+    }
+  }
+
+  template<class PipeType>
+  void* persistentWriter(void* arg)
+  {
+    typedef Pipe::PersistentPipeFactory<PipeType> Factory;
+    PersistentRun<PipeType>& run = *static_cast<PersistentRun<PipeType>*>(arg);
+    Random random(options.seed + 4);
+    std::vector<char> buffer(run.maxSize);
+
+    uint64_t seq = 0;
+    while (seq < options.messages)
+    {
+      PipeType& pipe = *run.writerPipe;
+      try
+      {
+        if (random.below(REOPEN_ODDS) == 0 && pthread_mutex_trylock(&run.reopenLock) == 0)
+        {
+          // Sometimes die with an element reserved, which must be dropped.
+          if (random.below(2) == 0)
+          {
+            void* space = pipe.reserve(messageSize(seq, run.maxSize));
+            if (space == NULL)
+            {
+              fail(run, "reserve returned NULL", seq);
+            }
+            buildMessage(seq, run.maxSize, static_cast<char*>(space));
+          }
+          pipe.stopReader();
+          while (!run.readerIdle.load())
+          {
+            pause();
+          }
+
+          Factory::close(run.writerPipe);
+          run.writerPipe = openEnd(run, Pipe::PipeEnd::WRITER);
+          if (run.writerPipe->numWritten() != seq)
+          {
+            fail(run, "numWritten() wrong after reopening the writer", seq);
+          }
+          run.numWriterStops.store(run.numWriterStops.load() + 1);
+
+          run.writerPipe->startReader();
+          while (run.readerIdle.load() && !run.readerDone.load())
+          {
+            pause();
+          }
+          pthread_mutex_unlock(&run.reopenLock);
+          continue;
+        }
+
+        if (random.below(2) == 0)
+        {
+          const uint32_t length = buildMessage(seq, run.maxSize, &buffer[0]);
+          pipe.push(Message(&buffer[0], length));
+        }
+        else
+        {
+          void* space = pipe.reserve(messageSize(seq, run.maxSize));
+          if (space == NULL)
+          {
+            fail(run, "reserve returned NULL", seq);
+          }
+          buildMessage(seq, run.maxSize, static_cast<char*>(space));
+          pipe.commit();
+        }
+        ++seq;
+        Factory::syncIfDue(&pipe, SYNC_INTERVAL_NSECS);
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        // The reader is reopening its end.
+        run.writerIdle.store(true);
+        while (!run.writerPipe->isWriterRunning())
+        {
+          pause();
+        }
+        run.writerIdle.store(false);
+      }
+    }
+
+    run.writerDone.store(true);
+    run.writerIdle.store(true);
+    Factory::close(run.writerPipe);
+    return NULL;
+  }
+
+  template<class PipeType>
+  void* persistentReader(void* arg)
+  {
+    typedef Pipe::PersistentPipeFactory<PipeType> Factory;
+    PersistentRun<PipeType>& run = *static_cast<PersistentRun<PipeType>*>(arg);
+    Random random(options.seed + 5);
+    std::vector<char> buffer(run.maxSize);
+    Message message;
+
+    while (run.expected[0].load() < options.messages)
+    {
+      PipeType& pipe = *run.readerPipe;
+      try
+      {
+        if (random.below(REOPEN_ODDS) == 0 && pthread_mutex_trylock(&run.reopenLock) == 0)
+        {
+          // Sometimes die looking at an element, which must be read again.
+          if (random.below(2) == 0)
+          {
+            pipe.peekView(message);
+          }
+          pipe.stopWriter();
+          while (!run.writerIdle.load())
+          {
+            pause();
+          }
+
+          Factory::close(run.readerPipe);
+          run.readerPipe = openEnd(run, Pipe::PipeEnd::READER);
+          if (run.readerPipe->numRead() != run.expected[0].load())
+          {
+            fail(run, "numRead() wrong after reopening the reader", run.expected[0].load());
+          }
+          run.numReaderStops.store(run.numReaderStops.load() + 1);
+
+          run.readerPipe->startWriter();
+          while (run.writerIdle.load() && !run.writerDone.load())
+          {
+            pause();
+          }
+          pthread_mutex_unlock(&run.reopenLock);
+          continue;
+        }
+
+        if (random.below(2) == 0)
+        {
+          pipe.pop(message, &buffer[0]);
+          check(run, message);
+        }
+        else
+        {
+          pipe.peekView(message);
+          check(run, message);
+          pipe.release();
+        }
+      }
+      catch (const Pipe::Interrupted&)
+      {
+        // The writer is reopening its end.
+        run.readerIdle.store(true);
+        while (!run.readerPipe->isReaderRunning())
+        {
+          pause();
+        }
+        run.readerIdle.store(false);
+      }
+    }
+
+    run.readerDone.store(true);
+    run.readerIdle.store(true);
+    Factory::close(run.readerPipe);
+    return NULL;
+  }
+
+  /*
+   * The errno PersistentPipeFactory<PipeType>::open() refuses the file at
+   * 'path' with, or 0 if it opens it.
+   */
+  template<class PipeType>
+  int persistentOpenErrno(const std::string& path)
+  {
+    try
+    {
+      Pipe::PersistentPipeFactory<PipeType>::close(
+        Pipe::PersistentPipeFactory<PipeType>::open(path, Pipe::PipeEnd::READER));
+    }
+    catch (const Errno& e)
+    {
+      return e.getErrno();
+    }
+    return 0;
+  }
+
+  /*
+   * open() must refuse a file whose header is not one it wrote for this
+   * pipe type, and open one that is.
+   */
+  template<class PipeType>
+  void checkPersistentHeader(PersistentRun<PipeType>& run)
+  {
+    typedef Pipe::LocklessPipe<Message, PIPE_SIZE / 2, typename PipeType::WakeupPolicyType> OtherPipeType;
+    if (persistentOpenErrno<OtherPipeType>(run.path) != EINVAL)
+    {
+      fail(run, "open() did not refuse a different pipe type", numChecked(run));
+    }
+
+    const int fd = ::open(run.path.c_str(), O_RDWR);
+    if (fd == -1)
+    {
+      perror("opening the pipe file failed");
+      exit(2);
+    }
+    uint64_t magic = ~static_cast<uint64_t>(Pipe::PersistentPipeHeader::MAGIC);
+    swapHeaderField(fd, offsetof(Pipe::PersistentPipeHeader, magic), &magic, sizeof(magic));
+    if (persistentOpenErrno<PipeType>(run.path) != EINVAL)
+    {
+      fail(run, "open() did not refuse a bad magic number", numChecked(run));
+    }
+    swapHeaderField(fd, offsetof(Pipe::PersistentPipeHeader, magic), &magic, sizeof(magic));
+
+    uint32_t version = Pipe::PersistentPipeHeader::VERSION + 1;
+    swapHeaderField(fd, offsetof(Pipe::PersistentPipeHeader, version), &version, sizeof(version));
+    if (persistentOpenErrno<PipeType>(run.path) != EINVAL)
+    {
+      fail(run, "open() did not refuse a different header version", numChecked(run));
+    }
+    swapHeaderField(fd, offsetof(Pipe::PersistentPipeHeader, version), &version, sizeof(version));
+    close(fd);
+
+    if (persistentOpenErrno<PipeType>(run.path) != 0)
+    {
+      fail(run, "open() refused the pipe after its header was put back", numChecked(run));
+    }
+  }
+
+  /*
+   * Run a LocklessPipe kept in a file, named persistent/policyName.
+   */
+  template<class WakeupPolicy>
+  void runPersistent(const char* policyName)
+  {
+    typedef Pipe::LocklessPipe<Message, PIPE_SIZE, WakeupPolicy> PipeType;
+    typedef Pipe::PersistentPipeFactory<PipeType> Factory;
+    if (!wanted(options.pipe, "persistent") || !wanted(options.policy, policyName))
+    {
+      return;
+    }
+    const std::string name = std::string("persistent/") + policyName;
+    const char* tmpDir = getenv("TMPDIR");
+
+    PersistentRun<PipeType> run;
+    run.name = name.c_str();
+    run.path = uniqueName((std::string(tmpDir != NULL ? tmpDir : "/tmp") + "/").c_str(), policyName);
+    unlink(run.path.c_str());
+
+    bool created = false;
+    run.pipe = openEnd(run, Pipe::PipeEnd::BOTH, &created);
+    if (!created)
+    {
+      fail(run, "open() did not create the pipe", 0);
+    }
+    run.writerPipe = openEnd(run, Pipe::PipeEnd::WRITER);
+    run.readerPipe = openEnd(run, Pipe::PipeEnd::READER);
+    run.maxSize = maxMessageSize(*run.pipe);
+    run.numWriters = 1;
+    run.numReaders = 1;
+    run.numStreams = 1;
+    pthread_mutex_init(&run.reopenLock, NULL);
+
+    const uint64_t startNSecs = Pipe::monotonicNSecs();
+
+    pthread_t writerThread;
+    pthread_t readerThread;
+    if (pthread_create(&readerThread, NULL, persistentReader<PipeType>, &run) != 0 ||
+        pthread_create(&writerThread, NULL, persistentWriter<PipeType>, &run) != 0)
+    {
+      perror("pthread_create failed");
+      exit(2);
+    }
+
+    watch(run, options.messages, startNSecs);
+
+    run.done.store(true);
+    pthread_join(writerThread, NULL);
+    pthread_join(readerThread, NULL);
+
+    checkEnd(run);
+    checkPersistentHeader(run);
+
+    printf("%-20s %10llu messages %8.2f s  writer reopens %4llu  reader reopens %4llu  OK\n",
+           run.name, (unsigned long long)options.messages,
+           (Pipe::monotonicNSecs() - startNSecs) / 1e9,
+           (unsigned long long)run.numWriterStops.load(),
+           (unsigned long long)run.numReaderStops.load());
+
+    pthread_mutex_destroy(&run.reopenLock);
+    Factory::close(run.pipe);
+    Factory::unlink(run.path);
+  }
+
+  /*
+   * The errno SharedPipeFactory<PipeType>::attach() refuses the region
+   * 'name' with, or 0 if it attaches to it.
+   */
+  template<class PipeType>
+  int sharedAttachErrno(const std::string& name)
+  {
+    try
+    {
+      Pipe::SharedPipeFactory<PipeType>::detach(Pipe::SharedPipeFactory<PipeType>::attach(name));
+    }
+    catch (const Errno& e)
+    {
+      return e.getErrno();
+    }
+    return 0;
+  }
+
+  /*
+   * attach() must refuse a region that is missing, still being created, or
+   * not a pipe of this type, and attach to one that is.
+   */
+  template<class PipeType>
+  void checkSharedHeader(Run<PipeType>& run, const std::string& name)
+  {
+    typedef Pipe::LocklessPipe<Message, PIPE_SIZE / 2, typename PipeType::WakeupPolicyType> OtherPipeType;
+    if (sharedAttachErrno<PipeType>(name + ".missing") != ENOENT)
+    {
+      fail(run, "attach() did not refuse a missing region", numChecked(run));
+    }
+    if (sharedAttachErrno<OtherPipeType>(name) != EINVAL)
+    {
+      fail(run, "attach() did not refuse a different pipe type", numChecked(run));
+    }
+
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd == -1)
+    {
+      perror("opening the shared region failed");
+      exit(2);
+    }
+    uint64_t magic = 0;
+    swapHeaderField(fd, offsetof(Pipe::SharedPipeHeader, magic), &magic, sizeof(magic));
+    if (sharedAttachErrno<PipeType>(name) != EAGAIN)
+    {
+      fail(run, "attach() did not wait for a pipe still being created", numChecked(run));
+    }
+    swapHeaderField(fd, offsetof(Pipe::SharedPipeHeader, magic), &magic, sizeof(magic));
+
+    magic = ~static_cast<uint64_t>(Pipe::SharedPipeHeader::MAGIC);
+    swapHeaderField(fd, offsetof(Pipe::SharedPipeHeader, magic), &magic, sizeof(magic));
+    if (sharedAttachErrno<PipeType>(name) != EINVAL)
+    {
+      fail(run, "attach() did not refuse a bad magic number", numChecked(run));
+    }
+    swapHeaderField(fd, offsetof(Pipe::SharedPipeHeader, magic), &magic, sizeof(magic));
+
+    uint32_t version = Pipe::SharedPipeHeader::VERSION + 1;
+    swapHeaderField(fd, offsetof(Pipe::SharedPipeHeader, version), &version, sizeof(version));
+    if (sharedAttachErrno<PipeType>(name) != EINVAL)
+    {
+      fail(run, "attach() did not refuse a different header version", numChecked(run));
+    }
+    swapHeaderField(fd, offsetof(Pipe::SharedPipeHeader, version), &version, sizeof(version));
+    close(fd);
+
+    if (sharedAttachErrno<PipeType>(name) != 0)
+    {
+      fail(run, "attach() refused the pipe after its header was put back", numChecked(run));
+    }
+  }
+
+  /*
+   * Run a LocklessPipe in POSIX shared memory, named shared/policyName.  The
+   * writer is a child process that attaches to the pipe; the reader and the
+   * stopper are threads of the process that created it.
+   */
+  template<class WakeupPolicy>
+  void runShared(const char* policyName)
+  {
+    typedef Pipe::LocklessPipe<Message, PIPE_SIZE, WakeupPolicy> PipeType;
+    typedef Pipe::SharedPipeFactory<PipeType> Factory;
+    if (!wanted(options.pipe, "shared") || !wanted(options.policy, policyName))
+    {
+      return;
+    }
+    const std::string name = std::string("shared/") + policyName;
+    const std::string region = uniqueName("/", policyName);
+
+    Run<PipeType> run;
+    run.name = name.c_str();
+    shm_unlink(region.c_str());
+    try
+    {
+      run.pipe = Factory::create(region);
+    }
+    catch (const Errno& e)
+    {
+      fprintf(stderr, "%s: FAILED: %s\n", run.name, e.what());
+      exit(1);
+    }
+    run.maxSize = maxMessageSize(*run.pipe);
+    run.numWriters = 1;
+    run.numReaders = 1;
+    run.numStreams = 1;
+
+    const uint64_t startNSecs = Pipe::monotonicNSecs();
+
+    // Nothing buffered may be written twice, by both processes.
+    fflush(stdout);
+    const pid_t writerPid = fork();
+    if (writerPid == -1)
+    {
+      perror("fork failed");
+      exit(2);
+    }
+    if (writerPid == 0)
+    {
+      try
+      {
+        run.pipe = Factory::attach(region);
+      }
+      catch (const Errno& e)
+      {
+        fprintf(stderr, "%s: FAILED: %s\n", run.name, e.what());
+        _exit(1);
+      }
+      write(run, 0);
+      Factory::detach(run.pipe);
+      _exit(0);
+    }
+
+    Worker<PipeType> worker = { &run, 0 };
+    pthread_t readerThread;
+    pthread_t stopperThread;
+    if (pthread_create(&readerThread, NULL, reader<PipeType>, &worker) != 0 ||
+        (options.stopIntervalUsecs != 0 &&
+         pthread_create(&stopperThread, NULL, stopper<PipeType>, &run) != 0))
+    {
+      perror("pthread_create failed");
+      exit(2);
+    }
+
+    watch(run, options.messages, startNSecs);
+
+    run.done.store(true);
+    pthread_join(readerThread, NULL);
+    if (options.stopIntervalUsecs != 0)
+    {
+      pthread_join(stopperThread, NULL);
+    }
+    int status;
+    if (waitpid(writerPid, &status, 0) != writerPid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      fail(run, "the writer process failed", numChecked(run));
+    }
+
+    checkEnd(run);
+    checkSharedHeader(run, region);
+
+    printf("%-20s %10llu messages %8.2f s  writer stops %6llu  reader stops %6llu  OK\n",
+           run.name, (unsigned long long)options.messages,
+           (Pipe::monotonicNSecs() - startNSecs) / 1e9,
+           (unsigned long long)run.numWriterStops.load(),
+           (unsigned long long)run.numReaderStops.load());
+
+    Factory::detach(run.pipe);
+    Factory::unlink(region);
+  }
+
+#ifdef STRESS_TEST_UNSHAREABLE
+  /*
+   * The factories refuse, at compile time, a pipe whose buffer or wakeup
+   * policy cannot be shared between processes.  With STRESS_TEST_UNSHAREABLE
+   * set to 1 to 4 this must not compile; make check_unshareable tries each.
+   */
+  void unshareable()
+  {
+#if STRESS_TEST_UNSHAREABLE == 1
+    Pipe::SharedPipeFactory<Pipe::LocklessPipe<Message, PIPE_SIZE, Pipe::EventFdWakeupPolicy> >::create("/unshareable");
+#elif STRESS_TEST_UNSHAREABLE == 2
+    Pipe::SharedPipeFactory<Pipe::LocklessPipe<Message, PIPE_SIZE, Pipe::NoWakeupPolicy,
+                                               Pipe::MirroredBuffer<PIPE_SIZE> > >::create("/unshareable");
+#elif STRESS_TEST_UNSHAREABLE == 3
+    Pipe::PersistentPipeFactory<Pipe::LocklessPipe<Message, PIPE_SIZE, Pipe::EventFdWakeupPolicy> >::open("unshareable");
+#elif STRESS_TEST_UNSHAREABLE == 4
+    Pipe::PersistentPipeFactory<Pipe::LocklessPipe<Message, PIPE_SIZE, Pipe::NoWakeupPolicy,
+                                                   Pipe::HeapBuffer<PIPE_SIZE> > >::open("unshareable");
+#endif
+  }
+#endif
+
+  void usage(const char* program)
+  {
+    fprintf(stderr,
+            "Usage: %s [--messages=<count>]\n"
+            "          [--pipe=lockless|multi|broadcast|fixed|persistent|shared|all]\n"
+            "          [--policy=none|futex|adaptive|eventfd|all]\n"
+            "          [--buffer=embedded|mirrored|heap|all] [--stop-interval=<usecs>] [--seed=<n>]\n",
+            program);
+  }
+
+  void collectOptions(int argc, char** argv)
+  {
+    static struct option long_options[] =
+    {
+      {"messages",      required_argument, 0, 'n'},
+      {"pipe",          required_argument, 0, 'p'},
+      {"policy",        required_argument, 0, 'w'},
+      {"buffer",        required_argument, 0, 'b'},
+      {"stop-interval", required_argument, 0, 'i'},
+      {"seed",          required_argument, 0, 's'},
+      {0,                               0, 0,   0}
+    };
+
+    options.messages = 2000000;
+    options.pipe = "all";
+    options.policy = "all";
+    options.buffer = "all";
+    options.stopIntervalUsecs = 2000;
+    options.seed = static_cast<uint64_t>(time(NULL));
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:p:w:b:i:s:", long_options, NULL)) != -1)
+    {
+      switch (c)
+      {
+        case 'n':
+          options.messages = strtoull(optarg, NULL, 10);
+          break;
+        case 'p':
+          options.pipe = optarg;
+          break;
+        case 'w':
+          options.policy = optarg;
+          break;
+        case 'b':
+          options.buffer = optarg;
+          break;
+        case 'i':
+          options.stopIntervalUsecs = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+          break;
+        case 's':
+          options.seed = strtoull(optarg, NULL, 10);
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+  }
+
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+  collectOptions(argc, argv);
+
+  printf("%llu messages per run, seed %llu\n\n",
+         (unsigned long long)options.messages, (unsigned long long)options.seed);
+
+  runPolicy<Pipe::NoWakeupPolicy>("none");
+#ifdef __linux__
+  runPolicy<Pipe::FutexWakeupPolicy>("futex");
+  runPolicy<Pipe::AdaptiveWakeupPolicy>("adaptive");
+  runPolicy<Pipe::EventFdWakeupPolicy>("eventfd");
+#endif
+
+  runPipe<Pipe::MultiProducerPipe<Message, PIPE_SIZE, Pipe::NoWakeupPolicy> >("multi", "none");
+#ifdef __linux__
+  runPipe<Pipe::MultiProducerPipe<Message, PIPE_SIZE, Pipe::FutexWakeupPolicy> >("multi", "futex");
+#endif
+
+  runPipe<Pipe::BroadcastPipe<Message, PIPE_SIZE, NUM_READERS, Pipe::NoWakeupPolicy> >("broadcast", "none");
+#ifdef __linux__
+  runPipe<Pipe::BroadcastPipe<Message, PIPE_SIZE, NUM_READERS, Pipe::FutexWakeupPolicy> >("broadcast", "futex");
+#endif
+
+  runPipe<Pipe::FixedSizePipe<FixedMessage, FIXED_CAPACITY, Pipe::NoWakeupPolicy> >("fixed", "none");
+#ifdef __linux__
+  runPipe<Pipe::FixedSizePipe<FixedMessage, FIXED_CAPACITY, Pipe::FutexWakeupPolicy> >("fixed", "futex");
+  runPipe<Pipe::FixedSizePipe<FixedMessage, FIXED_CAPACITY, Pipe::AdaptiveWakeupPolicy> >("fixed", "adaptive");
+#endif
+
+  runPersistent<Pipe::NoWakeupPolicy>("none");
+#ifdef __linux__
+  runPersistent<Pipe::FutexWakeupPolicy>("futex");
+  runPersistent<Pipe::AdaptiveWakeupPolicy>("adaptive");
+#endif
+
+  runShared<Pipe::NoWakeupPolicy>("none");
+#ifdef __linux__
+  runShared<Pipe::FutexWakeupPolicy>("futex");
+  runShared<Pipe::AdaptiveWakeupPolicy>("adaptive");
+#endif
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+#ifndef PIPE_PIPEATOMIC_HH
+#define PIPE_PIPEATOMIC_HH
+
+#include "Utility.h"
+
+#if __cplusplus > 199711L
+#include <atomic>
+#else
+#include "MemoryFence.h"
+#endif
+
+namespace Pipe {
+
+  /*
+   * A word shared between the reader and the writer of a pipe.  Every access
+   * names its memory ordering, so the synchronisation is visible where it
+   * happens rather than hidden in a fence a few lines away:
+   *
+   *   load()/store()                  - no ordering (statistics, own fields)
+   *   loadAcquire()/storeRelease()    - publishing and consuming an index
+   *   fetchAdd()/compareExchange()    - sequentially consistent RMW
+   *
+   * With a C++11 compiler this is a std::atomic.  Acquire and release then
+   * compile to plain loads and stores on x86/SPARC TSO and to ldar/stlr on
+   * aarch64, with no full barrier on any of them, and ThreadSanitizer can see
+   * the happens-before edges.  Older compilers fall back to a volatile and the
+   * MemoryFence macros, which is what the pipe used before.
+   */
+  template<typename T>
+  class PipeAtomic
+  {
+    public:
+      explicit PipeAtomic(T value = T()) NO_THROW : value_(value) { }
+
+#if __cplusplus > 199711L
+      T load() const NO_THROW {
+        return value_.load(std::memory_order_relaxed);
+      }
+      T loadAcquire() const NO_THROW {
+        return value_.load(std::memory_order_acquire);
+      }
+      void store(T value) NO_THROW {
+        value_.store(value, std::memory_order_relaxed);
+      }
+      void storeRelease(T value) NO_THROW {
+        value_.store(value, std::memory_order_release);
+      }
+      T fetchAdd(T delta) NO_THROW {
+        return value_.fetch_add(delta);
+      }
+      bool compareExchange(T expected, T desired) NO_THROW {
+        return value_.compare_exchange_strong(expected, desired);
+      }
+      /*
+       * The address of the underlying word, e.g. for futex(2).
+       */
+      T* address() NO_THROW {
+        return reinterpret_cast<T*>(&value_);
+      }
+#else
+      T load() const NO_THROW {
+        return value_;
+      }
+      T loadAcquire() const NO_THROW {
+        const T value = value_;
+        MF_read_sync();
+        return value;
+      }
+      void store(T value) NO_THROW {
+        value_ = value;
+      }
+      void storeRelease(T value) NO_THROW {
+        MF_write_sync();
+        value_ = value;
+      }
+      T fetchAdd(T delta) NO_THROW {
+        return __sync_fetch_and_add(address(), delta);
+      }
+      bool compareExchange(T expected, T desired) NO_THROW {
+        return __sync_bool_compare_and_swap(address(), expected, desired);
+      }
+      T* address() NO_THROW {
+        return const_cast<T*>(&value_);
+      }
+#endif
+
+    private:
+#if __cplusplus > 199711L
+      std::atomic<T> value_;
+#else
+      volatile T value_;
+#endif
+
+      // Not copyable
+      PipeAtomic(const PipeAtomic&);
+      PipeAtomic& operator=(const PipeAtomic&);
+  };
+
+  /*
+   * A full (StoreLoad) fence, for the Dekker-style handshakes between a
+   * waiter raising a flag and a waker publishing an index.
+   */
+  inline void fullFence() NO_THROW
+  {
+#if __cplusplus > 199711L
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+#else
+    MF_full_sync();
+#endif
+  }
+
+} // Pipe
+
+#endif /* PIPE_PIPEATOMIC_HH */
@@ -0,0 +1,355 @@
+#ifndef PIPE_PIPEBUFFER_HH
+#define PIPE_PIPEBUFFER_HH
+
+#include "Errno.hh"
+#include "Utility.h"
+
+#include <stdint.h>                       // To get uint32_t
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Producer-owned and consumer-owned state each start on their own cache line,
+ * so a push and a pop running on different CPUs do not ping-pong one line.
+ * 128 covers x86 adjacent-line prefetch as well as SPARC/POWER; define it to
+ * 64 to trade some of that for a smaller pipe object.
+ *
+ * Ideally we'd use alignas(), but that isn't handled gracefully by all
+ * compilers (see mwait.cpp).
+ */
+#ifndef PIPE_CACHE_LINE_SIZE
+#define PIPE_CACHE_LINE_SIZE 128
+#endif
+#define PIPE_CALIGNED __attribute__ ((aligned(PIPE_CACHE_LINE_SIZE)))
+
+/*
+ * Ask for the cache line holding addr to be brought in for reading, without
+ * waiting for it.
+ */
+#if defined(__GNUC__)
+  #define PIPE_prefetch(addr) __builtin_prefetch((addr), 0, 3)
+#elif defined(__SUNPRO_CC) || defined(__SUNPRO_C)
+  #include <sun_prefetch.h>
+  #define PIPE_prefetch(addr) sun_prefetch_read_many(const_cast<char*>(addr))
+#else
+  #define PIPE_prefetch(addr) ((void)(addr))
+#endif
+
+namespace Pipe {
+
+  /*
+   * Buffer policies say where a LocklessPipe keeps its ring of elements.
+   *
+   * Each provides data(), the start of the ring, and MIRRORED, which is set
+   * when the SIZE bytes following data() + SIZE alias the ring itself.  With
+   * a mirrored ring an element may run past the end of the buffer and still
+   * be contiguous, so the pipe never has to skip the tail of the buffer.
+   * SHAREABLE is set when the ring is inside the pipe object, so a pipe
+   * placed in shared memory takes its ring with it.
+   */
+
+  /*
+   * The ring is a plain array inside the pipe object, so the pipe can be
+   * placed anywhere, including memory shared with other processes.  Elements
+   * never wrap, so the largest element is just under half the ring.
+   */
+  template<uint32_t SIZE>
+  class EmbeddedBuffer
+  {
+    public:
+      enum { MIRRORED = 0, SHAREABLE = 1 };
+
+      char* data() NO_THROW {
+        return buf_;
+      }
+
+    private:
+      // Starts on a fresh cache line, so the first elements do not share a
+      // line with the pipe's bookkeeping.
+      PIPE_CALIGNED char buf_[SIZE];
+  };
+
+#ifdef __linux__
+  /*
+   * The ring is one memfd mapped twice, back to back.  Any element up to
+   * (nearly) the full ring size is contiguous in memory, for push/pop and
+   * for the zero-copy reserve()/peekView() alike.
+   *
+   * SIZE must be a multiple of the page size.  As the mapping is private to
+   * the creating process, a pipe using this buffer cannot be shared between
+   * processes.
+   */
+  template<uint32_t SIZE>
+  class MirroredBuffer
+  {
+    public:
+      enum { MIRRORED = 1, SHAREABLE = 0 };
+
+      MirroredBuffer();
+      ~MirroredBuffer();
+
+      char* data() NO_THROW {
+        return base_;
+      }
+
+    private:
+      char* base_;
+
+      // Not copyable
+      MirroredBuffer(const MirroredBuffer&);
+      MirroredBuffer& operator=(const MirroredBuffer&);
+  };
+
+  template<uint32_t SIZE>
+  inline
+  MirroredBuffer<SIZE>::MirroredBuffer() :
+    base_(NULL)
+  {
+    if (SIZE % static_cast<uint32_t>(sysconf(_SC_PAGESIZE)) != 0)
+    {
+      throw Errno(EINVAL, "creating a MirroredBuffer") << " of " << SIZE
+                << " bytes, not a multiple of the page size";
+    }
+
+    const int fd = memfd_create("LocklessPipe", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+      throw Errno("returned from memfd_create");
+    }
+    if (ftruncate(fd, SIZE) != 0)
+    {
+      const Errno e("returned from ftruncate");
+      close(fd);
+      throw e;
+    }
+
+    // Reserve twice the address space, then map the file over both halves.
+    void* base = mmap(NULL, 2 * static_cast<size_t>(SIZE), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+      const Errno e("returned from mmap reserving the mirrored buffer");
+      close(fd);
+      throw e;
+    }
+    base_ = static_cast<char*>(base);
+
+    if (mmap(base_, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base_ + SIZE, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+      const Errno e("returned from mmap mapping the mirrored buffer");
+      munmap(base_, 2 * static_cast<size_t>(SIZE));
+      close(fd);
+      throw e;
+    }
+
+    // The mappings keep the file alive.
+    close(fd);
+  }
+
+  template<uint32_t SIZE>
+  inline
+  MirroredBuffer<SIZE>::~MirroredBuffer()
+  {
+    munmap(base_, 2 * static_cast<size_t>(SIZE));
+  }
+
+  namespace NumaNode {
+    // Bind to the node of the CPU the buffer is constructed on.
+    enum { LOCAL = -1 };
+  }
+
+  /*
+   * The ring is its own anonymous mapping, placed for the reader rather than
+   * wherever the pipe object happened to be allocated:
+   *
+   *   - It is backed by huge pages when it can be, to keep a multi-megabyte
+   *     ring to a handful of TLB entries: MAP_HUGETLB when there are enough
+   *     reserved huge pages, otherwise transparent huge pages (THP) through
+   *     MADV_HUGEPAGE on a mapping aligned to the huge page size.
+   *   - Its pages are bound with mbind(MPOL_BIND) to NUMA_NODE, by default
+   *     the node the buffer is constructed on.  Construct the pipe on the
+   *     reader's thread, or call bindToNode() from it, so the reader's loads
+   *     stay node-local; the writer's stores are the ones that cross nodes.
+   *   - Every page is touched on construction, after binding, so the first
+   *     elements through the pipe do not take page faults.
+   *
+   * The system calls are made directly, so there is no libnuma dependency.
+   * A kernel without NUMA support just leaves the pages where they land.
+   * As the mapping is private to the creating process, a pipe using this
+   * buffer cannot be shared between processes.
+   */
+  template<uint32_t SIZE, int NUMA_NODE = NumaNode::LOCAL>
+  class HeapBuffer
+  {
+    public:
+      enum { MIRRORED = 0, SHAREABLE = 0 };
+
+      /*
+       * \throws Errno if the ring cannot be mapped or bound
+       */
+      HeapBuffer();
+      ~HeapBuffer();
+
+      char* data() NO_THROW {
+        return base_;
+      }
+
+      /*
+       * Bind the ring to 'node', moving the pages already there.
+       * \param node a NUMA node, or NumaNode::LOCAL for the caller's node
+       * \throws Errno if the pages cannot be bound
+       */
+      void bindToNode(int node);
+
+      /*
+       * The node the ring was last bound to, or -1 without NUMA support.
+       */
+      int getNode() const NO_THROW {
+        return node_;
+      }
+      /*
+       * Is the ring in reserved (MAP_HUGETLB) huge pages?  If not, it is in
+       * transparent huge pages where the kernel could provide them.
+       */
+      bool isHugeTlb() const NO_THROW {
+        return hugeTlb_;
+      }
+
+    private:
+      // The default huge page size on x86-64 and 4K-page aarch64.
+      enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+      static const size_t MAPPING_SIZE =
+        (static_cast<size_t>(SIZE) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+      char* base_;
+      // Where the mapping really starts, and its length, for the THP case,
+      // which over-maps to find an aligned start.
+      void* mapping_;
+      size_t mappingLength_;
+      bool hugeTlb_;
+      int node_;
+
+      static int currentNode() NO_THROW;
+      void mbindTo(int node, unsigned flags);
+
+      // Not copyable
+      HeapBuffer(const HeapBuffer&);
+      HeapBuffer& operator=(const HeapBuffer&);
+  };
+
+  template<uint32_t SIZE, int NUMA_NODE>
+  inline
+  HeapBuffer<SIZE, NUMA_NODE>::HeapBuffer() :
+    base_(NULL),
+    mapping_(MAP_FAILED),
+    mappingLength_(0),
+    hugeTlb_(false),
+    node_(-1)
+  {
+    mapping_ = mmap(NULL, MAPPING_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping_ != MAP_FAILED)
+    {
+      hugeTlb_ = true;
+      mappingLength_ = MAPPING_SIZE;
+      base_ = static_cast<char*>(mapping_);
+    }
+    else
+    {
+      // No reserved huge pages: over-map by a huge page so the ring can start
+      // on a huge page boundary, which THP needs to back it.
+      mappingLength_ = MAPPING_SIZE + HUGE_PAGE_SIZE;
+      mapping_ = mmap(NULL, mappingLength_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mapping_ == MAP_FAILED)
+      {
+        throw Errno("returned from mmap allocating a HeapBuffer") << " of " << SIZE << " bytes";
+      }
+      const uintptr_t start = reinterpret_cast<uintptr_t>(mapping_);
+      base_ = reinterpret_cast<char*>((start + HUGE_PAGE_SIZE - 1) & ~static_cast<uintptr_t>(HUGE_PAGE_SIZE - 1));
+      // Only a hint; THP may be disabled.
+      madvise(base_, MAPPING_SIZE, MADV_HUGEPAGE);
+    }
+
+    try
+    {
+      mbindTo(NUMA_NODE == NumaNode::LOCAL ? currentNode() : NUMA_NODE, 0);
+    }
+    catch (...)
+    {
+      munmap(mapping_, mappingLength_);
+      throw;
+    }
+
+    // Prefault, now the policy says where the pages go.
+    const size_t pageSize = hugeTlb_ ? static_cast<size_t>(HUGE_PAGE_SIZE) :
+                                       static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (size_t offset = 0; offset < MAPPING_SIZE; offset += pageSize)
+    {
+      base_[offset] = 0;
+    }
+  }
+
+  template<uint32_t SIZE, int NUMA_NODE>
+  inline
+  HeapBuffer<SIZE, NUMA_NODE>::~HeapBuffer()
+  {
+    munmap(mapping_, mappingLength_);
+  }
+
+  template<uint32_t SIZE, int NUMA_NODE>
+  inline
+  void HeapBuffer<SIZE, NUMA_NODE>::bindToNode(int node)
+  {
+    mbindTo(node == NumaNode::LOCAL ? currentNode() : node, MPOL_MF_MOVE);
+  }
+
+  template<uint32_t SIZE, int NUMA_NODE>
+  inline
+  int HeapBuffer<SIZE, NUMA_NODE>::currentNode() NO_THROW
+  {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    {
+      return 0;
+    }
+    return static_cast<int>(node);
+  }
+
+  template<uint32_t SIZE, int NUMA_NODE>
+  inline
+  void HeapBuffer<SIZE, NUMA_NODE>::mbindTo(int node, unsigned flags)
+  {
+    enum { BITS_PER_WORD = 8 * sizeof(unsigned long), MAX_NODES = 1024 };
+    if (node < 0 || node >= MAX_NODES)
+    {
+      throw Errno(EINVAL, "binding a HeapBuffer") << " to NUMA node " << node;
+    }
+    unsigned long nodeMask[MAX_NODES / BITS_PER_WORD];
+    std::memset(nodeMask, 0, sizeof(nodeMask));
+    nodeMask[node / BITS_PER_WORD] = 1UL << (node % BITS_PER_WORD);
+
+    if (syscall(SYS_mbind, base_, MAPPING_SIZE, MPOL_BIND, nodeMask,
+                static_cast<unsigned long>(MAX_NODES), flags) != 0)
+    {
+      if (errno == ENOSYS)
+      {
+        // No NUMA support in this kernel, so nowhere else for the pages to be.
+        return;
+      }
+      throw Errno("returned from mbind") << " binding a HeapBuffer to NUMA node " << node;
+    }
+    node_ = node;
+  }
+#endif /* __linux__ */
+
+} // Pipe
+
+#endif /* PIPE_PIPEBUFFER_HH */
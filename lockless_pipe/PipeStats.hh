@@ -0,0 +1,98 @@
+#ifndef PIPE_PIPESTATS_HH
+#define PIPE_PIPESTATS_HH
+
+/*
+ * Hot path instrumentation for LocklessPipe, compiled in only when
+ * PIPE_INSTRUMENTATION is defined.  Without it the pipe's record header, its
+ * layout and its code are exactly as before.
+ */
+#ifdef PIPE_INSTRUMENTATION
+
+#include "LatencyHistogram.hh"
+#include "MonotonicClock.hh"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "Utility.h"
+
+#include <ostream>
+#include <stdint.h>                       // To get uint64_t
+
+namespace Pipe {
+
+  /*
+   * What an instrumented pipe records:
+   *
+   *   latency                 enqueue to dequeue, from a timestamp the writer
+   *                           puts in each element's header
+   *   occupancy high water    the most elements ever in the pipe, as seen by
+   *                           the writer when it publishes
+   *   full blocks             pushes that had to wait for room
+   *   empty waits             pops that had to wait for data
+   *
+   * The writer's and the reader's counters are on separate cache lines and
+   * each has a single writer.  All are relaxed PipeAtomics, so another thread
+   * can read them (and print the pipe) while it runs.
+   */
+  class PipeStats
+  {
+    public:
+      PipeStats() NO_THROW {
+        occupancyHighWater_.store(0);
+        numFullBlocks_.store(0);
+        numEmptyWaits_.store(0);
+      }
+
+      // Writer side
+      void recordOccupancy(uint64_t numElements) NO_THROW {
+        if (numElements > occupancyHighWater_.load())
+        {
+          occupancyHighWater_.store(numElements);
+        }
+      }
+      void countFullBlock() NO_THROW {
+        numFullBlocks_.store(numFullBlocks_.load() + 1);
+      }
+
+      // Reader side
+      void recordLatency(uint64_t enqueueNSecs) NO_THROW {
+        const uint64_t now = monotonicNSecs();
+        latency_.record(now > enqueueNSecs ? now - enqueueNSecs : 0);
+      }
+      void countEmptyWait() NO_THROW {
+        numEmptyWaits_.store(numEmptyWaits_.load() + 1);
+      }
+
+      uint64_t occupancyHighWater() const NO_THROW {
+        return occupancyHighWater_.load();
+      }
+      uint64_t numFullBlocks() const NO_THROW {
+        return numFullBlocks_.load();
+      }
+      uint64_t numEmptyWaits() const NO_THROW {
+        return numEmptyWaits_.load();
+      }
+      const LatencyHistogram& latency() const NO_THROW {
+        return latency_;
+      }
+
+      friend std::ostream& operator<<(std::ostream& os, const PipeStats& stats)
+      {
+        return os << "\tOccupancy high water mark   " << stats.occupancyHighWater() << "\n"
+                  << "\tNum Full Blocks             " << stats.numFullBlocks() << "\n"
+                  << "\tNum Empty Waits             " << stats.numEmptyWaits() << "\n"
+                  << "\tEnqueue to dequeue latency  " << stats.latency();
+      }
+
+    private:
+      PIPE_CALIGNED PipeAtomic<uint64_t> occupancyHighWater_;
+      PipeAtomic<uint64_t> numFullBlocks_;
+
+      PIPE_CALIGNED PipeAtomic<uint64_t> numEmptyWaits_;
+      LatencyHistogram latency_;
+  };
+
+} // Pipe
+
+#endif /* PIPE_INSTRUMENTATION */
+
+#endif /* PIPE_PIPESTATS_HH */
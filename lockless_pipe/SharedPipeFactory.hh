@@ -0,0 +1,287 @@
+#ifndef PIPE_SHAREDPIPEFACTORY_HH
+#define PIPE_SHAREDPIPEFACTORY_HH
+
+#include "Errno.hh"
+#include "LocklessPipe.hpp"
+#include "PipeAtomic.hh"
+#include "PipeBuffer.hh"
+#include "Utility.h"
+
+#include <fcntl.h>
+#include <new>
+#include <stdint.h>                       // To get uint32_t, uint64_t
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+namespace Pipe {
+
+  /*
+   * The start of every shared pipe region.  The creator fills it in and
+   * stores 'magic' last, so an attacher that sees MAGIC sees the rest of the
+   * header and a constructed pipe.
+   */
+  struct SharedPipeHeader
+  {
+    static const uint64_t MAGIC = 0x4C4B4C5350495045ULL;      // "LKLSPIPE"
+    enum { VERSION = 1 };
+
+    PipeAtomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t sharedType;
+    // The size of the whole mapping, header included.
+    uint64_t regionSize;
+    // What the creator's pipe type looked like, so an attacher compiled
+    // with a different one is turned away.
+    uint64_t pipeObjectSize;
+    uint32_t pipeSize;
+    uint32_t maxPipeElementSize;
+  };
+
+  /*
+   * Places a LocklessPipe in a named POSIX shared memory region, so the writer
+   * and the reader can be separate processes.
+   *
+   * The region is a SharedPipeHeader followed, on a fresh cache line, by the
+   * pipe itself.  create() constructs the pipe; attach() maps an existing
+   * one and refuses it unless the header matches this PipeType and the
+   * pipe's validate() (stomp canaries included) passes.  Each process calls
+   * detach() when done, and one of them unlink() to remove the name.
+   *
+   * With a hugePageDir (a hugetlbfs mount, such as /dev/hugepages) the region
+   * is a file in that directory instead of a shm_open() object, and is
+   * rounded up to the huge page size.
+   *
+   * The pipe must use an EmbeddedBuffer; the mappings of MirroredBuffer and
+   * HeapBuffer are private to one process.  NoWakeupPolicy, FutexWakeupPolicy
+   * and AdaptiveWakeupPolicy all work across processes; EventFdWakeupPolicy's
+   * fd does not.  Both are checked at compile time, through the policies'
+   * SHAREABLE.
+   */
+  template<class PipeType>
+  class SharedPipeFactory
+  {
+    public:
+      /*
+       * Create the region, which must not exist yet, and construct a pipe in
+       * it.
+       * \param name the shm_open() name, e.g. "/feed"
+       * \param hugePageDir the hugetlbfs mount to put the region on, or NULL
+       * \param mode the permissions of the new region
+       * \throws Errno if the region cannot be created or mapped
+       */
+      static PipeType* create(const std::string& name,
+                              const char* hugePageDir = NULL,
+                              mode_t mode = 0600);
+
+      /*
+       * Map the pipe another process created.
+       * \throws Errno if the region cannot be mapped, is still being created
+       *         (EAGAIN), or does not hold a valid pipe of this type (EINVAL)
+       */
+      static PipeType* attach(const std::string& name,
+                              const char* hugePageDir = NULL);
+
+      /*
+       * Unmap a pipe returned by create() or attach().  The pipe itself lives
+       * on for the other processes.
+       */
+      static void detach(PipeType* pipe) NO_THROW;
+
+      /*
+       * Remove the region's name.  Processes that have it mapped keep it
+       * until they detach.
+       * \throws Errno if the name cannot be removed
+       */
+      static void unlink(const std::string& name,
+                         const char* hugePageDir = NULL);
+
+    private:
+      CT_ASSERT(EmbeddedBufferOnly, PipeType::BufferPolicyType::SHAREABLE);
+      CT_ASSERT(ShareableWakeupPolicyOnly, PipeType::WakeupPolicyType::SHAREABLE);
+
+      enum {
+        PIPE_OFFSET = (sizeof(SharedPipeHeader) + PIPE_CACHE_LINE_SIZE - 1) /
+                      PIPE_CACHE_LINE_SIZE * PIPE_CACHE_LINE_SIZE
+      };
+
+      static int open(const std::string& name, const char* hugePageDir, int flags, mode_t mode);
+
+      static std::string hugePagePath(const std::string& name, const char* hugePageDir) {
+        return std::string(hugePageDir) + "/" +
+               (name.size() > 0 && name[0] == '/' ? name.substr(1) : name);
+      }
+
+      static int removeName(const std::string& name, const char* hugePageDir) {
+        return hugePageDir != NULL ?
+               ::unlink(hugePagePath(name, hugePageDir).c_str()) :
+               shm_unlink(name.c_str());
+      }
+
+      static SharedPipeHeader* headerOf(PipeType* pipe) NO_THROW {
+        return reinterpret_cast<SharedPipeHeader*>(reinterpret_cast<char*>(pipe) - PIPE_OFFSET);
+      }
+  };
+
+
+  template<class PipeType>
+  inline
+  int SharedPipeFactory<PipeType>::open(const std::string& name, const char* hugePageDir,
+                                        int flags, mode_t mode)
+  {
+    const int fd = hugePageDir != NULL ?
+                   ::open(hugePagePath(name, hugePageDir).c_str(), flags, mode) :
+                   shm_open(name.c_str(), flags, mode);
+    if (fd == -1)
+    {
+      throw Errno("opening shared pipe") << " " << name;
+    }
+    return fd;
+  }
+
+  template<class PipeType>
+  inline
+  PipeType* SharedPipeFactory<PipeType>::create(const std::string& name,
+                                                const char* hugePageDir,
+                                                mode_t mode)
+  {
+    const int fd = open(name, hugePageDir, O_RDWR | O_CREAT | O_EXCL, mode);
+
+    // Round the region up to the page size of the file system it lives on,
+    // which for hugetlbfs is the huge page size.
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    struct statvfs fs;
+    if (hugePageDir != NULL && fstatvfs(fd, &fs) == 0 && fs.f_bsize > pageSize)
+    {
+      pageSize = fs.f_bsize;
+    }
+    const size_t regionSize = (PIPE_OFFSET + sizeof(PipeType) + pageSize - 1) / pageSize * pageSize;
+
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(regionSize)) == 0)
+    {
+      base = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED)
+    {
+      Errno e("creating shared pipe");
+      close(fd);
+      removeName(name, hugePageDir);
+      throw e << " " << name << " of " << regionSize << " bytes";
+    }
+    // The mapping keeps the region alive.
+    close(fd);
+
+    SharedPipeHeader* header = new (base) SharedPipeHeader();
+    PipeType* pipe = new (static_cast<char*>(base) + PIPE_OFFSET) PipeType();
+
+    header->version = SharedPipeHeader::VERSION;
+    header->sharedType = SharedType::PROCESS_SHARED;
+    header->regionSize = regionSize;
+    header->pipeObjectSize = sizeof(PipeType);
+    header->pipeSize = pipe->getPipeSize();
+    header->maxPipeElementSize = pipe->getMaxPipeElementSize();
+
+    // Release: everything above is visible to an attacher that sees MAGIC.
+    header->magic.storeRelease(SharedPipeHeader::MAGIC);
+
+    return pipe;
+  }
+
+  template<class PipeType>
+  inline
+  PipeType* SharedPipeFactory<PipeType>::attach(const std::string& name,
+                                                const char* hugePageDir)
+  {
+    const int fd = open(name, hugePageDir, O_RDWR, 0);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      Errno e("attaching to shared pipe");
+      close(fd);
+      throw e << " " << name;
+    }
+    const size_t regionSize = static_cast<size_t>(st.st_size);
+    if (regionSize < PIPE_OFFSET + sizeof(PipeType))
+    {
+      close(fd);
+      throw Errno(st.st_size == 0 ? EAGAIN : EINVAL, "attaching to shared pipe")
+              << " " << name << " of " << regionSize << " bytes";
+    }
+
+    void* base = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+      Errno e("attaching to shared pipe");
+      close(fd);
+      throw e << " " << name;
+    }
+    close(fd);
+
+    SharedPipeHeader* header = static_cast<SharedPipeHeader*>(base);
+    PipeType* pipe = reinterpret_cast<PipeType*>(static_cast<char*>(base) + PIPE_OFFSET);
+
+    // Acquire: pairs with the creator's release of the magic number.
+    const uint64_t magic = header->magic.loadAcquire();
+    const char* problem = NULL;
+    int err = EINVAL;
+    if (magic == 0)
+    {
+      problem = "it is still being created";
+      err = EAGAIN;
+    }
+    else if (magic != SharedPipeHeader::MAGIC)
+    {
+      problem = "it is not a shared pipe";
+    }
+    else if (header->version != SharedPipeHeader::VERSION)
+    {
+      problem = "it has a different header version";
+    }
+    else if (header->sharedType != SharedType::PROCESS_SHARED ||
+             header->regionSize != regionSize ||
+             header->pipeObjectSize != sizeof(PipeType) ||
+             header->pipeSize != pipe->getPipeSize() ||
+             header->maxPipeElementSize != pipe->getMaxPipeElementSize())
+    {
+      problem = "it was created for a different pipe type";
+    }
+    else if (!pipe->validate(true))
+    {
+      problem = "the pipe failed validation";
+    }
+
+    if (problem != NULL)
+    {
+      munmap(base, regionSize);
+      throw Errno(err, "attaching to shared pipe") << " " << name << ", " << problem;
+    }
+
+    return pipe;
+  }
+
+  template<class PipeType>
+  inline
+  void SharedPipeFactory<PipeType>::detach(PipeType* pipe) NO_THROW
+  {
+    SharedPipeHeader* header = headerOf(pipe);
+    munmap(header, header->regionSize);
+  }
+
+  template<class PipeType>
+  inline
+  void SharedPipeFactory<PipeType>::unlink(const std::string& name,
+                                           const char* hugePageDir)
+  {
+    if (removeName(name, hugePageDir) != 0)
+    {
+      throw Errno("removing shared pipe") << " " << name;
+    }
+  }
+
+} // Pipe
+
+#endif /* PIPE_SHAREDPIPEFACTORY_HH */
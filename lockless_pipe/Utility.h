@@ -3,6 +3,7 @@
 
 #include <cstddef>     // for size_t
 #include <exception>
+#include <ios>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -230,5 +231,33 @@ template<size_t Size> size_t align_up(size_t value)
   return (value + (Size - 1)) & ~(Size - 1);
 }
 
+/*
+ * Saves the format flags, fill character and precision of a stream
+ * and restores them when it goes out of scope, so a print routine can
+ * switch to hex or change the width without leaking that to its caller.
+ */
+class StreamGuard
+{
+  public:
+    explicit StreamGuard(std::basic_ios<char>& stream)
+      : stream_(stream), flags_(stream.flags()), fill_(stream.fill()), precision_(stream.precision()) {}
+
+    ~StreamGuard()
+    {
+      stream_.flags(flags_);
+      stream_.fill(fill_);
+      stream_.precision(precision_);
+    }
+
+  private:
+    StreamGuard(const StreamGuard&);
+    StreamGuard& operator=(const StreamGuard&);
+
+    std::basic_ios<char>& stream_;
+    std::ios_base::fmtflags flags_;
+    char fill_;
+    std::streamsize precision_;
+};
+
 
 #endif /* UTILITY_H */